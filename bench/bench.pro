@@ -0,0 +1,20 @@
+#-------------------------------------------------
+#
+# Protocol layer benchmark, runs against pty simulator
+#
+#-------------------------------------------------
+
+QT       -= gui
+
+TARGET = stm32_isp_bench
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += main.cpp \
+    benchmark.cpp
+
+HEADERS  += benchmark.h
+
+include(../sim/sim.pri)
+include(../core.pri)
@@ -0,0 +1,237 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "benchmark.h"
+#include "comm.h"
+#include "simulator.h"
+#include <QElapsedTimer>
+#include <QTemporaryFile>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QTextStream>
+#include <algorithm>
+
+Benchmark::Benchmark(const BENCH_PARAMS &params, QObject *parent) :
+    QObject(parent),
+    params(params)
+{
+    comm = new Comm(this);
+    connect(comm, SIGNAL(log(LOG_TYPE,QString,Qt::GlobalColor)), this, SLOT(log(LOG_TYPE,QString,Qt::GlobalColor)));
+}
+
+Benchmark::~Benchmark()
+{
+}
+
+void Benchmark::log(LOG_TYPE type, const QString &text, Qt::GlobalColor color)
+{
+    Q_UNUSED(color);
+    if (!params.verbose && type != LOG_TYPE_ERROR)
+        return;
+    QTextStream(stderr) << text;
+}
+
+double Benchmark::percentile(QVector<double> samples, double p)
+{
+    if (samples.isEmpty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    //nearest rank
+    int rank = static_cast<int>(p * samples.size() + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    return samples.at(qMin(rank, samples.size()) - 1);
+}
+
+void Benchmark::add(const QString &name, unsigned int baud, unsigned int bytes, const QVector<double> &samples, bool wire)
+{
+    BENCH_RESULT res;
+    res.name = name;
+    res.baud = baud;
+    res.blockSize = comm->getBlockSize();
+    res.count = samples.size();
+    res.bytes = bytes;
+    res.total = 0;
+    foreach (double sample, samples)
+        res.total += sample;
+    res.p50 = percentile(samples, 0.50);
+    res.p95 = percentile(samples, 0.95);
+    res.p99 = percentile(samples, 0.99);
+    res.bytesPerSecond = res.total > 0 ? 1000.0 * bytes * res.count / res.total : 0;
+    res.efficiency = wire && baud ? res.bytesPerSecond * BITS_PER_CHAR / baud : 0;
+    results.append(res);
+}
+
+void Benchmark::runCommands(unsigned int baud)
+{
+    unsigned int blockSize = comm->getBlockSize();
+    QVector<double> samples;
+    QElapsedTimer timer;
+    unsigned int i;
+
+    for (i = 0; i < params.iterations; ++i)
+    {
+        timer.start();
+        comm->cmdReadMemory(params.addr + (i * blockSize) % params.size, blockSize);
+        samples.append(timer.nsecsElapsed() / 1000000.0);
+    }
+    add("read", baud, blockSize, samples);
+
+    //writes go to erased flash only, count is limited by range
+    comm->erase(params.addr, params.size);
+    QByteArray data(blockSize, 0x5a);
+    samples.clear();
+    for (i = 0; i < params.iterations && (i + 1) * blockSize <= params.size; ++i)
+    {
+        timer.start();
+        comm->cmdWriteMemory(params.addr + i * blockSize, data);
+        samples.append(timer.nsecsElapsed() / 1000000.0);
+    }
+    add("write", baud, blockSize, samples);
+
+    const SECTOR sector = comm->getDevice().sectors(params.addr, 1).first();
+    QVector<unsigned int> pages;
+    pages.append(sector.index);
+    samples.clear();
+    for (i = 0; i < params.iterations; ++i)
+    {
+        timer.start();
+        if (comm->isExtendedErase())
+            comm->cmdEraseMemoryEx(pages);
+        else
+            comm->cmdEraseMemory(pages);
+        samples.append(timer.nsecsElapsed() / 1000000.0);
+    }
+    add("erase_page", baud, sector.size, samples, false);
+}
+
+void Benchmark::runCycles(unsigned int baud)
+{
+    QVector<double> erase, flash, verify, dump;
+    QElapsedTimer timer;
+    QByteArray data(params.size, 0);
+    for (unsigned int i = 0; i < params.size; ++i)
+        data[i] = static_cast<char>(i * 7 + (i >> 8));
+    QTemporaryFile file;
+    if (!file.open())
+        throw ErrorFileCreate();
+    file.close();
+
+    for (unsigned int i = 0; i < params.cycles; ++i)
+    {
+        timer.start();
+        comm->erase(params.addr, params.size);
+        erase.append(timer.nsecsElapsed() / 1000000.0);
+
+        timer.start();
+        comm->flash(data, params.addr, false);
+        flash.append(timer.nsecsElapsed() / 1000000.0);
+
+        timer.start();
+        comm->verify(data, params.addr);
+        verify.append(timer.nsecsElapsed() / 1000000.0);
+
+        timer.start();
+        comm->dump(file.fileName(), params.addr, params.size);
+        dump.append(timer.nsecsElapsed() / 1000000.0);
+    }
+    add("erase_range", baud, params.size, erase, false);
+    add("flash", baud, params.size, flash);
+    add("verify", baud, params.size, verify);
+    add("dump", baud, params.size, dump);
+}
+
+void Benchmark::runBaud(unsigned int baud)
+{
+    Simulator* sim = 0;
+    QString port = params.port;
+    if (port.isEmpty())
+    {
+        SIM_CONFIG config = Simulator::defaultConfig();
+        config.baud = baud;
+        sim = new Simulator(config, this);
+        port = sim->open();
+        sim->start();
+        comm->setStubImage(Simulator::stubImage(config.device));
+    }
+    comm->setStubEnabled(params.stub);
+    try
+    {
+        comm->open(port, baud);
+        foreach (unsigned int blockSize, params.blockSizes)
+        {
+            comm->setBlockSize(blockSize);
+            //bootloader commands would leave loader
+            if (!comm->isStubActive())
+                runCommands(baud);
+            runCycles(baud);
+        }
+        comm->close();
+    }
+    catch (...)
+    {
+        comm->close();
+        delete sim;
+        throw;
+    }
+    delete sim;
+}
+
+void Benchmark::run()
+{
+    results.clear();
+    foreach (unsigned int baud, params.bauds)
+        runBaud(baud);
+}
+
+QString Benchmark::toCsv() const
+{
+    QString res;
+    QTextStream out(&res);
+    out << "name,baud,block,count,bytes,total_ms,p50_ms,p95_ms,p99_ms,bytes_per_s,efficiency\n";
+    foreach (const BENCH_RESULT& r, results)
+        out << r.name << ',' << r.baud << ',' << r.blockSize << ',' << r.count << ',' << r.bytes << ','
+            << QString::number(r.total, 'f', 3) << ',' << QString::number(r.p50, 'f', 3) << ','
+            << QString::number(r.p95, 'f', 3) << ',' << QString::number(r.p99, 'f', 3) << ','
+            << QString::number(r.bytesPerSecond, 'f', 0) << ',' << QString::number(r.efficiency, 'f', 3) << '\n';
+    return res;
+}
+
+QString Benchmark::toJson() const
+{
+    QJsonArray list;
+    foreach (const BENCH_RESULT& r, results)
+    {
+        QJsonObject obj;
+        obj["name"] = r.name;
+        obj["baud"] = static_cast<int>(r.baud);
+        obj["block"] = static_cast<int>(r.blockSize);
+        obj["count"] = static_cast<int>(r.count);
+        obj["bytes"] = static_cast<int>(r.bytes);
+        obj["totalMs"] = r.total;
+        obj["p50Ms"] = r.p50;
+        obj["p95Ms"] = r.p95;
+        obj["p99Ms"] = r.p99;
+        obj["bytesPerSecond"] = r.bytesPerSecond;
+        obj["efficiency"] = r.efficiency;
+        list.append(obj);
+    }
+    return QJsonDocument(list).toJson(QJsonDocument::Indented);
+}
+
+QString Benchmark::toTable() const
+{
+    QString res;
+    QTextStream out(&res);
+    out << QString("%1 %2 %3 %4 %5 %6 %7 %8\n").arg("command", -12).arg("baud", 8).arg("block", 6).arg("B/s", 9)
+           .arg("eff", 6).arg("p50 ms", 9).arg("p95 ms", 9).arg("p99 ms", 9);
+    foreach (const BENCH_RESULT& r, results)
+        out << QString("%1 %2 %3 %4 %5 %6 %7 %8\n").arg(r.name, -12).arg(r.baud, 8).arg(r.blockSize, 6)
+               .arg(r.bytesPerSecond, 9, 'f', 0).arg(r.efficiency, 6, 'f', 3)
+               .arg(r.p50, 9, 'f', 3).arg(r.p95, 9, 'f', 3).arg(r.p99, 9, 'f', 3);
+    return res;
+}
@@ -0,0 +1,73 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QObject>
+#include <QList>
+#include <QVector>
+#include <QString>
+#include "common.h"
+
+class Comm;
+class Simulator;
+
+typedef struct {
+    QString name;
+    unsigned int baud;
+    unsigned int blockSize;
+    unsigned int count;
+    //payload bytes per run
+    unsigned int bytes;
+    //ms
+    double total, p50, p95, p99;
+    double bytesPerSecond;
+    //relative to raw line rate, 8E1
+    double efficiency;
+} BENCH_RESULT;
+
+typedef struct {
+    QString port;
+    QVector<unsigned int> bauds;
+    QVector<unsigned int> blockSizes;
+    //per command and per full cycle
+    unsigned int iterations;
+    unsigned int cycles;
+    unsigned int addr;
+    unsigned int size;
+    //cycles through RAM flash loader, single commands are skipped
+    bool stub;
+    bool verbose;
+} BENCH_PARAMS;
+
+class Benchmark : public QObject
+{
+    Q_OBJECT
+private:
+    BENCH_PARAMS params;
+    Comm* comm;
+    QList<BENCH_RESULT> results;
+
+    static double percentile(QVector<double> samples, double p);
+    void add(const QString& name, unsigned int baud, unsigned int bytes, const QVector<double>& samples, bool wire = true);
+    void runCommands(unsigned int baud);
+    void runCycles(unsigned int baud);
+    void runBaud(unsigned int baud);
+public:
+    explicit Benchmark(const BENCH_PARAMS& params, QObject *parent = 0);
+    virtual ~Benchmark();
+
+    void run();
+    const QList<BENCH_RESULT>& getResults() const {return results;}
+    QString toCsv() const;
+    QString toJson() const;
+    QString toTable() const;
+private slots:
+    void log(LOG_TYPE type, const QString& text, Qt::GlobalColor color);
+};
+
+#endif // BENCHMARK_H
@@ -0,0 +1,98 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "benchmark.h"
+#include "comm.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QTextStream>
+
+static QVector<unsigned int> numbers(const QString& str)
+{
+    QVector<unsigned int> res;
+    foreach (const QString& item, str.split(',', QString::SkipEmptyParts))
+        res.append(item.toUInt(0, 0));
+    return res;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("stm32_isp_bench");
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QObject::tr("Protocol layer benchmark. Runs against built-in pty simulator unless port is set."));
+    parser.addHelpOption();
+    QCommandLineOption portOption(QStringList() << "p" << "port", QObject::tr("Serial port of real device or loopback"), "port");
+    QCommandLineOption baudOption(QStringList() << "b" << "baud", QObject::tr("Comma separated baud rates"), "list", "57600,115200");
+    QCommandLineOption blockOption("block", QObject::tr("Comma separated block sizes"), "list", "64,128,256");
+    QCommandLineOption iterationsOption(QStringList() << "n" << "iterations", QObject::tr("Samples per command"), "count", "100");
+    QCommandLineOption cyclesOption("cycles", QObject::tr("Full erase/flash/verify/dump cycles"), "count", "3");
+    QCommandLineOption addrOption(QStringList() << "a" << "address", QObject::tr("Start address, hex"), "address", "08000000");
+    QCommandLineOption sizeOption(QStringList() << "s" << "size", QObject::tr("Range size, hex"), "size", "4000");
+    QCommandLineOption formatOption(QStringList() << "f" << "format", QObject::tr("Baseline format: csv or json"), "format", "csv");
+    QCommandLineOption outputOption(QStringList() << "o" << "output", QObject::tr("Baseline file, stdout by default"), "file");
+    QCommandLineOption stubOption("stub", QObject::tr("Run cycles through RAM flash loader"));
+    QCommandLineOption verboseOption(QStringList() << "v" << "verbose", QObject::tr("Print protocol log"));
+    parser.addOption(portOption);
+    parser.addOption(baudOption);
+    parser.addOption(blockOption);
+    parser.addOption(iterationsOption);
+    parser.addOption(cyclesOption);
+    parser.addOption(addrOption);
+    parser.addOption(sizeOption);
+    parser.addOption(formatOption);
+    parser.addOption(outputOption);
+    parser.addOption(stubOption);
+    parser.addOption(verboseOption);
+    parser.process(a);
+
+    BENCH_PARAMS params;
+    params.port = parser.value(portOption);
+    params.bauds = numbers(parser.value(baudOption));
+    params.blockSizes = numbers(parser.value(blockOption));
+    params.iterations = parser.value(iterationsOption).toUInt();
+    params.cycles = parser.value(cyclesOption).toUInt();
+    params.addr = parser.value(addrOption).toUInt(0, 16);
+    params.size = parser.value(sizeOption).toUInt(0, 16);
+    params.stub = parser.isSet(stubOption);
+    params.verbose = parser.isSet(verboseOption);
+    if (params.bauds.isEmpty() || params.blockSizes.isEmpty() || !params.size)
+    {
+        err << parser.helpText();
+        return 1;
+    }
+
+    Benchmark bench(params);
+    try
+    {
+        bench.run();
+    }
+    catch (Exception& e)
+    {
+        err << e.what() << endl;
+        return 1;
+    }
+    err << bench.toTable();
+
+    QString baseline = parser.value(formatOption) == "json" ? bench.toJson() : bench.toCsv();
+    if (parser.isSet(outputOption))
+    {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        {
+            err << ErrorFileCreate().what() << endl;
+            return 1;
+        }
+        file.write(baseline.toUtf8());
+    }
+    else
+        out << baseline;
+    return 0;
+}
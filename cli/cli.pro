@@ -0,0 +1,19 @@
+#-------------------------------------------------
+#
+# Headless console flasher, no QtGui/QtWidgets
+#
+#-------------------------------------------------
+
+QT       -= gui
+
+TARGET = stm32_isp_cli
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += main.cpp \
+    console.cpp
+
+HEADERS  += console.h
+
+include(../core.pri)
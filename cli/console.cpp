@@ -0,0 +1,435 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "console.h"
+#include "comm.h"
+#include "config.h"
+#include "error.h"
+#include "gang.h"
+#include "firmware.h"
+#include "recipe.h"
+#include <QFile>
+#include <QCommandLineParser>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <stdio.h>
+
+Console::Console(QObject *parent) :
+    QObject(parent),
+    speed(115200),
+    addr(FLASH_BASE),
+    size(0),
+    verbose(false),
+    verify(true),
+    diff(false),
+    wipe(false),
+    dryRun(false),
+    noErase(false),
+    go(false),
+    stub(false),
+    jobs(0),
+    dumper(0)
+{
+    comm = new Comm(this);
+    connect(comm, SIGNAL(log(LOG_TYPE,QString,Qt::GlobalColor)), this, SLOT(log(LOG_TYPE,QString,Qt::GlobalColor)));
+}
+
+Console::~Console()
+{
+    delete comm;
+}
+
+void Console::log(LOG_TYPE type, const QString &text, Qt::GlobalColor color)
+{
+    Q_UNUSED(color);
+    //stdout is reserved for JSON result
+    QTextStream err(stderr);
+    switch (type)
+    {
+    case LOG_TYPE_WARNING:
+        err << tr("Warning: ") << text;
+        break;
+    case LOG_TYPE_ERROR:
+        err << tr("Error: ") << text;
+        break;
+    case LOG_TYPE_DEBUG:
+        if (verbose)
+            err << "> " << text;
+        break;
+    default:
+        err << text;
+        break;
+    }
+}
+
+int Console::exitCode(Exception &e)
+{
+    if (dynamic_cast<ErrorProtocolVerify*>(&e))
+        return CLI_EXIT_VERIFY;
+    if (dynamic_cast<ErrorProtocolReadProtection*>(&e) || dynamic_cast<ErrorProtocolWriteProtection*>(&e))
+        return CLI_EXIT_PROTECTED;
+    if (dynamic_cast<ErrorProtocol*>(&e))
+        return CLI_EXIT_PROTOCOL;
+    if (dynamic_cast<ErrorPort*>(&e) || dynamic_cast<ErrorPortOpen*>(&e) || dynamic_cast<ErrorPortTimeout*>(&e) || dynamic_cast<ErrorNotActive*>(&e))
+        return CLI_EXIT_PORT;
+    if (dynamic_cast<ErrorFile*>(&e))
+        return CLI_EXIT_FILE;
+    if (dynamic_cast<ErrorDeviceRange*>(&e))
+        return CLI_EXIT_RANGE;
+    if (dynamic_cast<ErrorCancel*>(&e))
+        return CLI_EXIT_CANCEL;
+    if (dynamic_cast<ErrorGang*>(&e))
+        return CLI_EXIT_GANG;
+    return CLI_EXIT_INTERNAL;
+}
+
+int Console::usageError(const QString &error)
+{
+    QTextStream(stderr) << error << "\n";
+    result["status"] = "error";
+    result["code"] = CLI_EXIT_USAGE;
+    result["error"] = error;
+    QTextStream(stdout) << QJsonDocument(result).toJson(QJsonDocument::Compact) << "\n";
+    return CLI_EXIT_USAGE;
+}
+
+QByteArray Console::stubImage() const
+{
+    if (stubFile.isEmpty())
+        return QByteArray();
+    QFile file(stubFile);
+    if (!file.open(QIODevice::ReadOnly))
+        throw ErrorFileOpen();
+    return file.readAll();
+}
+
+void Console::open()
+{
+    comm->setStubEnabled(stub);
+    comm->setStubImage(stubImage());
+    comm->open(port, speed);
+    const Device& device = comm->getDevice();
+    result["pid"] = QString("0x%1").arg(device.pid, 4, 16, QChar('0'));
+    result["device"] = device.name;
+    result["flashSize"] = static_cast<int>(device.flashSize);
+    result["speed"] = static_cast<int>(comm->getSpeed());
+    result["loader"] = QString("%1.%2").arg(comm->getLoaderVersion() >> 4).arg(comm->getLoaderVersion() & 0xf);
+    if (stub)
+        result["stub"] = comm->isStubActive();
+}
+
+void Console::runGang(const QString &fileName)
+{
+    QStringList ports(port.isEmpty() || port == "all" ? Comm::ports() : port.split(',', QString::SkipEmptyParts));
+    //one mapping or parse shared by all ports
+    Firmware firmware;
+    firmware.load(fileName, addr);
+
+    GANG_PARAMS params;
+    params.speed = speed;
+    params.addr = addr;
+    params.eraseSize = size;
+    params.verify = verify;
+    params.diff = diff;
+    params.wipe = wipe;
+    params.go = go;
+    params.stub = stub;
+    params.stubImage = stubImage();
+    params.blockSize = comm->getBlockSize();
+    params.deferredVerify = comm->isDeferredVerify();
+    params.checksumVerify = comm->isChecksumVerify();
+    params.compress = comm->isCompress();
+    params.resetLines = comm->isResetLines();
+    params.devicesFile = devicesFile;
+    params.metrics = dumper;
+    Gang gang;
+    if (jobs > 0)
+        gang.setMaxThreads(jobs);
+    connect(&gang, SIGNAL(log(LOG_TYPE,QString,Qt::GlobalColor)), this, SLOT(log(LOG_TYPE,QString,Qt::GlobalColor)), Qt::DirectConnection);
+
+    QJsonArray list;
+    bool ok = true;
+    foreach (const GANG_RESULT& res, gang.run(ports, firmware.getSegments(), params))
+    {
+        QJsonObject obj;
+        obj["port"] = res.port;
+        obj["status"] = res.ok ? "ok" : "error";
+        if (!res.ok)
+            obj["error"] = res.error;
+        obj["pid"] = QString("0x%1").arg(res.pid, 4, 16, QChar('0'));
+        obj["retries"] = static_cast<int>(res.retries);
+        obj["openTime"] = static_cast<double>(res.openTime);
+        obj["eraseTime"] = static_cast<double>(res.eraseTime);
+        obj["flashTime"] = static_cast<double>(res.flashTime);
+        obj["verifyTime"] = static_cast<double>(res.verifyTime);
+        obj["time"] = static_cast<double>(res.totalTime);
+        list.append(obj);
+        ok = ok && res.ok;
+    }
+    result["results"] = list;
+    if (!ok)
+        throw ErrorGang();
+}
+
+void Console::runRecipe(const QString &fileName)
+{
+    //bad recipe fails before connecting
+    Recipe recipe;
+    recipe.load(fileName);
+    connect(&recipe, SIGNAL(log(LOG_TYPE,QString,Qt::GlobalColor)), this, SLOT(log(LOG_TYPE,QString,Qt::GlobalColor)));
+    open();
+    try
+    {
+        recipe.run(comm);
+        result["steps"] = recipe.getSteps().size();
+        comm->close();
+    }
+    catch (...)
+    {
+        comm->close();
+        throw;
+    }
+}
+
+void Console::run(const QString &command, const QString &fileName)
+{
+    if (command == "ports")
+    {
+        result["ports"] = QJsonArray::fromStringList(comm->ports());
+        return;
+    }
+    if (command == "gang")
+    {
+        runGang(fileName);
+        return;
+    }
+    if (port.isEmpty())
+        throw ErrorNotActive();
+    if (command == "run")
+    {
+        runRecipe(fileName);
+        return;
+    }
+    open();
+    try
+    {
+        if (command == "open")
+        {
+        }
+        else if (command == "erase")
+        {
+            ERASE_PLAN plan(comm->eraseAuto(addr, size, wipe, dryRun));
+            const char* methods[] = {"pages", "bank", "mass"};
+            result["erase"] = QString(methods[plan.method]);
+            result["estimate"] = plan.estimate;
+        }
+        else if (command == "flash")
+        {
+            Firmware firmware;
+            firmware.load(fileName, addr);
+            result["segments"] = firmware.getSegments().size();
+            if (diff)
+                comm->flashDiff(firmware.getSegments(), verify);
+            else
+            {
+                if (!noErase)
+                {
+                    if (size)
+                        comm->eraseAuto(addr, size, wipe);
+                    else
+                        comm->eraseAuto(firmware.getSegments(), wipe);
+                }
+                comm->flash(firmware.getSegments(), verify);
+            }
+            const TRANSFER_STATS& transfer = comm->getTransferStats();
+            if (transfer.wireBytes)
+            {
+                result["compression"] = static_cast<double>(transfer.rawBytes) / transfer.wireBytes;
+                result["bytesPerSecond"] = static_cast<double>(transfer.rawBytes * 1000 / (transfer.time ? transfer.time : 1));
+                result["lineRate"] = static_cast<int>(comm->getSpeed() / BITS_PER_CHAR);
+            }
+            if (verify)
+                result["verifyTime"] = static_cast<double>(comm->getVerifyTime());
+            if (go)
+                comm->cmdGo(addr);
+        }
+        else if (command == "verify")
+        {
+            Firmware firmware;
+            firmware.load(fileName, addr);
+            comm->verify(firmware.getSegments());
+            result["verifyTime"] = static_cast<double>(comm->getVerifyTime());
+        }
+        else if (command == "dump")
+        {
+            DUMP_HASH hash(comm->dump(fileName, addr, size));
+            result["size"] = static_cast<double>(hash.size);
+            result["crc32"] = QString("%1").arg(hash.crc32, 8, 16, QChar('0'));
+            result["sha256"] = QString(hash.sha256.toHex());
+        }
+        else if (command == "go")
+            comm->cmdGo(addr);
+        else if (command == "protect")
+            comm->cmdReadoutProtect();
+        else if (command == "unprotect")
+            comm->cmdReadoutUnProtect();
+        comm->close();
+    }
+    catch (...)
+    {
+        comm->close();
+        throw;
+    }
+}
+
+int Console::exec(const QStringList &arguments)
+{
+    QCommandLineParser parser;
+    parser.setApplicationDescription(tr("STM32 USART ISP flasher. Result is printed to stdout as JSON, log goes to stderr."));
+    parser.addHelpOption();
+    parser.addPositionalArgument("command", tr("ports, open, erase, flash, verify, dump, go, protect, unprotect, gang, run"));
+    parser.addPositionalArgument("file", tr("Image file for flash, verify, dump and gang, recipe for run"), "[file]");
+    QCommandLineOption portOption(QStringList() << "p" << "port", tr("Serial port. For gang: comma separated list or \"all\""), "port");
+    QCommandLineOption speedOption(QStringList() << "b" << "speed", tr("Baud rate, 115200 by default. \"auto\" probes fastest clean rate, needs DTR/RTS reset wiring"), "speed");
+    QCommandLineOption addrOption(QStringList() << "a" << "address", tr("Start address, hex"), "address");
+    QCommandLineOption sizeOption(QStringList() << "s" << "size", tr("Size for erase and dump, hex"), "size");
+    QCommandLineOption blockOption("block", tr("Transfer block size, bytes"), "size");
+    QCommandLineOption devicesOption(QStringList() << "d" << "devices", tr("Device database file"), "file");
+    QCommandLineOption diffOption("diff", tr("Erase and write only changed pages"));
+    QCommandLineOption wipeOption("wipe", tr("Allow bank or mass erase if faster, data outside of range is lost"));
+    QCommandLineOption dryRunOption("dry-run", tr("Print erase plan only"));
+    QCommandLineOption noVerifyOption("no-verify", tr("Don't verify after flashing"));
+    QCommandLineOption verifyEachOption("verify-each", tr("Read back each block right after writing instead of one pass after flashing"));
+    QCommandLineOption readBackOption("read-back", tr("Verify by reading whole image back instead of per page CRC"));
+    QCommandLineOption stubOption("stub", tr("Program through RAM flash loader, bootloader is used if it can't be started"));
+    QCommandLineOption noCompressOption("no-compress", tr("Send raw blocks to RAM flash loader"));
+    QCommandLineOption stubFileOption("stub-file", tr("RAM flash loader image instead of stub/ by device"), "file");
+    QCommandLineOption resetLinesOption("reset-lines", tr("Pulse DTR/RTS into bootloader after mass erase and readout (un)protect"));
+    QCommandLineOption noEraseOption("no-erase", tr("Don't erase before flashing"));
+    QCommandLineOption goOption("go", tr("Start firmware after flashing"));
+    QCommandLineOption jobsOption(QStringList() << "j" << "jobs", tr("Parallel ports in gang mode"), "count");
+    QCommandLineOption metricsOption("metrics", tr("Dump protocol metrics to file periodically and on exit"), "file");
+    QCommandLineOption metricsFormatOption("metrics-format", tr("Metrics format: json or prometheus"), "format", "json");
+    QCommandLineOption verboseOption(QStringList() << "v" << "verbose", tr("Print debug output"));
+    parser.addOption(portOption);
+    parser.addOption(speedOption);
+    parser.addOption(addrOption);
+    parser.addOption(sizeOption);
+    parser.addOption(blockOption);
+    parser.addOption(devicesOption);
+    parser.addOption(diffOption);
+    parser.addOption(wipeOption);
+    parser.addOption(dryRunOption);
+    parser.addOption(noVerifyOption);
+    parser.addOption(verifyEachOption);
+    parser.addOption(readBackOption);
+    parser.addOption(stubOption);
+    parser.addOption(stubFileOption);
+    parser.addOption(noCompressOption);
+    parser.addOption(resetLinesOption);
+    parser.addOption(noEraseOption);
+    parser.addOption(goOption);
+    parser.addOption(jobsOption);
+    parser.addOption(metricsOption);
+    parser.addOption(metricsFormatOption);
+    parser.addOption(verboseOption);
+    if (!parser.parse(arguments))
+        return usageError(parser.errorText());
+    if (parser.isSet("help"))
+        parser.showHelp(CLI_EXIT_OK);
+
+    QStringList args(parser.positionalArguments());
+    QString command(args.value(0));
+    QStringList commands;
+    commands << "ports" << "open" << "erase" << "flash" << "verify" << "dump" << "go" << "protect" << "unprotect" << "gang" << "run";
+    bool needFile = command == "flash" || command == "verify" || command == "dump" || command == "gang" || command == "run";
+    if (!commands.contains(command) || (needFile && args.size() < 2))
+    {
+        QTextStream(stderr) << parser.helpText();
+        return usageError(commands.contains(command) ? QString(tr("File is required for %1")).arg(command) : QString(tr("Unknown command: %1")).arg(command));
+    }
+
+    port = parser.value(portOption);
+    if (parser.isSet(speedOption) && !Comm::parseSpeed(parser.value(speedOption), speed))
+        return usageError(QString(tr("Invalid baud rate: %1")).arg(parser.value(speedOption)));
+    bool ok = true;
+    if (parser.isSet(addrOption))
+        addr = parser.value(addrOption).toUInt(&ok, 16);
+    if (!ok)
+        return usageError(QString(tr("Invalid address: %1")).arg(parser.value(addrOption)));
+    if (parser.isSet(sizeOption))
+        size = parser.value(sizeOption).toUInt(&ok, 16);
+    if (!ok)
+        return usageError(QString(tr("Invalid size: %1")).arg(parser.value(sizeOption)));
+    if (parser.isSet(blockOption))
+    {
+        unsigned int block = parser.value(blockOption).toUInt(&ok);
+        if (!ok)
+            return usageError(QString(tr("Invalid block size: %1")).arg(parser.value(blockOption)));
+        comm->setBlockSize(block);
+    }
+    verbose = parser.isSet(verboseOption);
+    verify = !parser.isSet(noVerifyOption);
+    comm->setDeferredVerify(!parser.isSet(verifyEachOption));
+    comm->setChecksumVerify(!parser.isSet(readBackOption));
+    comm->setResetLines(parser.isSet(resetLinesOption));
+    stubFile = parser.value(stubFileOption);
+    stub = parser.isSet(stubOption) || !stubFile.isEmpty();
+    comm->setCompress(!parser.isSet(noCompressOption));
+    diff = parser.isSet(diffOption);
+    wipe = parser.isSet(wipeOption);
+    dryRun = parser.isSet(dryRunOption);
+    noErase = parser.isSet(noEraseOption);
+    go = parser.isSet(goOption);
+    if (parser.isSet(jobsOption))
+        jobs = parser.value(jobsOption).toInt(&ok);
+    if (!ok || jobs < 0)
+        return usageError(QString(tr("Invalid job count: %1")).arg(parser.value(jobsOption)));
+
+    if (parser.isSet(metricsOption))
+    {
+        dumper = new MetricsDumper(parser.value(metricsOption), parser.value(metricsFormatOption) == "prometheus" ? METRICS_FORMAT_PROMETHEUS : METRICS_FORMAT_JSON,
+                                   METRICS_INTERVAL, this);
+        //gang ports are added by their tasks
+        if (command != "gang")
+            dumper->add(comm);
+        dumper->start();
+    }
+
+    int code = CLI_EXIT_OK;
+    QElapsedTimer timer;
+    timer.start();
+    result["command"] = command;
+    result["port"] = port;
+    try
+    {
+        devicesFile = parser.value(devicesOption);
+        if (!devicesFile.isEmpty())
+            comm->loadDevices(devicesFile);
+        run(command, args.value(1));
+    }
+    catch (Exception& e)
+    {
+        code = exitCode(e);
+        result["error"] = e.what();
+    }
+    catch (...)
+    {
+        code = CLI_EXIT_INTERNAL;
+        result["error"] = tr("Unhandled exception");
+    }
+    result["status"] = code == CLI_EXIT_OK ? "ok" : "error";
+    result["code"] = code;
+    result["time"] = static_cast<double>(timer.elapsed());
+    //final dump on thread exit
+    delete dumper;
+    dumper = 0;
+
+    QTextStream(stdout) << QJsonDocument(result).toJson(QJsonDocument::Compact) << "\n";
+    return code;
+}
@@ -0,0 +1,66 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <QObject>
+#include <QStringList>
+#include <QJsonObject>
+#include "common.h"
+
+class Comm;
+class Exception;
+class MetricsDumper;
+
+typedef enum {
+    CLI_EXIT_OK = 0,
+    CLI_EXIT_USAGE,
+    CLI_EXIT_PORT,
+    CLI_EXIT_PROTOCOL,
+    CLI_EXIT_PROTECTED,
+    CLI_EXIT_VERIFY,
+    CLI_EXIT_FILE,
+    CLI_EXIT_RANGE,
+    CLI_EXIT_CANCEL,
+    CLI_EXIT_INTERNAL,
+    CLI_EXIT_GANG
+} CLI_EXIT;
+
+class Console : public QObject
+{
+    Q_OBJECT
+private:
+    Comm* comm;
+    QJsonObject result;
+    QString port, stubFile, devicesFile;
+    unsigned int speed, addr, size;
+    bool verbose, verify, diff, wipe, dryRun, noErase, go, stub;
+    int jobs;
+    MetricsDumper* dumper;
+
+    static int exitCode(Exception& e);
+    //prints error result, returns CLI_EXIT_USAGE
+    int usageError(const QString& error);
+    QByteArray stubImage() const;
+    void open();
+    void runGang(const QString& fileName);
+    //all steps in one session
+    void runRecipe(const QString& fileName);
+    void run(const QString& command, const QString& fileName);
+public:
+    explicit Console(QObject *parent = 0);
+    ~Console();
+
+    int exec(const QStringList& arguments);
+    //printed to stdout by exec
+    const QJsonObject& getResult() const {return result;}
+
+public slots:
+    void log(LOG_TYPE type, const QString& text, Qt::GlobalColor color);
+};
+
+#endif // CONSOLE_H
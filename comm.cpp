@@ -10,14 +10,49 @@
 #include "proto.h"
 #include <QFile>
 #include <QtSerialPort/QSerialPortInfo>
-#include <QtSerialPort/QSerialPort>
-#include <QCoreApplication>
+#include "transport.h"
+#include "imagefile.h"
+#include <QElapsedTimer>
+#include <QSettings>
 #include "delay.h"
+#include "crc.h"
+#include "lz4.h"
+#include <QCoreApplication>
+#include <QtEndian>
+#include <stddef.h>
+#include <string.h>
 
 Comm::Comm(QObject *parent) :
-    QObject(parent)
+    QObject(parent),
+    blockSize(BLOCK_SIZE),
+    portSpeed(0),
+    loaderVersion(0),
+    retries(0),
+    cancelFlag(0),
+    deferredVerify(VERIFY_DEFERRED),
+    checksumVerify(VERIFY_CHECKSUM),
+    checksumFailed(false),
+    resetLines(false),
+    resyncTime(0),
+    eraseTimingsChanged(false),
+    verifyTime(0),
+    rxBuf(RX_BUFFER_SIZE, 0),
+    rxPos(0),
+    rxLen(0),
+    txLen(0),
+    txCrc(0),
+    stubEnabled(false),
+    stubActive(false),
+    stubFrameSize(0),
+    stubWindow(0),
+    stubFeatures(0),
+    stubSeq(0),
+    compress(true)
 {
-    com = new QSerialPort();
+    transfer.rawBytes = transfer.wireBytes = 0;
+    transfer.time = 0;
+    //child, so it follows Comm to worker thread
+    com = Transport::create(QString(), this);
 }
 
 Comm::~Comm()
@@ -25,95 +60,159 @@ Comm::~Comm()
     delete com;
 }
 
-void Comm::ispStart()
+void Comm::checkCancel()
+{
+    if (cancelFlag && cancelFlag->load())
+        throw ErrorCancel();
+}
+
+void Comm::ispStart(int count, bool ackOnly)
 {
-    for (int i = 0; i < ACK_TIMEOUT_COUNT; ++i)
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < count; ++i)
     {
-        com->putChar(ISP_START_FRAME);
-        if (com->waitForReadyRead(10))
+        checkCancel();
+        const char start = ISP_START_FRAME;
+        com->write(&start, 1);
+        metrics.addTx(1);
+        if (rxFill(SYNC_INTERVAL))
         {
-            char c;
-            while (com->getChar(&c))
+            while (rxPos < rxLen)
             {
+                unsigned char c = rxBuf.at(rxPos++);
                 if (c == ISP_ACK)
                 {
+                    metrics.addSync(timer.nsecsElapsed() / 1000000.0, true);
                     info(QObject::tr("Device ACK\n"));
                     return;
                 }
-                if (c == ISP_NACK)
+                if (c == ISP_NACK && !ackOnly)
                 {
+                    metrics.addSync(timer.nsecsElapsed() / 1000000.0, true);
                     info(QObject::tr("Device already connected\n"));
                     return;
                 }
             }
         }
-        QCoreApplication::processEvents();
     }
+    metrics.addSync(timer.nsecsElapsed() / 1000000.0, false);
     throw ErrorPortTimeout();
 }
 
+bool Comm::rxFill(int timeout)
+{
+    if (rxPos < rxLen)
+        return true;
+    rxPos = 0;
+    rxLen = com->read(rxBuf.data(), rxBuf.size(), timeout);
+    metrics.addRx(rxLen);
+    return rxLen > 0;
+}
+
+void Comm::rxClear()
+{
+    com->clear();
+    rxPos = rxLen = 0;
+}
+
 QByteArray Comm::rx(unsigned int maxSize)
 {
     QByteArray buf;
-    while (static_cast<unsigned int>(buf.size()) < maxSize && com->waitForReadyRead(PORT_DEFAULT_TIMEOUT))
-        buf.append(com->read(maxSize - buf.size()));
+    while (static_cast<unsigned int>(buf.size()) < maxSize && rxFill(PORT_DEFAULT_TIMEOUT))
+    {
+        int len = qMin(static_cast<int>(maxSize) - buf.size(), rxLen - rxPos);
+        buf.append(rxBuf.constData() + rxPos, len);
+        rxPos += len;
+    }
+    if (static_cast<unsigned int>(buf.size()) < maxSize)
+        metrics.addTimeout();
     if (buf.isEmpty())
         throw ErrorPortTimeout();
     return buf;
 }
 
-unsigned char Comm::rxChar()
+unsigned char Comm::rxChar(int timeout)
 {
-
-    if (com->waitForReadyRead(PORT_DEFAULT_TIMEOUT))
-    {
-        unsigned char c;
-        if (com->getChar(reinterpret_cast<char*>(&c)))
-            return c;
-    }
+    if (rxFill(timeout))
+        return static_cast<unsigned char>(rxBuf.at(rxPos++));
+    metrics.addTimeout();
     throw ErrorPortTimeout();
 }
 
-void Comm::rxAck()
+void Comm::rxAck(int timeout)
 {
-    unsigned char c = rxChar();
+    unsigned char c = rxChar(timeout);
     if (c == ISP_NACK)
+    {
+        metrics.addNack();
         throw ErrorProtocolNack();
+    }
     if (c != ISP_ACK)
         throw ErrorProtocolInvalidResponse();
 }
 
-void Comm::tx(const QByteArray &buf)
+void Comm::frameAppend(const char *data, int size)
 {
-    char crc = buf.size() > 1 ? 0x00 : 0xff;
-    foreach (char c, buf)
-        crc ^= c;
-    com->flush();
-    com->write(buf);
-    com->putChar(crc);
-    rxAck();
+    //room for checksum is kept
+    Q_ASSERT(txLen + size < TX_BUFFER_SIZE);
+    char* dst = txBuf + txLen;
+    for (int i = 0; i < size; ++i)
+    {
+        dst[i] = data[i];
+        txCrc ^= data[i];
+    }
+    txLen += size;
+}
+
+void Comm::frameSend(int timeout)
+{
+    //single byte is followed by complement
+    txBuf[txLen] = txLen > 1 ? txCrc : ~txCrc;
+    com->write(txBuf, txLen + 1);
+    metrics.addTx(txLen + 1);
+    rxAck(timeout);
 }
 
 void Comm::txAck()
 {
-    com->putChar(ISP_ACK);
+    const char ack = ISP_ACK;
+    com->write(&ack, 1);
+    metrics.addTx(1);
 }
 
 void Comm::txReq(unsigned char cmd)
 {
-    QByteArray buf;
-    buf.append(static_cast<char>(cmd));
-    tx(buf);
+    if (stubActive)
+        leaveStub();
+    frameStart();
+    frameAppend(static_cast<char>(cmd));
+    frameSend();
 }
 
 void Comm::txAddr(unsigned int addr)
 {
-    QByteArray buf;
-    buf.append(static_cast<char>((addr >> 24) & 0xff));
-    buf.append(static_cast<char>((addr >> 16) & 0xff));
-    buf.append(static_cast<char>((addr >> 8) & 0xff));
-    buf.append(static_cast<char>((addr >> 0) & 0xff));
-    tx(buf);
+    frameStart();
+    frameAppend(static_cast<char>((addr >> 24) & 0xff));
+    frameAppend(static_cast<char>((addr >> 16) & 0xff));
+    frameAppend(static_cast<char>((addr >> 8) & 0xff));
+    frameAppend(static_cast<char>((addr >> 0) & 0xff));
+    frameSend();
+}
+
+unsigned int Comm::chunkSize(unsigned int addr, unsigned int left) const
+{
+    //don't cross block boundary, so unaligned head is shortened and the rest stays aligned
+    unsigned int block = stubActive ? stubFrameSize : blockSize;
+    unsigned int size = block - (addr % block);
+    return size < left ? size : left;
+}
+
+unsigned int Comm::readChunkSize(unsigned int addr, unsigned int left) const
+{
+    unsigned int block = stubActive ? stubFrameSize : MAX_BLOCK_SIZE;
+    unsigned int size = block - (addr % block);
+    return size < left ? size : left;
 }
 
 bool Comm::isActive()
@@ -123,26 +222,48 @@ bool Comm::isActive()
 
 void Comm::open(const QString &name, unsigned int speed)
 {
+    if (speed == 0)
+        openAuto(name);
+    else
+    {
+        openPort(name, speed);
+        ispConnect(ACK_TIMEOUT_COUNT);
+    }
+    if (stubEnabled)
+        startStub();
+}
+
+void Comm::openPort(const QString &name, unsigned int speed)
+{
+    portName = name;
+    portSpeed = speed;
+    retries = 0;
+    stubActive = false;
+    checksumFailed = false;
+    erasedSectors.clear();
+    transfer.rawBytes = transfer.wireBytes = 0;
+    transfer.time = 0;
+    metrics.setPort(name);
     com->close();
-    com->setPortName(name);
-    if (!com->open(QIODevice::ReadWrite))
+    delete com;
+    com = Transport::create(name, this);
+    rxPos = rxLen = 0;
+    if (!com->open(name, speed))
         throw ErrorPortOpen();
-    com->setBaudRate(speed);
-    com->setDataBits(QSerialPort::Data8);
-    com->setStopBits(QSerialPort::OneStop);
-    com->setParity(QSerialPort::EvenParity);
-    com->setFlowControl(QSerialPort::NoFlowControl);
+}
 
+void Comm::ispConnect(int syncCount)
+{
     try
     {
         hint(tr("Enter ISP mode and connect device...\n"));
-        ispStart();
-        unsigned char version;
+        ispStart(syncCount);
         unsigned short pid;
-        version = cmdGet();
-        info(QString(tr("ISP loader version: %1.%2\n")).arg(version >> 4).arg(version & 0xf));
+        loaderVersion = cmdGet();
+        info(QString(tr("ISP loader version: %1.%2\n")).arg(loaderVersion >> 4).arg(loaderVersion & 0xf));
         pid = cmdGetID();
         info(QString(tr("PID: 0x%1\n")).arg(pid, 4, 16, QChar('0')));
+        selectDevice(pid);
     }
     catch (...)
     {
@@ -151,11 +272,252 @@ void Comm::open(const QString &name, unsigned int speed)
     }
 }
 
+void Comm::resync(unsigned char cmd, bool restoreStub)
+{
+    QElapsedTimer timer;
+    timer.start();
+    unsigned short pid = device.pid;
+    QSettings settings(SETTINGS_FILE_NAME, QSettings::IniFormat);
+    settings.beginGroup(QString("reset_%1").arg(pid, 4, 16, QChar('0')));
+    QString key(QString("%1").arg(cmd, 2, 16, QChar('0')));
+    double expected = settings.value(key, RESYNC_BOOT_TIME).toDouble();
+    try
+    {
+        if (resetLines)
+            resetToLoader();
+        else
+            sleep_ms(static_cast<unsigned long>(expected * RESYNC_WAIT));
+        rxClear();
+        int deadline = static_cast<int>(qMax(static_cast<double>(RESYNC_TIMEOUT), expected * 4));
+        //old session NACKs every second 0x7f until device resets
+        ispStart(deadline / SYNC_INTERVAL, true);
+        qint64 boot = timer.elapsed();
+        loaderVersion = cmdGet();
+        if (cmdGetID() != pid)
+            throw ErrorProtocolInvalidResponse();
+        //flash size register is readable again after unprotect
+        selectDevice(pid);
+        if (!resetLines)
+        {
+            double measured = expected;
+            EraseTimings::update(measured, boot);
+            settings.setValue(key, measured);
+        }
+        if (restoreStub && stubEnabled)
+            startStub();
+        resyncTime = timer.elapsed();
+        debug(QString(tr("Resync after reset: %1ms, sync %2ms\n")).arg(resyncTime).arg(boot));
+    }
+    catch (ErrorCancel)
+    {
+        com->close();
+        throw;
+    }
+    catch (Exception& e)
+    {
+        resyncTime = timer.elapsed();
+        warning(QString(tr("Resync after reset: %1\n")).arg(e.what()));
+        com->close();
+        //command itself was done, but device state is unknown
+        throw ErrorProtocolResync();
+    }
+}
+
+void Comm::loadDevices(const QString &fileName)
+{
+    if (devices.isEmpty())
+        devices.loadBuiltin();
+    devices.load(fileName);
+}
+
+void Comm::selectDevice(unsigned short pid)
+{
+    if (devices.isEmpty())
+    {
+        try
+        {
+            devices.loadBuiltin();
+        }
+        catch (Exception& e)
+        {
+            warning(QString(tr("Device database: %1\n")).arg(e.what()));
+        }
+    }
+    device = devices.find(pid);
+    device.pid = pid;
+    eraseTimings.load(pid);
+    if (!device.isKnown())
+    {
+        warning(QString(tr("Unknown device, assuming %1 bytes pages at 0x%2\n")).arg(PAGE_SIZE).arg(FLASH_BASE, 8, 16, QChar('0')));
+        return;
+    }
+    if (device.flashSizeReg)
+    {
+        try
+        {
+            QByteArray buf(cmdReadMemory(device.flashSizeReg, 2));
+            unsigned int size = ((static_cast<unsigned char>(buf.at(1)) << 8) | static_cast<unsigned char>(buf.at(0))) * 1024;
+            if (size && size < device.flashSize)
+                device.flashSize = size;
+        }
+        catch (ErrorProtocol&)
+        {
+            //read protected, use family maximum
+        }
+    }
+    info(QString(tr("Device: %1, flash %2K at 0x%3\n")).arg(device.name).arg(device.flashSize / 1024).arg(device.flashBase, 8, 16, QChar('0')));
+}
+
+QVector<SECTOR> Comm::flashSectors(unsigned int addr, unsigned int size) const
+{
+    QVector<SECTOR> sectors(device.sectors(addr, size));
+    if (size == 0)
+        return sectors;
+    if (sectors.isEmpty() || sectors.first().addr > addr || sectors.last().addr + sectors.last().size < addr + size)
+        throw ErrorDeviceRange();
+    return sectors;
+}
+
+void Comm::resetToLoader()
+{
+    //BOOT0 high, NRST pulse
+    com->setRequestToSend(false);
+    com->setDataTerminalReady(true);
+    sleep_ms(RESET_PULSE);
+    com->setDataTerminalReady(false);
+    sleep_ms(BOOT_DELAY);
+    rxClear();
+}
+
+bool Comm::probeSpeed()
+{
+    QElapsedTimer timer;
+    timer.start();
+    QByteArray first;
+    bool readable = true;
+    try
+    {
+        for (int i = 0; i < BAUD_PROBE_READS; ++i)
+        {
+            checkCancel();
+            if (!readable)
+            {
+                cmdGetVersion();
+                continue;
+            }
+            try
+            {
+                QByteArray buf(cmdReadMemory(device.flashBase, MAX_BLOCK_SIZE));
+                //bit errors show up as differing read-back
+                if (first.isEmpty())
+                    first = buf;
+                else if (buf != first)
+                    throw ErrorProtocolVerify();
+            }
+            catch (ErrorProtocolReadProtection)
+            {
+                readable = false;
+            }
+        }
+    }
+    catch (ErrorCancel)
+    {
+        throw;
+    }
+    catch (Exception& e)
+    {
+        warning(QString(tr("%1 bps: %2\n")).arg(portSpeed).arg(e.what()));
+        return false;
+    }
+    info(QString(tr("%1 bps: clean, %2 ms\n")).arg(portSpeed).arg(timer.elapsed()));
+    return true;
+}
+
+unsigned int Comm::openAuto(const QString &name)
+{
+    //per port and board type, last seen board of port tried first
+    QSettings settings(SETTINGS_FILE_NAME, QSettings::IniFormat);
+    settings.beginGroup("baud");
+    QString key(QString(name).replace('/', '_'));
+    unsigned int cached = settings.value(QString("%1_%2").arg(key).arg(settings.value(key).toString())).toUInt();
+    QVector<unsigned int> rates;
+    if (cached)
+        rates.append(cached);
+    for (unsigned int i = 0; i < sizeof(AUTO_BAUD_RATES) / sizeof(AUTO_BAUD_RATES[0]); ++i)
+        if (AUTO_BAUD_RATES[i] != cached)
+            rates.append(AUTO_BAUD_RATES[i]);
+
+    foreach (unsigned int speed, rates)
+    {
+        openPort(name, speed);
+        try
+        {
+            //bootloader locks to first 0x7f rate until reset
+            resetToLoader();
+            ispConnect(AUTO_BAUD_SYNC_COUNT);
+            if (probeSpeed())
+            {
+                QString pid(QString("%1").arg(device.pid, 4, 16, QChar('0')));
+                settings.setValue(key, pid);
+                settings.setValue(QString("%1_%2").arg(key).arg(pid), speed);
+                info(QString(tr("Auto baud: %1\n")).arg(speed));
+                return speed;
+            }
+        }
+        catch (ErrorCancel)
+        {
+            com->close();
+            throw;
+        }
+        catch (Exception& e)
+        {
+            debug(QString(tr("%1 bps: %2\n")).arg(speed).arg(e.what()));
+        }
+        com->close();
+    }
+    throw ErrorPortTimeout();
+}
+
 void Comm::close()
 {
+    //target is left in bootloader, as without loader
+    if (stubActive)
+    {
+        try
+        {
+            leaveStub();
+        }
+        catch (Exception& e)
+        {
+            warning(QString(tr("Flash loader exit: %1\n")).arg(e.what()));
+        }
+    }
     com->close();
 }
 
+void Comm::reconnect()
+{
+    if (portName.isEmpty())
+        throw ErrorNotActive();
+    open(portName, portSpeed);
+}
+
+void Comm::setBlockSize(unsigned int size)
+{
+    //Write Memory requires word-aligned length
+    size &= ~3;
+    if (size < 4)
+        size = 4;
+    if (size > static_cast<unsigned int>(MAX_BLOCK_SIZE))
+        size = MAX_BLOCK_SIZE;
+    blockSize = size;
+}
+
+bool Comm::isExtendedErase() const
+{
+    return supportedCmds.contains(ISP_ERASE_MEMORY_EX);
+}
+
 QStringList Comm::ports()
 {
     QStringList res;
@@ -164,11 +526,24 @@ QStringList Comm::ports()
     return res;
 }
 
+bool Comm::parseSpeed(const QString &text, unsigned int &speed)
+{
+    if (text == "auto")
+    {
+        speed = 0;
+        return true;
+    }
+    bool ok;
+    speed = text.toUInt(&ok);
+    return ok && speed;
+}
+
 unsigned char Comm::cmdGet()
 {
     if (!com->isOpen())
         throw ErrorNotActive();
 
+    MetricsScope scope(metrics, ISP_GET);
     txReq(ISP_GET);
     int len = rxChar();
     unsigned char version = rxChar();
@@ -185,6 +560,7 @@ unsigned char Comm::cmdGetVersion()
     if (!com->isOpen())
         throw ErrorNotActive();
 
+    MetricsScope scope(metrics, ISP_GET_VERSION);
     txReq(ISP_GET_VERSION);
     unsigned char version = rxChar();
     rxChar();
@@ -200,6 +576,7 @@ unsigned short Comm::cmdGetID()
     if (!com->isOpen())
         throw ErrorNotActive();
 
+    MetricsScope scope(metrics, ISP_GET_ID);
     txReq(ISP_GET_ID);
     //len
     rxChar();
@@ -213,6 +590,7 @@ unsigned short Comm::cmdGetID()
 QByteArray Comm::cmdReadMemory(unsigned int addr, unsigned int size)
 {
     QByteArray buf;
+    MetricsScope scope(metrics, ISP_READ_MEMORY);
     try
     {
         txReq(ISP_READ_MEMORY);
@@ -223,7 +601,9 @@ QByteArray Comm::cmdReadMemory(unsigned int addr, unsigned int size)
     }
 
     txAddr(addr);
-    tx(QByteArray().append(static_cast<char>(size - 1)));
+    frameStart();
+    frameAppend(static_cast<char>(size - 1));
+    frameSend();
 
     buf = rx(size);
     if (static_cast<unsigned int>(buf.size()) < size)
@@ -234,6 +614,7 @@ QByteArray Comm::cmdReadMemory(unsigned int addr, unsigned int size)
 
 void Comm::cmdGo(unsigned int addr)
 {
+    MetricsScope scope(metrics, ISP_GO);
     txReq(ISP_GO);
     txAddr(addr);
     com->close();
@@ -241,6 +622,15 @@ void Comm::cmdGo(unsigned int addr)
 
 void Comm::cmdWriteMemory(unsigned int addr, const QByteArray &data)
 {
+    cmdWriteMemory(addr, data.constData(), data.size());
+}
+
+void Comm::cmdWriteMemory(unsigned int addr, const char *data, unsigned int size)
+{
+    //length is sent as size - 1 in one byte
+    if (size == 0 || size > static_cast<unsigned int>(MAX_BLOCK_SIZE))
+        throw ErrorDeviceRange();
+    MetricsScope scope(metrics, ISP_WRITE_MEMORY);
     try
     {
         txReq(ISP_WRITE_MEMORY);
@@ -251,219 +641,1233 @@ void Comm::cmdWriteMemory(unsigned int addr, const QByteArray &data)
     }
 
     txAddr(addr);
-    tx(QByteArray().append(static_cast<char>(data.size() - 1)).append(data));
+    frameStart();
+    frameAppend(static_cast<char>(size - 1));
+    frameAppend(data, size);
+    frameSend();
 }
 
-void Comm::cmdEraseMemory(unsigned int page)
+void Comm::cmdEraseMemory(unsigned int page, int timeout)
 {
-    try
+    if (page != ISP_MASS_ERASE)
     {
-        txReq(ISP_ERASE_MEMORY);
+        cmdEraseMemory(QVector<unsigned int>() << page);
+        return;
     }
-    catch (ErrorProtocolNack)
     {
-        throw ErrorProtocolWriteProtection();
+        MetricsScope scope(metrics, ISP_ERASE_MEMORY);
+        try
+        {
+            txReq(ISP_ERASE_MEMORY);
+        }
+        catch (ErrorProtocolNack)
+        {
+            throw ErrorProtocolWriteProtection();
+        }
+        frameStart();
+        frameAppend(static_cast<char>(page & 0xff));
+        frameSend(timeout);
     }
-    QByteArray buf;
-    if (page != ISP_MASS_ERASE)
-        buf.append(static_cast<char>(0x00));
-    buf.append(static_cast<char>(page & 0xff));
-    tx(buf);
+    for (unsigned int i = 0; i < device.sectorCount(); ++i)
+        markErased(i);
     //device will reset
-    if (page == ISP_MASS_ERASE)
-        com->close();
+    if ((device.quirks & QUIRK_ERASE_NO_RESET) == 0)
+        resync(ISP_ERASE_MEMORY, true);
 }
 
-void Comm::cmdEraseMemoryEx(unsigned int page)
+void Comm::cmdEraseMemory(const QVector<unsigned int> &pages, int pageTimeout)
 {
-    try
+    //checked before request, so bootloader is never left inside a frame
+    foreach (unsigned int page, pages)
+        //only 8 bit page numbers in legacy command
+        if (page > 0xff)
+            throw ErrorDeviceRange();
+    for (int i = 0; i < pages.size(); i += ERASE_BATCH_MAX)
     {
-        txReq(ISP_ERASE_MEMORY_EX);
+        int count = pages.size() - i < ERASE_BATCH_MAX ? pages.size() - i : ERASE_BATCH_MAX;
+        MetricsScope scope(metrics, ISP_ERASE_MEMORY);
+        try
+        {
+            txReq(ISP_ERASE_MEMORY);
+        }
+        catch (ErrorProtocolNack)
+        {
+            throw ErrorProtocolWriteProtection();
+        }
+        frameStart();
+        frameAppend(static_cast<char>(count - 1));
+        for (int j = i; j < i + count; ++j)
+            frameAppend(static_cast<char>(pages.at(j)));
+        frameSend(PORT_DEFAULT_TIMEOUT + count * pageTimeout);
+        for (int j = i; j < i + count; ++j)
+            markErased(pages.at(j));
     }
-    catch (ErrorProtocolNack)
+}
+
+void Comm::cmdEraseMemoryEx(unsigned int page, int timeout)
+{
+    if (page != ISP_ERASE_BANK1 && page != ISP_ERASE_BANK2 && page != ISP_MASS_ERASE)
     {
-        throw ErrorProtocolWriteProtection();
+        cmdEraseMemoryEx(QVector<unsigned int>() << page);
+        return;
     }
-    QByteArray buf;
-    if (page != ISP_ERASE_BANK1 && page != ISP_ERASE_BANK2 && page != ISP_MASS_ERASE)
     {
-        buf.append(static_cast<char>(0 >> 8));
-        buf.append(static_cast<char>(0 & 0xff));
+        MetricsScope scope(metrics, ISP_ERASE_MEMORY_EX);
+        try
+        {
+            txReq(ISP_ERASE_MEMORY_EX);
+        }
+        catch (ErrorProtocolNack)
+        {
+            throw ErrorProtocolWriteProtection();
+        }
+        frameStart();
+        frameAppend(static_cast<char>(page >> 8));
+        frameAppend(static_cast<char>(page & 0xff));
+        frameSend(timeout);
+    }
+    if (page == ISP_MASS_ERASE)
+        for (unsigned int i = 0; i < device.sectorCount(); ++i)
+            markErased(i);
+    else if (device.banks && device.flashSize)
+    {
+        unsigned int bankSize = device.flashSize / device.banks;
+        foreach (const SECTOR& sector, device.sectors(device.flashBase + (page == ISP_ERASE_BANK2 ? bankSize : 0), bankSize))
+            markErased(sector.index);
     }
-    buf.append(static_cast<char>(page >> 8));
-    buf.append(static_cast<char>(page & 0xff));
-    tx(buf);
     //device will reset
-    if (page == ISP_MASS_ERASE)
-        com->close();
+    if (page == ISP_MASS_ERASE && (device.quirks & QUIRK_ERASE_NO_RESET) == 0)
+        resync(ISP_ERASE_MEMORY_EX, true);
+}
+
+void Comm::cmdEraseMemoryEx(const QVector<unsigned int> &pages, int pageTimeout)
+{
+    //0xfff0-0xffff are bank and mass erase codes
+    foreach (unsigned int page, pages)
+        if (page >= 0xfff0)
+            throw ErrorDeviceRange();
+    for (int i = 0; i < pages.size(); i += ERASE_BATCH_MAX)
+    {
+        int count = pages.size() - i < ERASE_BATCH_MAX ? pages.size() - i : ERASE_BATCH_MAX;
+        MetricsScope scope(metrics, ISP_ERASE_MEMORY_EX);
+        try
+        {
+            txReq(ISP_ERASE_MEMORY_EX);
+        }
+        catch (ErrorProtocolNack)
+        {
+            throw ErrorProtocolWriteProtection();
+        }
+        frameStart();
+        frameAppend(static_cast<char>((count - 1) >> 8));
+        frameAppend(static_cast<char>((count - 1) & 0xff));
+        for (int j = i; j < i + count; ++j)
+        {
+            frameAppend(static_cast<char>(pages.at(j) >> 8));
+            frameAppend(static_cast<char>(pages.at(j) & 0xff));
+        }
+        frameSend(PORT_DEFAULT_TIMEOUT + count * pageTimeout);
+        for (int j = i; j < i + count; ++j)
+            markErased(pages.at(j));
+    }
 }
 
 void Comm::cmdReadoutProtect()
 {
-    txReq(ISP_READOUT_PROTECT);
-    rxAck();
-    com->close();
+    {
+        MetricsScope scope(metrics, ISP_READOUT_PROTECT);
+        txReq(ISP_READOUT_PROTECT);
+        rxAck();
+    }
+    //loader can't be written until unprotect
+    resync(ISP_READOUT_PROTECT, false);
 }
 
 void Comm::cmdReadoutUnProtect()
 {
-    txReq(ISP_READOUT_UNPROTECT);
-    rxAck();
-    com->close();
+    {
+        MetricsScope scope(metrics, ISP_READOUT_UNPROTECT);
+        txReq(ISP_READOUT_UNPROTECT);
+        rxAck();
+    }
+    resync(ISP_READOUT_UNPROTECT, true);
 }
 
-void Comm::dump(const QString &fileName, unsigned int addr, unsigned int size)
+void Comm::retrain(unsigned int addr)
 {
-    QFile file(fileName);
-    if (!file.open(QIODevice::WriteOnly))
-        throw ErrorFileOpen();
-    unsigned int i;
-    try
+    ++retries;
+    metrics.addRetry();
+    info(QObject::tr("\n"));
+    warning(QString(QObject::tr("Retrain at: 0x%1")).arg(addr, 8, 16, QChar('0')));
+}
+
+QByteArray Comm::readBlock(unsigned int addr, unsigned int size)
+{
+    checkCancel();
+    if (stubActive)
     {
-        info(QString(QObject::tr("Dumping 0x%1-0x%2")).arg(addr, 8, 16, QChar('0')).arg(addr + size, 8, 16, QChar('0')));
-        for (i = 0; i * PAGE_SIZE < size; ++i)
+        QByteArray buf;
+        stubRequest(STUB_READ, addr, size, 0, &buf);
+        if (static_cast<unsigned int>(buf.size()) != size)
+            throw ErrorProtocolInvalidResponse();
+        return buf;
+    }
+    for (int retry = 0;; ++retry)
+    {
+        try
         {
-            for (int retry = 0;; ++retry)
+            return cmdReadMemory(addr, size);
+        }
+        catch (...)
+        {
+            if (retry < NRETRY)
             {
-                try
-                {
-                    file.write(cmdReadMemory(i * PAGE_SIZE + addr, PAGE_SIZE));
-                    break;
-                }
-                catch (...)
-                {
-                    if (retry < NRETRY)
-                    {
-                        info(QObject::tr("\n"));
-                        warning(QString(QObject::tr("Retrain at: 0x%1")).arg(i * PAGE_SIZE + addr, 8, 16, QChar('0')));
-                        continue;
-                    }
-                    throw;
-                }
+                retrain(addr);
+                continue;
             }
-            if (i && ((i % REFRESH_RATE) == 0))
-                info(".");
+            throw;
         }
-        info(QObject::tr(".Ok!\n"));
-        file.close();
-    }
-    catch (...)
-    {
-        info(QString(QObject::tr(".Fail! at 0x%1\n").arg(addr + i * PAGE_SIZE, 8, 16, QChar('0'))));
-        file.close();
-        throw;
     }
 }
 
-void Comm::erase(unsigned int addr, unsigned int size)
+void Comm::writeBlock(unsigned int addr, const QByteArray &chunk, bool verify)
 {
-    unsigned int i;
-    try
+    checkCancel();
+    QElapsedTimer timer;
+    timer.start();
+    markWritten(addr, chunk.size());
+    //loader requests are retried by stubRequest
+    if (stubActive)
+        stubRequest(STUB_WRITE, addr, chunk.size(), chunk.constData(), 0);
+    for (int retry = 0; !stubActive; ++retry)
     {
-        info(QString(QObject::tr("Erasing 0x%1-0x%2")).arg(addr, 8, 16, QChar('0')).arg(addr + size, 8, 16, QChar('0')));
-        for (i = 0; i * PAGE_SIZE < size; ++i)
+        try
+        {
+            cmdWriteMemory(addr, chunk);
+            break;
+        }
+        catch (...)
         {
-            for (int retry = 0;; ++retry)
+            if (retry < NRETRY)
             {
-                try
-                {
-                    if (supportedCmds.contains(ISP_ERASE_MEMORY_EX))
-                        cmdEraseMemoryEx(((i * PAGE_SIZE + addr) - FLASH_BASE) / PAGE_SIZE);
-                    else
-                        cmdEraseMemory(((i * PAGE_SIZE + addr) - FLASH_BASE) / PAGE_SIZE);
-                    break;
-                }
-                catch (...)
-                {
-                    if (retry < NRETRY)
-                    {
-                        info(QObject::tr("\n"));
-                        warning(QString(QObject::tr("Retrain at: 0x%1")).arg(i * PAGE_SIZE + addr, 8, 16, QChar('0')));
-                        continue;
-                    }
-                    throw;
-                }
+                retrain(addr);
+                continue;
             }
-            if (i && ((i % REFRESH_RATE) == 0))
-                info(".");
+            throw;
         }
-        info(QObject::tr(".Ok!\n"));
     }
-    catch (...)
+    metrics.addProgram(chunk.size(), timer.nsecsElapsed() / 1000000.0);
+    if (verify && stubActive)
     {
-        info(QString(QObject::tr(".Fail! at 0x%1\n").arg(addr + i * PAGE_SIZE, 8, 16, QChar('0'))));
-        throw;
+        if (chunk != readBlock(addr, chunk.size()))
+            throw ErrorProtocolVerify();
     }
-}
-
-void Comm::flash(const QByteArray &data, unsigned int addr, bool verify)
-{
-    unsigned int i;
-    try
+    else if (verify)
     {
-        info(QString(QObject::tr("Flashing")));
-        for (i = 0; i * PAGE_SIZE < static_cast<unsigned int>(data.size()); ++i)
+        for (int retry = 0;; ++retry)
         {
-            QByteArray chunk(data.mid(i * PAGE_SIZE, PAGE_SIZE));
-            if (static_cast<unsigned int>(chunk.size()) < PAGE_SIZE)
-                chunk += QByteArray(PAGE_SIZE - chunk.size(), 0x0);
-            for (int retry = 0;; ++retry)
+            try
             {
-                try
-                {
-                    cmdWriteMemory(i * PAGE_SIZE + addr, chunk);
-                    break;
-                }
-                catch (...)
-                {
-                    if (retry < NRETRY)
-                    {
-                        info(QObject::tr("\n"));
-                        warning(QString(QObject::tr("Retrain at: 0x%1")).arg(i * PAGE_SIZE + addr, 8, 16, QChar('0')));
-                        continue;
-                    }
-                    throw;
-                }
+                if (chunk != cmdReadMemory(addr, chunk.size()))
+                    throw ErrorProtocolVerify();
+                break;
             }
-            if (verify)
+            catch (...)
             {
-                for (int retry = 0;; ++retry)
+                if (retry < NRETRY)
                 {
-                    try
-                    {
-                        if (chunk != cmdReadMemory(i * PAGE_SIZE + addr, PAGE_SIZE))
-                            throw ErrorProtocolVerify();
-                        break;
-                    }
-                    catch (...)
-                    {
-                        if (retry < NRETRY)
-                        {
-                            info(QObject::tr("\n"));
-                            warning(QString(QObject::tr("Retrain at: 0x%1")).arg(i * PAGE_SIZE + addr, 8, 16, QChar('0')));
-                        }
-                    }
+                    retrain(addr);
+                    continue;
                 }
+                throw;
             }
-            if (i && ((i % REFRESH_RATE) == 0))
-                info(".");
         }
-        info(QObject::tr(".Ok!\n"));
     }
-    catch (...)
+}
+
+static bool isBlank(const QByteArray& buf, int from, int size)
+{
+    const char* p = buf.constData() + from;
+    for (int i = 0; i < size; ++i)
+        if (static_cast<unsigned char>(p[i]) != 0xff)
+            return false;
+    return true;
+}
+
+bool Comm::blockMatches(unsigned int addr, const char *expected, unsigned int size)
+{
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        QByteArray buf(readBlock(addr, size));
+        if (memcmp(buf.constData(), expected, size) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool Comm::canChecksum() const
+{
+    if (!checksumVerify || checksumFailed)
+        return false;
+    return stubActive && (stubFeatures & STUB_FEATURE_CRC);
+}
+
+bool Comm::crcMatches(unsigned int addr, const char *data, unsigned int size)
+{
+    checkCancel();
+    try
+    {
+        QByteArray res;
+        stubRequest(STUB_CRC, addr, size, 0, &res);
+        return res.size() == 4 && qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(res.constData())) == crc32(data, size);
+    }
+    catch (ErrorCancel)
     {
-        info(QString(QObject::tr(".Fail! at 0x%1\n").arg(addr + i * PAGE_SIZE, 8, 16, QChar('0'))));
         throw;
     }
+    catch (Exception& e)
+    {
+        //page is read back instead
+        checksumFailed = true;
+        info(QObject::tr("\n"));
+        warning(QString(tr("Checksum: %1, verifying by read back\n")).arg(e.what()));
+        return false;
+    }
 }
 
-void Comm::flash(const QString &fileName, unsigned int addr, bool verify)
+QVector<SECTOR> Comm::mismatchSectors(const QByteArray &data, unsigned int addr, unsigned int &pos)
+{
+    unsigned int size = data.size();
+    unsigned int i, first = size;
+    bool checksum = canChecksum();
+    QVector<SECTOR> bad;
+    for (i = 0, pos = 0; pos < size; ++i)
+    {
+        unsigned int len = readChunkSize(addr + pos, size - pos);
+        //off after first failed checksum
+        checksum = checksum && canChecksum();
+        if (checksum)
+        {
+            const SECTOR& sector = flashSectors(addr + pos, 1).first();
+            len = qMin(sector.addr + sector.size - (addr + pos), size - pos);
+        }
+        if (!checksum || !crcMatches(addr + pos, data.constData() + pos, len))
+        {
+            for (unsigned int p = pos; p < pos + len; p += readChunkSize(addr + p, pos + len - p))
+            {
+                unsigned int chunk = readChunkSize(addr + p, pos + len - p);
+                if (blockMatches(addr + p, data.constData() + p, chunk))
+                    continue;
+                first = qMin(first, p);
+                foreach (const SECTOR& sector, flashSectors(addr + p, chunk))
+                    if (bad.isEmpty() || bad.last().index != sector.index)
+                        bad.append(sector);
+            }
+        }
+        pos += len;
+        emit progress(pos, size);
+        if (i && ((i % REFRESH_RATE) == 0))
+            info(".");
+    }
+    pos = first;
+    return bad;
+}
+
+void Comm::verifyDeferred(const QByteArray &data, unsigned int addr)
+{
+    QElapsedTimer timer;
+    timer.start();
+    unsigned int pos = 0;
+    unsigned int size = data.size();
+    QVector<SECTOR> bad;
+    try
+    {
+        info(QString(QObject::tr("Verifying 0x%1-0x%2")).arg(addr, 8, 16, QChar('0')).arg(addr + size, 8, 16, QChar('0')));
+        bad = mismatchSectors(data, addr, pos);
+        if (!bad.isEmpty())
+        {
+            info(QObject::tr("\n"));
+            warning(QString(QObject::tr("Rewriting %1 page(s) from 0x%2")).arg(bad.size()).arg(bad.first().addr, 8, 16, QChar('0')));
+            repairSectors(bad, data, addr);
+        }
+        verifyTime = timer.elapsed();
+        metrics.addVerify(size, timer.nsecsElapsed() / 1000000.0);
+        info(QString(QObject::tr(".Ok! %1ms\n")).arg(verifyTime));
+    }
+    catch (...)
+    {
+        verifyTime = timer.elapsed();
+        info(QString(QObject::tr(".Fail! at 0x%1\n").arg(addr + pos, 8, 16, QChar('0'))));
+        throw;
+    }
+}
+
+void Comm::repairSectors(QVector<SECTOR> sectors, const QByteArray &data, unsigned int addr)
+{
+    //current content outside of the image is kept
+    QVector<QByteArray> expected;
+    foreach (const SECTOR& sector, sectors)
+    {
+        QByteArray page;
+        for (unsigned int pos = 0; pos < sector.size; pos += readChunkSize(sector.addr + pos, sector.size - pos))
+            page += readBlock(sector.addr + pos, readChunkSize(sector.addr + pos, sector.size - pos));
+        unsigned int start = sector.addr < addr ? addr : sector.addr;
+        unsigned int end = sector.addr + sector.size < addr + data.size() ? sector.addr + sector.size : addr + data.size();
+        page.replace(start - sector.addr, end - start, data.constData() + (start - addr), end - start);
+        expected.append(page);
+    }
+    for (int retry = 0;; ++retry)
+    {
+        erasePages(sectors);
+        for (int i = 0; i < sectors.size(); ++i)
+        {
+            const SECTOR& sector = sectors.at(i);
+            for (unsigned int pos = 0; pos < sector.size; pos += chunkSize(sector.addr + pos, sector.size - pos))
+            {
+                QByteArray chunk(QByteArray::fromRawData(expected.at(i).constData() + pos, chunkSize(sector.addr + pos, sector.size - pos)));
+                //already erased
+                if (isBlank(chunk, 0, chunk.size()))
+                    continue;
+                writeBlock(sector.addr + pos, chunk, false);
+            }
+        }
+        QVector<SECTOR> failed;
+        QVector<QByteArray> failedData;
+        for (int i = 0; i < sectors.size(); ++i)
+        {
+            const SECTOR& sector = sectors.at(i);
+            for (unsigned int pos = 0; pos < sector.size; pos += readChunkSize(sector.addr + pos, sector.size - pos))
+                if (!blockMatches(sector.addr + pos, expected.at(i).constData() + pos, readChunkSize(sector.addr + pos, sector.size - pos)))
+                {
+                    failed.append(sector);
+                    failedData.append(expected.at(i));
+                    break;
+                }
+        }
+        if (failed.isEmpty())
+            return;
+        if (retry >= NRETRY)
+            throw ErrorProtocolVerify();
+        retrain(failed.first().addr);
+        sectors = failed;
+        expected = failedData;
+    }
+}
+
+void Comm::erasePages(const QVector<SECTOR> &sectors)
+{
+    checkCancel();
+    if (stubActive)
+    {
+        stubErase(sectors);
+        return;
+    }
+    QVector<unsigned int> pages;
+    unsigned int maxSize = 0;
+    foreach (const SECTOR& sector, sectors)
+    {
+        pages.append(sector.index);
+        if (sector.size > maxSize)
+            maxSize = sector.size;
+    }
+    int pageTimeout = ERASE_PAGE_TIMEOUT + maxSize / 1024 * ERASE_KB_TIMEOUT;
+    for (int retry = 0;; ++retry)
+    {
+        try
+        {
+            QElapsedTimer timer;
+            timer.start();
+            if (isExtendedErase())
+                cmdEraseMemoryEx(pages, pageTimeout);
+            else
+                cmdEraseMemory(pages, pageTimeout);
+            metrics.addErase(timer.nsecsElapsed() / 1000000.0);
+            updateEraseTiming(sectors, timer.elapsed());
+            break;
+        }
+        catch (ErrorDeviceRange)
+        {
+            //nothing was sent, retry won't help
+            throw;
+        }
+        catch (...)
+        {
+            if (retry < NRETRY)
+            {
+                retrain(sectors.first().addr);
+                continue;
+            }
+            throw;
+        }
+    }
+}
+
+void Comm::updateEraseTiming(const QVector<SECTOR> &sectors, qint64 elapsed)
+{
+    double kb = 0;
+    foreach (const SECTOR& sector, sectors)
+        kb += sector.size / 1024.0;
+    //command round trip is part of page time
+    double measured = elapsed / kb;
+    if (measured > 0)
+    {
+        EraseTimings::update(eraseTimings.kbTime, measured);
+        eraseTimingsChanged = true;
+    }
+}
+
+void Comm::saveEraseTimings()
+{
+    if (!eraseTimingsChanged)
+        return;
+    eraseTimings.save(device.pid);
+    eraseTimingsChanged = false;
+}
+
+QByteArray Comm::findStubImage() const
 {
-    QFile file(fileName);
+    if (!stubImage.isEmpty())
+        return stubImage;
+    if (device.stub.isEmpty())
+        return QByteArray();
+    QFile file(QString("%1/%2/stub_%3.bin").arg(QCoreApplication::applicationDirPath()).arg(STUB_DIR_NAME).arg(device.stub));
     if (!file.open(QIODevice::ReadOnly))
-        throw ErrorFileOpen();
-    QByteArray data(file.readAll());
-    file.close();
-    flash(data, addr, verify);
+        return QByteArray();
+    return file.readAll();
+}
+
+bool Comm::startStub()
+{
+    QByteArray image(findStubImage());
+    if (image.size() < static_cast<int>(sizeof(STUB_HEADER)))
+    {
+        debug(tr("No flash loader for device\n"));
+        return false;
+    }
+    //Write Memory length must be word aligned
+    if (image.size() % 4)
+        image.append(QByteArray(4 - image.size() % 4, 0));
+    const uchar* header = reinterpret_cast<const uchar*>(image.constData());
+    unsigned int base = qFromLittleEndian<quint32>(header + offsetof(STUB_HEADER, base));
+    unsigned int sp = qFromLittleEndian<quint32>(header + offsetof(STUB_HEADER, sp));
+    unsigned int ramEnd = device.ramBase + device.ramSize;
+    stubFrameSize = qFromLittleEndian<quint32>(header + offsetof(STUB_HEADER, frameSize));
+    stubWindow = qFromLittleEndian<quint16>(header + offsetof(STUB_HEADER, window));
+    stubFeatures = qFromLittleEndian<quint32>(header + offsetof(STUB_HEADER, features));
+    if (qFromLittleEndian<quint32>(header + offsetof(STUB_HEADER, magic)) != STUB_MAGIC ||
+        qFromLittleEndian<quint16>(header + offsetof(STUB_HEADER, version)) != STUB_VERSION ||
+        base < device.ramBase || base + image.size() > ramEnd || sp > ramEnd ||
+        stubFrameSize < static_cast<unsigned int>(MAX_BLOCK_SIZE) || stubFrameSize % MAX_BLOCK_SIZE ||
+        stubWindow == 0 || stubWindow > 127 ||
+        !supportedCmds.contains(ISP_WRITE_MEMORY) || !supportedCmds.contains(ISP_GO))
+    {
+        warning(tr("Flash loader doesn't match device, using bootloader\n"));
+        return false;
+    }
+
+    try
+    {
+        info(QString(tr("Uploading flash loader to 0x%1\n")).arg(base, 8, 16, QChar('0')));
+        for (int pos = 0; pos < image.size(); pos += MAX_BLOCK_SIZE)
+        {
+            unsigned int len = qMin(MAX_BLOCK_SIZE, image.size() - pos);
+            cmdWriteMemory(base + pos, image.constData() + pos, len);
+            if (cmdReadMemory(base + pos, len) != image.mid(pos, len))
+                throw ErrorProtocolVerify();
+        }
+    }
+    catch (ErrorCancel)
+    {
+        throw;
+    }
+    catch (Exception& e)
+    {
+        warning(QString(tr("Flash loader upload: %1, using bootloader\n")).arg(e.what()));
+        return false;
+    }
+
+    bool started = false;
+    try
+    {
+        //not cmdGo, port stays open
+        MetricsScope scope(metrics, ISP_GO);
+        txReq(ISP_GO);
+        txAddr(base);
+        started = true;
+        STUB_FRAME hello(stubReceive(0, STUB_START_TIMEOUT));
+        if (hello.cmd != (STUB_HELLO | STUB_REPLY))
+            throw ErrorProtocolInvalidResponse();
+    }
+    catch (Exception& e)
+    {
+        warning(QString(tr("Flash loader start: %1, using bootloader\n")).arg(e.what()));
+        if (!started)
+            return false;
+        //bootloader is left, only DTR/RTS can bring it back
+        if (!resetLines)
+        {
+            com->close();
+            throw ErrorProtocolStubStart();
+        }
+        resetToLoader();
+        ispConnect(ACK_TIMEOUT_COUNT);
+        return false;
+    }
+    stubActive = true;
+    stubSeq = 0;
+    info(QString(tr("Flash loader started, %1 bytes frames, window %2\n")).arg(stubFrameSize).arg(stubWindow));
+    return true;
+}
+
+void Comm::stubSend(unsigned char cmd, unsigned char seq, unsigned int addr, unsigned int size, const char *data)
+{
+    STUB_FRAME frame;
+    frame.sync = STUB_SYNC;
+    frame.cmd = cmd;
+    frame.seq = seq;
+    frame.status = STUB_OK;
+    frame.addr = qToLittleEndian<quint32>(addr);
+    frame.size = qToLittleEndian<quint32>(size);
+    //READ has length only
+    unsigned int payload = data ? size : 0;
+    stubTx.resize(0);
+    stubTx.append(reinterpret_cast<const char*>(&frame), sizeof(STUB_FRAME));
+    stubTx.append(data, payload);
+    quint32 crc = qToLittleEndian<quint32>(crc32(stubTx.constData(), stubTx.size()));
+    stubTx.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+    com->write(stubTx.constData(), stubTx.size());
+    metrics.addTx(stubTx.size());
+}
+
+STUB_FRAME Comm::stubReceive(QByteArray *payload, int timeout)
+{
+    char buf[sizeof(STUB_FRAME)];
+    STUB_FRAME frame;
+    //noise before frame is skipped
+    do
+        buf[0] = rxChar(timeout);
+    while (buf[0] != static_cast<char>(STUB_SYNC));
+    for (unsigned int i = 1; i < sizeof(STUB_FRAME); ++i)
+        buf[i] = rxChar(timeout);
+    memcpy(&frame, buf, sizeof(STUB_FRAME));
+    frame.addr = qFromLittleEndian<quint32>(frame.addr);
+    frame.size = qFromLittleEndian<quint32>(frame.size);
+    if (frame.size > stubFrameSize)
+        throw ErrorProtocolInvalidResponse();
+    QByteArray data(frame.size, 0);
+    for (unsigned int i = 0; i < frame.size; ++i)
+        data[i] = rxChar(timeout);
+    uchar crc[4];
+    for (int i = 0; i < 4; ++i)
+        crc[i] = rxChar(timeout);
+    if (qFromLittleEndian<quint32>(crc) != crc32(data.constData(), data.size(), crc32(buf, sizeof(STUB_FRAME))))
+        throw ErrorProtocolInvalidResponse();
+    if (payload)
+        *payload = data;
+    return frame;
+}
+
+void Comm::stubFailed()
+{
+    //state of loader is unknown, target needs reset
+    stubActive = false;
+    com->close();
+}
+
+STUB_FRAME Comm::stubRequest(unsigned char cmd, unsigned int addr, unsigned int size, const char *data, QByteArray *payload, int timeout)
+{
+    unsigned char seq = stubSeq;
+    for (int retry = 0;; ++retry)
+    {
+        try
+        {
+            stubSend(cmd, seq, addr, size, data);
+            STUB_FRAME res;
+            //late replies of earlier requests are dropped
+            do
+                res = stubReceive(payload, timeout);
+            while (res.seq != seq || res.cmd != (cmd | STUB_REPLY));
+            if (res.status == STUB_ERROR_CRC)
+                throw ErrorProtocolInvalidResponse();
+            ++stubSeq;
+            if (res.status != STUB_OK)
+                throw ErrorProtocolStub();
+            return res;
+        }
+        catch (ErrorProtocolStub)
+        {
+            throw;
+        }
+        catch (Exception&)
+        {
+            if (retry < NRETRY)
+            {
+                retrain(addr);
+                rxClear();
+                continue;
+            }
+            stubFailed();
+            throw;
+        }
+    }
+}
+
+unsigned int Comm::stubChunkSize(unsigned int addr, unsigned int left) const
+{
+    unsigned int size = stubFrameSize - (addr % stubFrameSize);
+    return size < left ? size : left;
+}
+
+void Comm::stubFlash(const QByteArray &data, unsigned int addr, unsigned int &pos)
+{
+    unsigned int size = data.size();
+    unsigned int align = device.writeAlign();
+    markWritten(addr, size);
+    bool packed = compress && (stubFeatures & STUB_FEATURE_LZ4);
+    //tail padded with erased value
+    QByteArray padded(data);
+    if (size % align)
+        padded.append(QByteArray(align - size % align, static_cast<char>(0xff)));
+    //prepared once, resent as is after go-back
+    QVector<STUB_CHUNK> chunks;
+    quint64 wireBytes = 0;
+    for (unsigned int p = 0, step; p < size; p += step)
+    {
+        STUB_CHUNK chunk;
+        step = stubChunkSize(addr + p, size - p);
+        unsigned int len = (step + align - 1) & ~(align - 1);
+        chunk.addr = addr + p;
+        chunk.end = p + step;
+        //page is erased before flash
+        if (isBlank(padded, p, len))
+            continue;
+        chunk.cmd = STUB_WRITE;
+        chunk.payload = QByteArray::fromRawData(padded.constData() + p, len);
+        if (packed)
+        {
+            //unpacked size, LZ4 block
+            QByteArray buf(len, 0);
+            quint32 unpacked = qToLittleEndian<quint32>(len);
+            memcpy(buf.data(), &unpacked, sizeof(unpacked));
+            int packedSize = lz4Compress(padded.constData() + p, len, buf.data() + sizeof(unpacked), len - sizeof(unpacked) - 1);
+            if (packedSize)
+            {
+                buf.resize(sizeof(unpacked) + packedSize);
+                chunk.cmd = STUB_WRITE_LZ4;
+                chunk.payload = buf;
+            }
+        }
+        wireBytes += sizeof(STUB_FRAME) + chunk.payload.size() + sizeof(quint32);
+        chunks.append(chunk);
+    }
+    int count = chunks.size();
+    int base = 0, next = 0, retry = 0;
+    unsigned char firstSeq = stubSeq;
+    QElapsedTimer timer, total;
+    timer.start();
+    total.start();
+    try
+    {
+        while (base < count)
+        {
+            checkCancel();
+            //no turnaround until window is full
+            for (; next < count && next - base < static_cast<int>(stubWindow); ++next)
+            {
+                const STUB_CHUNK& chunk = chunks.at(next);
+                stubSend(chunk.cmd, static_cast<unsigned char>(firstSeq + next), chunk.addr, chunk.payload.size(), chunk.payload.constData());
+            }
+            STUB_FRAME res;
+            try
+            {
+                res = stubReceive(0, PORT_DEFAULT_TIMEOUT);
+            }
+            catch (Exception&)
+            {
+                if (++retry > NRETRY)
+                    throw;
+                //go back to first unacknowledged frame
+                retrain(chunks.at(base).addr);
+                rxClear();
+                next = base;
+                continue;
+            }
+            int acked = static_cast<unsigned char>(res.seq - firstSeq - base);
+            //late reply of frame before go-back
+            if ((res.cmd != (STUB_WRITE | STUB_REPLY) && res.cmd != (STUB_WRITE_LZ4 | STUB_REPLY)) || acked >= next - base)
+                continue;
+            if (res.status == STUB_ERROR_CRC)
+            {
+                //frames after damaged one are dropped by loader
+                if (++retry > NRETRY)
+                    throw ErrorProtocolInvalidResponse();
+                retrain(chunks.at(base).addr);
+                next = base;
+                continue;
+            }
+            if (res.status != STUB_OK)
+            {
+                //frames in flight are still programmed, their replies are dropped
+                while (res.seq != static_cast<unsigned char>(firstSeq + next - 1))
+                    res = stubReceive(0, PORT_DEFAULT_TIMEOUT);
+                stubSeq = firstSeq + next;
+                throw ErrorProtocolStub();
+            }
+            //replies are in order, lost one is acknowledged by next
+            base += acked + 1;
+            retry = 0;
+            metrics.addProgram(chunks.at(base - 1).end - pos, timer.nsecsElapsed() / 1000000.0);
+            timer.start();
+            pos = chunks.at(base - 1).end;
+            emit progress(pos, size);
+        }
+        pos = size;
+    }
+    catch (ErrorProtocolStub)
+    {
+        throw;
+    }
+    catch (...)
+    {
+        stubFailed();
+        throw;
+    }
+    stubSeq = firstSeq + count;
+
+    transfer.rawBytes += size;
+    transfer.wireBytes += wireBytes;
+    transfer.time += total.elapsed();
+    qint64 ms = total.elapsed() ? total.elapsed() : 1;
+    info(QString(tr("\nCompression %1:1, %2 bytes/s effective, line %3 bytes/s\n"))
+         .arg(wireBytes ? double(size) / wireBytes : 0, 0, 'f', 2).arg(static_cast<qint64>(size) * 1000 / ms).arg(portSpeed / BITS_PER_CHAR));
+}
+
+void Comm::stubErase(const QVector<SECTOR> &sectors)
+{
+    unsigned int perFrame = stubFrameSize / 4;
+    for (int i = 0; i < sectors.size(); i += perFrame)
+    {
+        QVector<SECTOR> batch(sectors.mid(i, perFrame));
+        QByteArray pages;
+        int timeout = PORT_DEFAULT_TIMEOUT;
+        foreach (const SECTOR& sector, batch)
+        {
+            quint32 page = qToLittleEndian<quint32>(sector.addr);
+            pages.append(reinterpret_cast<const char*>(&page), sizeof(page));
+            timeout += ERASE_PAGE_TIMEOUT + sector.size / 1024 * ERASE_KB_TIMEOUT;
+        }
+        QElapsedTimer timer;
+        timer.start();
+        stubRequest(STUB_ERASE, batch.first().addr, pages.size(), pages.constData(), 0, timeout);
+        metrics.addErase(timer.nsecsElapsed() / 1000000.0);
+        foreach (const SECTOR& sector, batch)
+            markErased(sector.index);
+    }
+}
+
+void Comm::leaveStub()
+{
+    stubRequest(STUB_EXIT, 0, 0, 0, 0);
+    stubActive = false;
+    rxClear();
+    ispStart(ACK_TIMEOUT_COUNT);
+}
+
+DUMP_HASH Comm::dump(const QString &fileName, unsigned int addr, unsigned int size)
+{
+    DumpFile file(fileName, size);
+    unsigned int i, pos = 0;
+    try
+    {
+        info(QString(QObject::tr("Dumping 0x%1-0x%2")).arg(addr, 8, 16, QChar('0')).arg(addr + size, 8, 16, QChar('0')));
+        for (i = 0; pos < size; ++i)
+        {
+            unsigned int len = chunkSize(addr + pos, size - pos);
+            file.write(readBlock(addr + pos, len));
+            pos += len;
+            emit progress(pos, size);
+            if (i && ((i % REFRESH_RATE) == 0))
+                info(".");
+        }
+        info(QObject::tr(".Ok!\n"));
+    }
+    catch (...)
+    {
+        info(QString(QObject::tr(".Fail! at 0x%1\n").arg(addr + pos, 8, 16, QChar('0'))));
+        throw;
+    }
+    DUMP_HASH hash(file.finish());
+    info(QString(QObject::tr("CRC32: %1, SHA-256: %2\n")).arg(hash.crc32, 8, 16, QChar('0')).arg(QString(hash.sha256.toHex())));
+    return hash;
+}
+
+void Comm::erase(unsigned int addr, unsigned int size)
+{
+    if (size == 0)
+        return;
+    eraseSectors(flashSectors(addr, size));
+}
+
+QVector<SECTOR> Comm::segmentSectors(const QVector<SEGMENT> &segments) const
+{
+    QMap<unsigned int, SECTOR> sectors;
+    foreach (const SEGMENT& segment, segments)
+        foreach (const SECTOR& sector, flashSectors(segment.addr, segment.data.size()))
+            sectors.insert(sector.index, sector);
+    return sectors.values().toVector();
+}
+
+void Comm::markWritten(unsigned int addr, unsigned int size)
+{
+    foreach (const SECTOR& sector, device.sectors(addr, size))
+        erasedSectors.remove(sector.index);
+}
+
+QVector<SEGMENT> Comm::mergeSegments(const QVector<SEGMENT> &segments, bool readGaps)
+{
+    QVector<SEGMENT> res;
+    foreach (const SEGMENT& segment, segments)
+    {
+        if (!res.isEmpty() && segment.data.size())
+        {
+            SEGMENT& last = res.last();
+            unsigned int end = last.addr + last.data.size();
+            QVector<SECTOR> tail(device.sectors(end - 1, 1));
+            QVector<SECTOR> head(device.sectors(segment.addr, 1));
+            if (end <= segment.addr && !tail.isEmpty() && !head.isEmpty() && tail.first().index == head.first().index)
+            {
+                //blocks stay full size, cells not covered by image keep their content
+                if (erasedSectors.contains(head.first().index))
+                    last.data.append(QByteArray(segment.addr - end, static_cast<char>(0xff)));
+                else if (readGaps)
+                {
+                    for (unsigned int pos = end; pos < segment.addr; )
+                    {
+                        unsigned int len = readChunkSize(pos, segment.addr - pos);
+                        last.data.append(readBlock(pos, len));
+                        pos += len;
+                    }
+                }
+                else
+                {
+                    res.append(segment);
+                    continue;
+                }
+                last.data.append(segment.data);
+                continue;
+            }
+        }
+        res.append(segment);
+    }
+    return res;
+}
+
+void Comm::eraseSectors(const QVector<SECTOR> &sectors)
+{
+    int i = 0;
+    if (sectors.isEmpty())
+        return;
+    try
+    {
+        info(QString(QObject::tr("Erasing 0x%1-0x%2")).arg(sectors.first().addr, 8, 16, QChar('0')).arg(sectors.last().addr + sectors.last().size, 8, 16, QChar('0')));
+        for (i = 0; i < sectors.size(); i += ERASE_BATCH_MAX)
+        {
+            erasePages(sectors.mid(i, ERASE_BATCH_MAX));
+            emit progress(i + sectors.mid(i, ERASE_BATCH_MAX).size(), sectors.size());
+            info(".");
+        }
+        info(QObject::tr(".Ok!\n"));
+        saveEraseTimings();
+    }
+    catch (...)
+    {
+        info(QString(QObject::tr(".Fail! at 0x%1\n").arg(sectors.at(i).addr, 8, 16, QChar('0'))));
+        throw;
+    }
+}
+
+void Comm::eraseAuto(const QVector<SEGMENT> &segments, bool allowExtra)
+{
+    if (segments.isEmpty())
+        return;
+    //gaps may only be destroyed if allowed
+    if (allowExtra)
+        eraseAuto(segments.first().addr, segments.last().addr + segments.last().data.size() - segments.first().addr, true);
+    else
+        eraseSectors(segmentSectors(segments));
+}
+
+ERASE_PLAN Comm::eraseAuto(unsigned int addr, unsigned int size, bool allowExtra, bool dryRun)
+{
+    ErasePlanner planner(device, supportedCmds.contains(ISP_ERASE_MEMORY_EX), eraseTimings);
+    //bank and mass erase are bootloader commands, loader erases pages
+    ERASE_PLAN plan(planner.plan(addr, size, allowExtra && !stubActive));
+    info(ErasePlanner::describe(plan));
+    if (dryRun || size == 0)
+        return plan;
+
+    QElapsedTimer timer;
+    switch (plan.method)
+    {
+    case ERASE_METHOD_BANK:
+        foreach (unsigned int bank, plan.banks)
+        {
+            info(QString(QObject::tr("Erasing bank %1\n")).arg(bank == ISP_ERASE_BANK1 ? 1 : 2));
+            timer.start();
+            cmdEraseMemoryEx(bank, ERASE_MASS_TIMEOUT);
+            metrics.addErase(timer.nsecsElapsed() / 1000000.0);
+            EraseTimings::update(eraseTimings.bankTime, timer.elapsed());
+        }
+        eraseTimings.save(device.pid);
+        break;
+    case ERASE_METHOD_MASS:
+        info(QObject::tr("Mass erasing\n"));
+        timer.start();
+        resyncTime = 0;
+        if (supportedCmds.contains(ISP_ERASE_MEMORY_EX))
+            cmdEraseMemoryEx(ISP_MASS_ERASE, ERASE_MASS_TIMEOUT);
+        else
+            cmdEraseMemory(ISP_MASS_ERASE, ERASE_MASS_TIMEOUT);
+        //resync is part of reset time
+        metrics.addErase(timer.nsecsElapsed() / 1000000.0 - resyncTime);
+        EraseTimings::update(eraseTimings.massTime, timer.elapsed() - resyncTime);
+        if (!isActive())
+        {
+            timer.start();
+            reconnect();
+            resyncTime += timer.elapsed();
+        }
+        if (resyncTime)
+            EraseTimings::update(eraseTimings.resetTime, resyncTime);
+        eraseTimings.save(device.pid);
+        break;
+    default:
+        erase(addr, size);
+        break;
+    }
+    return plan;
+}
+
+void Comm::flash(const QByteArray &data, unsigned int addr, bool verify)
+{
+    verifyTime = 0;
+    unsigned int i, pos = 0;
+    unsigned int size = data.size();
+    try
+    {
+        info(QString(QObject::tr("Flashing")));
+        if (stubActive)
+            stubFlash(data, addr, pos);
+        for (i = 0; pos < size; ++i)
+        {
+            unsigned int len = chunkSize(addr + pos, size - pos);
+            //no copy, only unaligned tail is padded with erased value
+            QByteArray chunk(QByteArray::fromRawData(data.constData() + pos, len));
+            if (len % device.writeAlign())
+                chunk = data.mid(pos, len) + QByteArray(device.writeAlign() - (len % device.writeAlign()), static_cast<char>(0xff));
+            writeBlock(addr + pos, chunk, verify && !deferredVerify);
+            pos += len;
+            emit progress(pos, size);
+            if (i && ((i % REFRESH_RATE) == 0))
+                info(".");
+        }
+        info(QObject::tr(".Ok!\n"));
+    }
+    catch (...)
+    {
+        info(QString(QObject::tr(".Fail! at 0x%1\n").arg(addr + pos, 8, 16, QChar('0'))));
+        throw;
+    }
+    if (verify && deferredVerify)
+        verifyDeferred(data, addr);
+    //page repairs and diff erases
+    saveEraseTimings();
+}
+
+void Comm::flash(const QVector<SEGMENT> &segments, bool verify)
+{
+    qint64 total = 0;
+    foreach (const SEGMENT& segment, mergeSegments(segments, false))
+    {
+        flash(segment.data, segment.addr, verify);
+        total += verifyTime;
+    }
+    verifyTime = total;
+}
+
+void Comm::flash(const QString &fileName, unsigned int addr, bool verify)
+{
+    ImageFile image(fileName);
+    flash(image.data(), addr, verify);
+}
+
+void Comm::verify(const QByteArray &data, unsigned int addr)
+{
+    QElapsedTimer timer;
+    timer.start();
+    unsigned int pos = 0;
+    unsigned int size = data.size();
+    try
+    {
+        info(QString(QObject::tr("Verifying 0x%1-0x%2")).arg(addr, 8, 16, QChar('0')).arg(addr + size, 8, 16, QChar('0')));
+        if (!mismatchSectors(data, addr, pos).isEmpty())
+            throw ErrorProtocolVerify();
+        verifyTime = timer.elapsed();
+        metrics.addVerify(size, timer.nsecsElapsed() / 1000000.0);
+        info(QString(QObject::tr(".Ok! %1ms\n")).arg(verifyTime));
+    }
+    catch (...)
+    {
+        verifyTime = timer.elapsed();
+        info(QString(QObject::tr(".Fail! at 0x%1\n").arg(addr + pos, 8, 16, QChar('0'))));
+        throw;
+    }
+}
+
+void Comm::verify(const QVector<SEGMENT> &segments)
+{
+    qint64 total = 0;
+    foreach (const SEGMENT& segment, segments)
+    {
+        verify(segment.data, segment.addr);
+        total += verifyTime;
+    }
+    verifyTime = total;
+}
+
+void Comm::verify(const QString &fileName, unsigned int addr)
+{
+    ImageFile image(fileName);
+    verify(image.data(), addr);
+}
+
+void Comm::flashDiff(const QByteArray &data, unsigned int addr, bool verify, const QByteArray &snapshot, unsigned int snapshotAddr)
+{
+    QElapsedTimer timer;
+    qint64 readTime = 0, writeTime = 0, eraseTime = 0;
+    unsigned int readBytes = 0, writtenBytes = 0, erasedPages = 0;
+    unsigned int skippedBytes = 0, skippedErases = 0;
+    unsigned int size = data.size();
+    unsigned int align = device.writeAlign();
+    QVector<SECTOR> sectors(flashSectors(addr, size));
+    QVector<SECTOR> dirty;
+    QVector<QByteArray> dirtyData;
+    unsigned int failAddr = addr;
+    verifyTime = 0;
+    try
+    {
+        info(QString(QObject::tr("Differential flashing 0x%1-0x%2")).arg(addr, 8, 16, QChar('0')).arg(addr + size, 8, 16, QChar('0')));
+        for (int i = 0; i < sectors.size(); ++i)
+        {
+            unsigned int page = failAddr = sectors.at(i).addr;
+            unsigned int pageSize = sectors.at(i).size;
+            //aligned part of the page covered by image
+            unsigned int from = (page < addr ? addr : page) & ~(align - 1);
+            unsigned int to = page + pageSize < addr + size ? page + pageSize : addr + size;
+            to = (to + align - 1) & ~(align - 1);
+
+            QByteArray current;
+            if (snapshotAddr <= page && page + pageSize <= snapshotAddr + snapshot.size())
+                current = snapshot.mid(page - snapshotAddr, pageSize);
+            else
+            {
+                timer.start();
+                for (unsigned int pos = 0; pos < pageSize; pos += chunkSize(page + pos, pageSize - pos))
+                    current += readBlock(page + pos, chunkSize(page + pos, pageSize - pos));
+                readTime += timer.elapsed();
+                readBytes += pageSize;
+            }
+
+            QByteArray merged(current);
+            unsigned int start = from < addr ? addr : from;
+            unsigned int end = to < addr + size ? to : addr + size;
+            merged.replace(start - page, end - start, data.mid(start - addr, end - start));
+
+            if (merged == current)
+            {
+                skippedBytes += end - start;
+                ++skippedErases;
+            }
+            else if (isBlank(current, from - page, to - from))
+            {
+                //only programming required
+                ++skippedErases;
+                timer.start();
+                for (unsigned int pos = from; pos < to; pos += chunkSize(pos, to - pos))
+                    writeBlock(pos, QByteArray::fromRawData(merged.constData() + (pos - page), chunkSize(pos, to - pos)), verify && !deferredVerify);
+                writeTime += timer.elapsed();
+                writtenBytes += to - from;
+            }
+            else
+            {
+                dirty.append(sectors.at(i));
+                dirtyData.append(merged);
+            }
+            emit progress(i + 1, sectors.size());
+            if (i && ((i % REFRESH_RATE) == 0))
+                info(".");
+        }
+
+        if (!dirty.isEmpty())
+        {
+            failAddr = dirty.first().addr;
+            timer.start();
+            erasePages(dirty);
+            eraseTime += timer.elapsed();
+            erasedPages = dirty.size();
+        }
+        timer.start();
+        for (int i = 0; i < dirty.size(); ++i)
+        {
+            unsigned int page = failAddr = dirty.at(i).addr;
+            unsigned int pageSize = dirty.at(i).size;
+            for (unsigned int pos = page; pos < page + pageSize; pos += chunkSize(pos, page + pageSize - pos))
+            {
+                QByteArray chunk(QByteArray::fromRawData(dirtyData.at(i).constData() + (pos - page), chunkSize(pos, page + pageSize - pos)));
+                //already erased
+                if (isBlank(chunk, 0, chunk.size()))
+                    continue;
+                writeBlock(pos, chunk, verify && !deferredVerify);
+                writtenBytes += chunk.size();
+            }
+            emit progress(i + 1, dirty.size());
+            if (i && ((i % REFRESH_RATE) == 0))
+                info(".");
+        }
+        writeTime += timer.elapsed();
+        info(QObject::tr(".Ok!\n"));
+    }
+    catch (...)
+    {
+        info(QString(QObject::tr(".Fail! at 0x%1\n").arg(failAddr, 8, 16, QChar('0'))));
+        throw;
+    }
+
+    //no measured writes - program time is close to read-back time for same amount of bytes
+    double byteTime = writtenBytes ? double(writeTime) / writtenBytes : (readBytes ? double(readTime) / readBytes : 0);
+    double pageEraseTime = erasedPages ? double(eraseTime) / erasedPages : ERASE_PAGE_TIME;
+    qint64 saved = static_cast<qint64>(skippedBytes * byteTime + skippedErases * pageEraseTime) - readTime;
+    info(QString(QObject::tr("Skipped %1 of %2 bytes, %3 page erases. Read-back %4ms, estimated time saved %5ms\n"))
+         .arg(skippedBytes).arg(size).arg(skippedErases).arg(readTime).arg(saved));
+    if (verify && deferredVerify)
+        verifyDeferred(data, addr);
+    //page repairs and diff erases
+    saveEraseTimings();
+}
+
+void Comm::flashDiff(const QVector<SEGMENT> &segments, bool verify)
+{
+    qint64 total = 0;
+    foreach (const SEGMENT& segment, mergeSegments(segments, true))
+    {
+        flashDiff(segment.data, segment.addr, verify);
+        total += verifyTime;
+    }
+    verifyTime = total;
 }
 
+void Comm::flashDiff(const QString &fileName, unsigned int addr, bool verify)
+{
+    ImageFile image(fileName);
+    flashDiff(image.data(), addr, verify);
+}
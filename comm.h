@@ -9,16 +9,24 @@
 
 #include <QObject>
 #include <QStringList>
-#include <QColor>
 #include <QVector>
+#include <QSet>
+#include <QAtomicInt>
 #include "common.h"
 #include "error.h"
+#include "device.h"
+#include "config.h"
+#include "eraseplanner.h"
+#include "metrics.h"
+#include "dumpfile.h"
+#include "firmware.h"
+#include "stubproto.h"
 
 const unsigned int ISP_MASS_ERASE =                             0xffff;
 const unsigned int ISP_ERASE_BANK1 =                            0xfffe;
 const unsigned int ISP_ERASE_BANK2 =                            0xfffd;
 
-class QSerialPort;
+class Transport;
 
 class ErrorPort: public Exception
 {
@@ -80,38 +88,222 @@ public:
     ErrorProtocolVerify() throw() :ErrorProtocol() {str = (QObject::tr("Page VERIFY failed"));}
 };
 
+class ErrorProtocolStub: public ErrorProtocol
+{
+public:
+    ErrorProtocolStub() throw() :ErrorProtocol() {str = (QObject::tr("Flash loader error"));}
+};
+
+class ErrorProtocolStubStart: public ErrorProtocol
+{
+public:
+    ErrorProtocolStubStart() throw() :ErrorProtocol() {str = (QObject::tr("Flash loader didn't start, reset device to bootloader"));}
+};
+
+class ErrorProtocolResync: public ErrorProtocol
+{
+public:
+    ErrorProtocolResync() throw() :ErrorProtocol() {str = (QObject::tr("No bootloader response after device reset"));}
+};
+
+class ErrorDeviceRange: public Exception
+{
+public:
+    ErrorDeviceRange() throw() :Exception() {str = (QObject::tr("Address is out of device flash"));}
+};
+
+//loader write frame, prepared before window loop
+typedef struct {
+    unsigned int addr;
+    //data offset after frame
+    unsigned int end;
+    unsigned char cmd;
+    QByteArray payload;
+} STUB_CHUNK;
+
+//loader writes since open
+typedef struct {
+    quint64 rawBytes;
+    quint64 wireBytes;
+    //ms
+    qint64 time;
+} TRANSFER_STATS;
+
 class Comm : public QObject
 {
     Q_OBJECT
 private:
-    QSerialPort* com;
+    Transport* com;
     QVector<unsigned char> supportedCmds;
+    unsigned int blockSize;
+    DeviceDatabase devices;
+    Device device;
+    EraseTimings eraseTimings;
+    QString portName;
+    unsigned int portSpeed;
+    unsigned char loaderVersion;
+    unsigned int retries;
+    const QAtomicInt* cancelFlag;
+    CommMetrics metrics;
+    bool deferredVerify, checksumVerify;
+    //checksum command failed once, read back for the rest of session
+    bool checksumFailed;
+    //DTR/RTS pulse after resetting commands, BOOT0 is not strapped high
+    bool resetLines;
+    //last resync after resetting command, ms
+    qint64 resyncTime;
+    //page timing is saved once at the end of operation
+    bool eraseTimingsChanged;
+    qint64 verifyTime;
+    //transport is read in chunks, bytes are taken from here
+    QByteArray rxBuf;
+    int rxPos, rxLen;
+    //frame under construction, checksum is accumulated by frameAppend
+    char txBuf[TX_BUFFER_SIZE];
+    int txLen;
+    char txCrc;
+    //RAM flash loader, replaces bootloader commands while active
+    bool stubEnabled, stubActive;
+    QByteArray stubImage, stubTx;
+    unsigned int stubFrameSize, stubWindow, stubFeatures;
+    unsigned char stubSeq;
+    bool compress;
+    TRANSFER_STATS transfer;
+    //page indexes erased and not written since, gaps there may be padded with 0xff
+    QSet<unsigned int> erasedSectors;
 
 protected:
-    void info(const QString& text, const QColor& color = Qt::black) {log(LOG_TYPE_DEFAULT, text, color);}
+    void info(const QString& text, Qt::GlobalColor color = Qt::black) {log(LOG_TYPE_DEFAULT, text, color);}
     void hint(const QString& text) {log(LOG_TYPE_HINT, text, Qt::black);}
     void warning(const QString& text) {log(LOG_TYPE_WARNING, text, Qt::black);}
     void error(const QString& text) {log(LOG_TYPE_ERROR, text, Qt::black);}
     void debug(const QString& text) {log(LOG_TYPE_DEBUG, text, Qt::black);}
 
-    void ispStart();
+    void checkCancel();
+    //ackOnly: NACK of session before reset is ignored
+    void ispStart(int count, bool ackOnly = false);
+    void ispConnect(int syncCount);
+    //after mass erase and readout (un)protect: port stays open, sync is retried on measured
+    //reset time, commands, PID and loader are restored. On failure port is closed and
+    //ErrorProtocolResync is thrown
+    void resync(unsigned char cmd, bool restoreStub);
+    void openPort(const QString& name, unsigned int speed);
+    //read-back test at current speed, any error fails
+    bool probeSpeed();
+    bool rxFill(int timeout);
+    void rxClear();
     QByteArray rx(unsigned int maxSize);
-    unsigned char rxChar();
-    void rxAck();
-    void tx(const QByteArray& buf);
+    unsigned char rxChar(int timeout = PORT_DEFAULT_TIMEOUT);
+    void rxAck(int timeout = PORT_DEFAULT_TIMEOUT);
+    void frameStart() {txLen = 0; txCrc = 0;}
+    void frameAppend(char c) {Q_ASSERT(txLen + 1 < TX_BUFFER_SIZE); txBuf[txLen++] = c; txCrc ^= c;}
+    void frameAppend(const char* data, int size);
+    //checksum appended, one transport write
+    void frameSend(int timeout = PORT_DEFAULT_TIMEOUT);
     void txAck();
     void txReq(unsigned char cmd);
     void txAddr(unsigned int addr);
+
+    unsigned int chunkSize(unsigned int addr, unsigned int left) const;
+    //MAX_BLOCK_SIZE read-back chunks, independent of blockSize
+    unsigned int readChunkSize(unsigned int addr, unsigned int left) const;
+    void retrain(unsigned int addr);
+    QByteArray readBlock(unsigned int addr, unsigned int size);
+    void writeBlock(unsigned int addr, const QByteArray& chunk, bool verify);
+    //read back once more on mismatch, the Read Memory payload has no checksum
+    bool blockMatches(unsigned int addr, const char* expected, unsigned int size);
+    //read-back of the programmed image, mismatching pages are rewritten
+    void verifyDeferred(const QByteArray& data, unsigned int addr);
+    //flash loader CRC is available
+    bool canChecksum() const;
+    //false if target CRC differs or range can't be checksummed
+    bool crcMatches(unsigned int addr, const char* data, unsigned int size);
+    //one checksum per page, only mismatching pages are read back. pos - first bad byte or size
+    QVector<SECTOR> mismatchSectors(const QByteArray& data, unsigned int addr, unsigned int& pos);
+    void repairSectors(QVector<SECTOR> sectors, const QByteArray& data, unsigned int addr);
+    void erasePages(const QVector<SECTOR>& sectors);
+    void updateEraseTiming(const QVector<SECTOR>& sectors, qint64 elapsed);
+    void saveEraseTimings();
+    void selectDevice(unsigned short pid);
+    QVector<SECTOR> flashSectors(unsigned int addr, unsigned int size) const;
+    //pages covered by segments, each once
+    QVector<SECTOR> segmentSectors(const QVector<SEGMENT>& segments) const;
+    void markErased(unsigned int index) {erasedSectors.insert(index);}
+    void markWritten(unsigned int addr, unsigned int size);
+    //joins segments separated by a gap inside one page: erased gap is padded with 0xff,
+    //programmed one is filled from flash if readGaps, else segments are kept apart
+    QVector<SEGMENT> mergeSegments(const QVector<SEGMENT>& segments, bool readGaps);
+    void eraseSectors(const QVector<SECTOR>& sectors);
+
+    //explicit image or stub/stub_<variant>.bin next to binary, empty if none
+    QByteArray findStubImage() const;
+    void stubSend(unsigned char cmd, unsigned char seq, unsigned int addr, unsigned int size, const char* data);
+    STUB_FRAME stubReceive(QByteArray* payload, int timeout);
+    //single request, same seq is resent on errors. Session is closed if retries are exhausted
+    STUB_FRAME stubRequest(unsigned char cmd, unsigned int addr, unsigned int size, const char* data, QByteArray* payload, int timeout = PORT_DEFAULT_TIMEOUT);
+    void stubFailed();
+    unsigned int stubChunkSize(unsigned int addr, unsigned int left) const;
+    //windowed write, pos follows acknowledged bytes
+    void stubFlash(const QByteArray& data, unsigned int addr, unsigned int& pos);
+    void stubErase(const QVector<SECTOR>& sectors);
+    //back to ROM bootloader, called before any bootloader command
+    void leaveStub();
 public:
     explicit Comm(QObject *parent = 0);
     virtual ~Comm();
 
     bool isActive();
+    //speed 0: auto, see openAuto
     void open(const QString& name, unsigned int speed);
+    //fastest clean rate of AUTO_BAUD_RATES, cached per port and PID. Needs DTR/RTS reset wiring
+    unsigned int openAuto(const QString& name);
+    //DTR/RTS reset into bootloader
+    void resetToLoader();
+    //pulse DTR/RTS on resync too
+    void setResetLines(bool enabled) {resetLines = enabled;}
+    bool isResetLines() const {return resetLines;}
     void close();
+    void reconnect();
 
-    QStringList ports();
+    static QStringList ports();
+    //"auto" gives 0, see open(). False on other non-numeric or zero rate
+    static bool parseSpeed(const QString& text, unsigned int& speed);
+    //set by job owner, checked between blocks
+    void setCancelFlag(const QAtomicInt* flag) {cancelFlag = flag;}
+    bool isExtendedErase() const;
 
+    unsigned int getBlockSize() const {return blockSize;}
+    void setBlockSize(unsigned int size);
+    void loadDevices(const QString& fileName);
+    const Device& getDevice() const {return device;}
+    unsigned char getLoaderVersion() const {return loaderVersion;}
+    const QString& getPortName() const {return portName;}
+    unsigned int getSpeed() const {return portSpeed;}
+    //block retries since open
+    unsigned int getRetries() const {return retries;}
+    //upload RAM flash loader on open, bootloader is used if it fails
+    void setStubEnabled(bool enabled) {stubEnabled = enabled;}
+    //instead of stub/ lookup by device
+    void setStubImage(const QByteArray& image) {stubImage = image;}
+    bool isStubActive() const {return stubActive;}
+    //LZ4 frames if loader supports them and they are shorter
+    void setCompress(bool enabled) {compress = enabled;}
+    bool isCompress() const {return compress;}
+    const TRANSFER_STATS& getTransferStats() const {return transfer;}
+    //false - bootloader is used. Bootloader is left after Go: without reset lines port is closed and
+    //ErrorProtocolStubStart is thrown
+    bool startStub();
+    //false - each block is read back right after it is written
+    void setDeferredVerify(bool deferred) {deferredVerify = deferred;}
+    bool isDeferredVerify() const {return deferredVerify;}
+    //false - verify always reads whole image back
+    void setChecksumVerify(bool enabled) {checksumVerify = enabled;}
+    bool isChecksumVerify() const {return checksumVerify;}
+    //last verify pass including repairs, ms
+    qint64 getVerifyTime() const {return verifyTime;}
+    //thread safe, cumulative since construction or reset
+    COMM_METRICS getMetrics() const {return metrics.snapshot();}
+    void resetMetrics() {metrics.reset();}
 
     unsigned char cmdGet();
     unsigned char cmdGetVersion();
@@ -119,17 +311,32 @@ public:
     QByteArray cmdReadMemory(unsigned int addr, unsigned int size);
     void cmdGo(unsigned int addr);
     void cmdWriteMemory(unsigned int addr, const QByteArray& data);
-    void cmdEraseMemory(unsigned int page);
-    void cmdEraseMemoryEx(unsigned int page);
+    void cmdWriteMemory(unsigned int addr, const char* data, unsigned int size);
+    void cmdEraseMemory(unsigned int page, int timeout = PORT_DEFAULT_TIMEOUT);
+    void cmdEraseMemory(const QVector<unsigned int>& pages, int pageTimeout = ERASE_PAGE_TIMEOUT);
+    void cmdEraseMemoryEx(unsigned int page, int timeout = PORT_DEFAULT_TIMEOUT);
+    void cmdEraseMemoryEx(const QVector<unsigned int>& pages, int pageTimeout = ERASE_PAGE_TIMEOUT);
     void cmdReadoutProtect();
     void cmdReadoutUnProtect();
 
-    void dump(const QString& fileName, unsigned int addr, unsigned int size);
+    //returns hash of data written
+    DUMP_HASH dump(const QString& fileName, unsigned int addr, unsigned int size);
     void erase(unsigned int addr, unsigned int size);
+    ERASE_PLAN eraseAuto(unsigned int addr, unsigned int size, bool allowExtra, bool dryRun = false);
+    //only pages under segments, whole span if allowExtra
+    void eraseAuto(const QVector<SEGMENT>& segments, bool allowExtra);
     void flash(const QByteArray& data, unsigned int addr, bool verify = true);
     void flash(const QString& fileName, unsigned int addr, bool verify = true);
+    void flash(const QVector<SEGMENT>& segments, bool verify = true);
+    void verify(const QByteArray& data, unsigned int addr);
+    void verify(const QString& fileName, unsigned int addr);
+    void verify(const QVector<SEGMENT>& segments);
+    void flashDiff(const QByteArray& data, unsigned int addr, bool verify = true, const QByteArray& snapshot = QByteArray(), unsigned int snapshotAddr = 0);
+    void flashDiff(const QString& fileName, unsigned int addr, bool verify = true);
+    void flashDiff(const QVector<SEGMENT>& segments, bool verify = true);
 signals:
-    void log(LOG_TYPE type, const QString& text, const QColor& color);
+    void log(LOG_TYPE type, const QString& text, Qt::GlobalColor color);
+    void progress(unsigned int done, unsigned int total);
 
 
 public slots:
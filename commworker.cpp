@@ -0,0 +1,157 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "commworker.h"
+#include "comm.h"
+#include "error.h"
+#include "recipe.h"
+#include <QThread>
+#include <QMetaType>
+
+CommJob::CommJob(const JOB_PARAMS &params, QObject *parent) :
+    QObject(parent),
+    params(params),
+    cancelled(0)
+{
+}
+
+CommWorker::CommWorker(Comm *comm) :
+    QObject(0),
+    comm(comm)
+{
+}
+
+void CommWorker::execute(const JOB_PARAMS &params)
+{
+    Recipe recipe;
+    if (params.type == JOB_RECIPE)
+    {
+        recipe.load(params.fileName);
+        //same thread, log goes out with Comm's own
+        connect(&recipe, SIGNAL(log(LOG_TYPE,QString,Qt::GlobalColor)), comm, SIGNAL(log(LOG_TYPE,QString,Qt::GlobalColor)));
+    }
+    comm->open(params.port, params.speed);
+    try
+    {
+        switch (params.type)
+        {
+        case JOB_FLASH:
+        {
+            //address is used for raw binary only
+            Firmware firmware;
+            firmware.load(params.fileName, params.addr);
+            if (params.diff)
+                comm->flashDiff(firmware.getSegments(), params.verify);
+            else
+            {
+                if (params.size)
+                    comm->eraseAuto(params.addr, params.size, params.wipe);
+                else
+                    comm->eraseAuto(firmware.getSegments(), params.wipe);
+                comm->flash(firmware.getSegments(), params.verify);
+            }
+            break;
+        }
+        case JOB_DUMP:
+            comm->dump(params.fileName, params.addr, params.size);
+            break;
+        case JOB_ERASE:
+            comm->eraseAuto(params.addr, params.size, params.wipe);
+            break;
+        case JOB_MASS_ERASE:
+            if (comm->isExtendedErase())
+                comm->cmdEraseMemoryEx(ISP_MASS_ERASE, ERASE_MASS_TIMEOUT);
+            else
+                comm->cmdEraseMemory(ISP_MASS_ERASE, ERASE_MASS_TIMEOUT);
+            break;
+        case JOB_PROTECT:
+            comm->cmdReadoutProtect();
+            break;
+        case JOB_UNPROTECT:
+            comm->cmdReadoutUnProtect();
+            break;
+        case JOB_RECIPE:
+            recipe.run(comm);
+            break;
+        }
+        comm->close();
+    }
+    catch (...)
+    {
+        comm->close();
+        throw;
+    }
+}
+
+void CommWorker::run(CommJob *job)
+{
+    bool ok = false;
+    QString err;
+    comm->setCancelFlag(job->cancelFlag());
+    connect(comm, SIGNAL(progress(uint,uint)), job, SIGNAL(progress(uint,uint)));
+    try
+    {
+        if (job->isCancelled())
+            throw ErrorCancel();
+        execute(job->getParams());
+        ok = true;
+    }
+    catch (Exception& e)
+    {
+        err = e.what();
+    }
+    catch (...)
+    {
+        err = tr("Unhandled exception");
+    }
+    disconnect(comm, SIGNAL(progress(uint,uint)), job, SIGNAL(progress(uint,uint)));
+    comm->setCancelFlag(0);
+    job->finish(ok, err);
+}
+
+CommQueue::CommQueue(QObject *parent) :
+    QObject(parent)
+{
+    qRegisterMetaType<LOG_TYPE>("LOG_TYPE");
+    qRegisterMetaType<Qt::GlobalColor>("Qt::GlobalColor");
+    qRegisterMetaType<CommJob*>("CommJob*");
+    thread = new QThread(this);
+    comm = new Comm();
+    worker = new CommWorker(comm);
+    comm->moveToThread(thread);
+    worker->moveToThread(thread);
+    thread->start();
+}
+
+CommQueue::~CommQueue()
+{
+    cancelAll();
+    thread->quit();
+    thread->wait();
+    delete worker;
+    delete comm;
+}
+
+CommJob* CommQueue::enqueue(const JOB_PARAMS &params)
+{
+    CommJob* job = new CommJob(params, this);
+    jobs.append(job);
+    connect(job, SIGNAL(finished(bool,QString)), this, SLOT(jobFinished()));
+    //worker event queue keeps jobs order
+    QMetaObject::invokeMethod(worker, "run", Qt::QueuedConnection, Q_ARG(CommJob*, job));
+    return job;
+}
+
+void CommQueue::cancelAll()
+{
+    foreach (CommJob* job, jobs)
+        job->cancel();
+}
+
+void CommQueue::jobFinished()
+{
+    jobs.removeOne(static_cast<CommJob*>(sender()));
+}
@@ -0,0 +1,101 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef COMMWORKER_H
+#define COMMWORKER_H
+
+#include <QObject>
+#include <QString>
+#include <QList>
+#include <QAtomicInt>
+
+class Comm;
+class QThread;
+
+typedef enum {
+    JOB_FLASH,
+    JOB_DUMP,
+    JOB_ERASE,
+    JOB_MASS_ERASE,
+    JOB_PROTECT,
+    JOB_UNPROTECT,
+    //fileName is recipe
+    JOB_RECIPE
+} JOB_TYPE;
+
+typedef struct {
+    JOB_TYPE type;
+    QString port;
+    unsigned int speed;
+    QString fileName;
+    unsigned int addr, size;
+    bool verify, diff, wipe;
+} JOB_PARAMS;
+
+//job handle, lives in caller thread
+class CommJob : public QObject
+{
+    Q_OBJECT
+private:
+    JOB_PARAMS params;
+    QAtomicInt cancelled;
+public:
+    explicit CommJob(const JOB_PARAMS& params, QObject *parent = 0);
+
+    const JOB_PARAMS& getParams() const {return params;}
+    const QAtomicInt* cancelFlag() const {return &cancelled;}
+    bool isCancelled() const {return cancelled.load() != 0;}
+    void finish(bool ok, const QString& error) {emit finished(ok, error);}
+
+public slots:
+    void cancel() {cancelled.store(1);}
+
+signals:
+    void progress(unsigned int done, unsigned int total);
+    void finished(bool ok, const QString& error);
+};
+
+//executes jobs one by one in own thread
+class CommWorker : public QObject
+{
+    Q_OBJECT
+private:
+    Comm* comm;
+
+    void execute(const JOB_PARAMS& params);
+public:
+    explicit CommWorker(Comm* comm);
+
+public slots:
+    void run(CommJob* job);
+};
+
+class CommQueue : public QObject
+{
+    Q_OBJECT
+private:
+    QThread* thread;
+    Comm* comm;
+    CommWorker* worker;
+    QList<CommJob*> jobs;
+
+public:
+    explicit CommQueue(QObject *parent = 0);
+    virtual ~CommQueue();
+
+    //log and progress signals source. Lives in worker thread
+    Comm* getComm() const {return comm;}
+    CommJob* enqueue(const JOB_PARAMS& params);
+    bool isBusy() const {return !jobs.isEmpty();}
+
+public slots:
+    void cancelAll();
+
+private slots:
+    void jobFinished();
+};
+
+#endif // COMMWORKER_H
@@ -0,0 +1,65 @@
+#-------------------------------------------------
+#
+# Protocol core shared by GUI and console targets,
+# depends on QtCore, QtSerialPort and QtNetwork only
+#
+#-------------------------------------------------
+
+QT       += core serialport network
+
+#config.h next to sources overrides template/config.h
+INCLUDEPATH += $$PWD \
+    $$PWD/template
+
+SOURCES += $$PWD/comm.cpp \
+    $$PWD/commworker.cpp \
+    $$PWD/crc.cpp \
+    $$PWD/device.cpp \
+    $$PWD/dumpfile.cpp \
+    $$PWD/eraseplanner.cpp \
+    $$PWD/firmware.cpp \
+    $$PWD/gang.cpp \
+    $$PWD/imagefile.cpp \
+    $$PWD/lz4.cpp \
+    $$PWD/metrics.cpp \
+    $$PWD/recipe.cpp \
+    $$PWD/transport.cpp
+
+HEADERS  += $$PWD/comm.h \
+    $$PWD/commworker.h \
+    $$PWD/common.h \
+    $$PWD/template/config.h \
+    $$PWD/delay.h \
+    $$PWD/crc.h \
+    $$PWD/device.h \
+    $$PWD/dumpfile.h \
+    $$PWD/eraseplanner.h \
+    $$PWD/error.h \
+    $$PWD/firmware.h \
+    $$PWD/gang.h \
+    $$PWD/imagefile.h \
+    $$PWD/lz4.h \
+    $$PWD/metrics.h \
+    $$PWD/proto.h \
+    $$PWD/recipe.h \
+    $$PWD/stubproto.h \
+    $$PWD/transport.h
+
+RESOURCES += $$PWD/devices.qrc
+
+linux*{
+LIBS += -ludev
+DEFINES += HAVE_LIBUDEV
+#termios2 serial backend instead of QSerialPort
+DEFINES += HAVE_TERMIOS2
+SOURCES += $$PWD/linuxserial.cpp
+HEADERS += $$PWD/linuxserial.h
+}
+
+win32*{
+LIBS += -lsetupapi
+}
+
+CONFIG += exceptions
+#C++17 for std::uncaught_exceptions in MetricsScope
+CONFIG += c++1z
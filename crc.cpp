@@ -0,0 +1,34 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "crc.h"
+
+class Crc32Table
+{
+public:
+    quint32 table[256];
+    Crc32Table()
+    {
+        for (quint32 i = 0; i < 256; ++i)
+        {
+            quint32 c = i;
+            for (int j = 0; j < 8; ++j)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+};
+
+//built before main, no locking in worker threads
+static const Crc32Table crcTable;
+
+quint32 crc32(const char *data, int size, quint32 crc)
+{
+    crc = ~crc;
+    for (int i = 0; i < size; ++i)
+        crc = crcTable.table[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
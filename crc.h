@@ -0,0 +1,15 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef CRC_H
+#define CRC_H
+
+#include <QtGlobal>
+
+//CRC-32 (IEEE 802.3, zlib), pass previous result to continue
+quint32 crc32(const char* data, int size, quint32 crc = 0);
+
+#endif // CRC_H
@@ -0,0 +1,147 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "device.h"
+#include "config.h"
+#include "error.h"
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QCoreApplication>
+
+Device::Device() :
+    pid(0),
+    name(QObject::tr("Unknown device")),
+    flashBase(FLASH_BASE),
+    flashSize(0),
+    flashSizeReg(0),
+    ramBase(0),
+    ramSize(0),
+    banks(1),
+    quirks(0)
+{
+}
+
+unsigned int Device::sectorCount() const
+{
+    unsigned int count = 0;
+    foreach (const SECTOR_GROUP& group, layout)
+        count += group.count;
+    return count;
+}
+
+QVector<SECTOR> Device::sectors(unsigned int addr, unsigned int size) const
+{
+    QVector<SECTOR> res;
+    SECTOR sector;
+    if (!isKnown())
+    {
+        //page index would wrap below flash base
+        if (addr < flashBase)
+            return res;
+        for (unsigned int page = (addr - flashBase) / PAGE_SIZE; flashBase + page * PAGE_SIZE < addr + size; ++page)
+        {
+            sector.index = page;
+            sector.addr = flashBase + page * PAGE_SIZE;
+            sector.size = PAGE_SIZE;
+            res.append(sector);
+        }
+        return res;
+    }
+    sector.index = 0;
+    sector.addr = flashBase;
+    foreach (const SECTOR_GROUP& group, layout)
+    {
+        for (unsigned int i = 0; i < group.count; ++i, ++sector.index, sector.addr += group.size)
+        {
+            if (flashSize && sector.addr >= flashBase + flashSize)
+                return res;
+            if (sector.addr >= addr + size)
+                return res;
+            sector.size = group.size;
+            if (sector.addr + sector.size > addr)
+                res.append(sector);
+        }
+    }
+    return res;
+}
+
+unsigned int jsonToUInt(const QJsonValue& value)
+{
+    if (value.isDouble())
+        return static_cast<unsigned int>(value.toDouble());
+    QString str(value.toString().trimmed().toUpper());
+    unsigned int mul = 1;
+    if (str.endsWith('K') && !str.startsWith("0X"))
+        mul = 1024;
+    if (str.endsWith('M') && !str.startsWith("0X"))
+        mul = 1024 * 1024;
+    if (mul != 1)
+        str.chop(1);
+    bool ok;
+    unsigned int res = str.toUInt(&ok, 0);
+    if (!ok)
+        throw ErrorFileRead();
+    return res * mul;
+}
+
+void DeviceDatabase::load(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        throw ErrorFileOpen();
+    QJsonDocument doc(QJsonDocument::fromJson(file.readAll()));
+    file.close();
+    if (!doc.isObject())
+        throw ErrorFileRead();
+
+    foreach (const QJsonValue& value, doc.object().value("devices").toArray())
+    {
+        QJsonObject obj(value.toObject());
+        Device device;
+        device.pid = jsonToUInt(obj.value("pid"));
+        device.name = obj.value("name").toString();
+        device.flashBase = jsonToUInt(obj.value("flash").toObject().value("base"));
+        device.flashSize = jsonToUInt(obj.value("flash").toObject().value("size"));
+        if (obj.value("flash").toObject().contains("sizeReg"))
+            device.flashSizeReg = jsonToUInt(obj.value("flash").toObject().value("sizeReg"));
+        device.ramBase = jsonToUInt(obj.value("ram").toObject().value("base"));
+        device.ramSize = jsonToUInt(obj.value("ram").toObject().value("size"));
+        if (obj.contains("banks"))
+            device.banks = jsonToUInt(obj.value("banks"));
+        device.stub = obj.value("stub").toString();
+        foreach (const QJsonValue& sector, obj.value("sectors").toArray())
+        {
+            SECTOR_GROUP group;
+            group.count = jsonToUInt(sector.toObject().value("count"));
+            group.size = jsonToUInt(sector.toObject().value("size"));
+            device.layout.append(group);
+        }
+        foreach (const QJsonValue& quirk, obj.value("quirks").toArray())
+        {
+            if (quirk.toString() == "write_align8")
+                device.quirks |= QUIRK_WRITE_ALIGN8;
+            else if (quirk.toString() == "erase_no_reset")
+                device.quirks |= QUIRK_ERASE_NO_RESET;
+        }
+        if (device.layout.isEmpty())
+            throw ErrorFileRead();
+        devices[device.pid] = device;
+    }
+}
+
+void DeviceDatabase::loadBuiltin()
+{
+    load(":/" + DEVICES_FILE_NAME);
+    if (QFile::exists(QCoreApplication::applicationDirPath() + "/" + DEVICES_FILE_NAME))
+        load(QCoreApplication::applicationDirPath() + "/" + DEVICES_FILE_NAME);
+}
+
+Device DeviceDatabase::find(unsigned short pid) const
+{
+    return devices.value(pid, Device());
+}
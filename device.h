@@ -0,0 +1,71 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <QString>
+#include <QVector>
+#include <QMap>
+
+//flash is programmed by double words
+const unsigned int QUIRK_WRITE_ALIGN8 =                         (1 << 0);
+//mass erase doesn't reset device
+const unsigned int QUIRK_ERASE_NO_RESET =                       (1 << 1);
+
+typedef struct {
+    unsigned int count;
+    unsigned int size;
+} SECTOR_GROUP;
+
+typedef struct {
+    unsigned int index;
+    unsigned int addr;
+    unsigned int size;
+} SECTOR;
+
+class QJsonValue;
+
+//number or string: "0x8000000", "1024", "16K", "1M"
+unsigned int jsonToUInt(const QJsonValue& value);
+
+class Device
+{
+public:
+    unsigned short pid;
+    QString name;
+    unsigned int flashBase, flashSize;
+    //flash size register in KB, 0 if not present
+    unsigned int flashSizeReg;
+    unsigned int ramBase, ramSize;
+    unsigned int banks;
+    unsigned int quirks;
+    //RAM flash loader variant, stub/stub_<name>.bin, empty if none
+    QString stub;
+    QVector<SECTOR_GROUP> layout;
+
+    //generic device: uniform PAGE_SIZE pages from FLASH_BASE
+    Device();
+
+    bool isKnown() const {return !layout.isEmpty();}
+    unsigned int writeAlign() const {return quirks & QUIRK_WRITE_ALIGN8 ? 8 : 4;}
+    unsigned int sectorCount() const;
+    QVector<SECTOR> sectors(unsigned int addr, unsigned int size) const;
+};
+
+class DeviceDatabase
+{
+private:
+    QMap<unsigned short, Device> devices;
+public:
+    void load(const QString& fileName);
+    //resource copy, extended by DEVICES_FILE_NAME next to binary
+    void loadBuiltin();
+    bool isEmpty() const {return devices.isEmpty();}
+    Device find(unsigned short pid) const;
+};
+
+#endif // DEVICE_H
@@ -0,0 +1,84 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "dumpfile.h"
+#include "config.h"
+#include "error.h"
+#include "crc.h"
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#endif
+
+DumpFile::DumpFile(const QString &fileName, qint64 size) :
+    file(fileName),
+    written(0),
+    crc(0),
+    sha(QCryptographicHash::Sha256),
+    finished(false)
+{
+    if (!file.open(QIODevice::WriteOnly))
+        throw ErrorFileOpen();
+    //allocate blocks up front, no fragmentation or ENOSPC in the middle
+#ifdef Q_OS_LINUX
+    if (size > 0 && posix_fallocate(file.handle(), 0, size) != 0)
+        file.resize(size);
+#else
+    if (size > 0)
+        file.resize(size);
+#endif
+    buf.reserve(DUMP_BUFFER_SIZE);
+}
+
+DumpFile::~DumpFile()
+{
+    if (!finished)
+    {
+        try
+        {
+            flushBuffer();
+        }
+        catch (...)
+        {
+        }
+        //drop preallocated tail
+        file.resize(file.pos());
+    }
+}
+
+void DumpFile::flushBuffer()
+{
+    if (buf.isEmpty())
+        return;
+    bool ok = file.write(buf) == buf.size();
+    //keeps reserved capacity
+    buf.resize(0);
+    if (!ok)
+        throw ErrorFileWrite();
+}
+
+void DumpFile::write(const QByteArray &data)
+{
+    crc = crc32(data.constData(), data.size(), crc);
+    sha.addData(data);
+    written += data.size();
+    if (buf.size() + data.size() > DUMP_BUFFER_SIZE)
+        flushBuffer();
+    buf.append(data);
+}
+
+DUMP_HASH DumpFile::finish()
+{
+    flushBuffer();
+    if (!file.resize(written))
+        throw ErrorFileWrite();
+    file.close();
+    finished = true;
+    DUMP_HASH res;
+    res.size = written;
+    res.crc32 = crc;
+    res.sha256 = sha.result();
+    return res;
+}
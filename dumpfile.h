@@ -0,0 +1,44 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef DUMPFILE_H
+#define DUMPFILE_H
+
+#include <QFile>
+#include <QByteArray>
+#include <QCryptographicHash>
+
+typedef struct {
+    quint64 size;
+    quint32 crc32;
+    QByteArray sha256;
+} DUMP_HASH;
+
+//preallocated, buffered dump output with running CRC32 and SHA-256.
+//Unfinished file is truncated to data actually written
+class DumpFile
+{
+private:
+    QFile file;
+    QByteArray buf;
+    quint64 written;
+    quint32 crc;
+    QCryptographicHash sha;
+    bool finished;
+
+    void flushBuffer();
+
+    DumpFile(const DumpFile&);
+    DumpFile& operator=(const DumpFile&);
+public:
+    DumpFile(const QString& fileName, qint64 size);
+    ~DumpFile();
+
+    void write(const QByteArray& data);
+    DUMP_HASH finish();
+};
+
+#endif // DUMPFILE_H
@@ -0,0 +1,111 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "eraseplanner.h"
+#include "config.h"
+#include "comm.h"
+#include <QSettings>
+#include <QObject>
+
+EraseTimings::EraseTimings() :
+    kbTime(ERASE_KB_TIME),
+    bankTime(ERASE_BANK_TIME),
+    massTime(ERASE_MASS_TIME),
+    resetTime(RESET_TIME)
+{
+}
+
+void EraseTimings::load(unsigned short pid)
+{
+    QSettings settings(SETTINGS_FILE_NAME, QSettings::IniFormat);
+    settings.beginGroup(QString("erase_%1").arg(pid, 4, 16, QChar('0')));
+    kbTime = settings.value("kb", ERASE_KB_TIME).toDouble();
+    bankTime = settings.value("bank", ERASE_BANK_TIME).toDouble();
+    massTime = settings.value("mass", ERASE_MASS_TIME).toDouble();
+    resetTime = settings.value("reset", RESET_TIME).toDouble();
+    settings.endGroup();
+}
+
+void EraseTimings::save(unsigned short pid) const
+{
+    QSettings settings(SETTINGS_FILE_NAME, QSettings::IniFormat);
+    settings.beginGroup(QString("erase_%1").arg(pid, 4, 16, QChar('0')));
+    settings.setValue("kb", kbTime);
+    settings.setValue("bank", bankTime);
+    settings.setValue("mass", massTime);
+    settings.setValue("reset", resetTime);
+    settings.endGroup();
+}
+
+void EraseTimings::update(double &value, double measured)
+{
+    //exponential moving average
+    value += (measured - value) * TIMING_AVERAGE_WEIGHT;
+}
+
+ErasePlanner::ErasePlanner(const Device &device, bool extended, const EraseTimings &timings) :
+    device(device),
+    extended(extended),
+    timings(timings)
+{
+}
+
+double ErasePlanner::pagesCost(const QVector<SECTOR> &sectors) const
+{
+    double kb = 0;
+    foreach (const SECTOR& sector, sectors)
+        kb += sector.size / 1024.0;
+    return kb * timings.kbTime;
+}
+
+ERASE_PLAN ErasePlanner::plan(unsigned int addr, unsigned int size, bool allowExtra) const
+{
+    ERASE_PLAN best;
+    best.method = ERASE_METHOD_PAGES;
+    best.sectors = device.sectors(addr, size);
+    best.reset = false;
+    best.estimate = pagesCost(best.sectors);
+    if (!allowExtra || !device.isKnown() || best.sectors.isEmpty())
+        return best;
+
+    //bank erase is extended command only
+    if (extended && device.banks == 2 && device.flashSize)
+    {
+        ERASE_PLAN plan;
+        plan.method = ERASE_METHOD_BANK;
+        plan.reset = false;
+        unsigned int bankSize = device.flashSize / device.banks;
+        unsigned int first = (best.sectors.first().addr - device.flashBase) / bankSize;
+        unsigned int last = (best.sectors.last().addr - device.flashBase) / bankSize;
+        for (unsigned int bank = first; bank <= last; ++bank)
+            plan.banks.append(bank ? ISP_ERASE_BANK2 : ISP_ERASE_BANK1);
+        plan.estimate = plan.banks.size() * timings.bankTime;
+        if (plan.estimate < best.estimate)
+            best = plan;
+    }
+
+    ERASE_PLAN plan;
+    plan.method = ERASE_METHOD_MASS;
+    plan.reset = (device.quirks & QUIRK_ERASE_NO_RESET) == 0;
+    plan.estimate = timings.massTime + (plan.reset ? timings.resetTime : 0);
+    if (plan.estimate < best.estimate)
+        best = plan;
+    return best;
+}
+
+QString ErasePlanner::describe(const ERASE_PLAN &plan)
+{
+    switch (plan.method)
+    {
+    case ERASE_METHOD_BANK:
+        return QString(QObject::tr("Erase plan: %1 bank(s), estimated %2ms\n")).arg(plan.banks.size()).arg(plan.estimate, 0, 'f', 0);
+    case ERASE_METHOD_MASS:
+        return QString(QObject::tr("Erase plan: mass erase%1, estimated %2ms\n"))
+                .arg(plan.reset ? QObject::tr(" with reconnect") : QString()).arg(plan.estimate, 0, 'f', 0);
+    default:
+        return QString(QObject::tr("Erase plan: %1 page(s), estimated %2ms\n")).arg(plan.sectors.size()).arg(plan.estimate, 0, 'f', 0);
+    }
+}
@@ -0,0 +1,62 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef ERASEPLANNER_H
+#define ERASEPLANNER_H
+
+#include <QVector>
+#include <QString>
+#include "device.h"
+
+typedef enum {
+    ERASE_METHOD_PAGES = 0,
+    ERASE_METHOD_BANK,
+    ERASE_METHOD_MASS
+} ERASE_METHOD;
+
+typedef struct {
+    ERASE_METHOD method;
+    //pages for ERASE_METHOD_PAGES, bank codes for ERASE_METHOD_BANK
+    QVector<SECTOR> sectors;
+    QVector<unsigned int> banks;
+    //device will reset after erase
+    bool reset;
+    //estimated time, ms
+    double estimate;
+} ERASE_PLAN;
+
+//measured erase timings, ms
+class EraseTimings
+{
+public:
+    double kbTime;
+    double bankTime;
+    double massTime;
+    double resetTime;
+
+    EraseTimings();
+    void load(unsigned short pid);
+    void save(unsigned short pid) const;
+    static void update(double& value, double measured);
+};
+
+class ErasePlanner
+{
+private:
+    const Device& device;
+    bool extended;
+    const EraseTimings& timings;
+
+    double pagesCost(const QVector<SECTOR>& sectors) const;
+public:
+    ErasePlanner(const Device& device, bool extended, const EraseTimings& timings);
+
+    //allowExtra: data outside of addr..addr+size may be destroyed
+    ERASE_PLAN plan(unsigned int addr, unsigned int size, bool allowExtra) const;
+    static QString describe(const ERASE_PLAN& plan);
+};
+
+#endif // ERASEPLANNER_H
@@ -0,0 +1,235 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "firmware.h"
+#include "imagefile.h"
+#include <QFileInfo>
+#include <QStringList>
+#include <algorithm>
+
+#define ELF_MAGIC                                   "\x7f" "ELF"
+#define ELF_HEADER_SIZE                             0x34
+#define ELF_PHDR_SIZE                               0x20
+#define ELF_PT_LOAD                                 1
+
+static bool segmentLess(const SEGMENT& a, const SEGMENT& b)
+{
+    return a.addr < b.addr;
+}
+
+static unsigned int le16(const QByteArray& buf, int pos)
+{
+    return static_cast<unsigned char>(buf.at(pos)) | (static_cast<unsigned char>(buf.at(pos + 1)) << 8);
+}
+
+static unsigned int le32(const QByteArray& buf, int pos)
+{
+    return le16(buf, pos) | (le16(buf, pos + 2) << 16);
+}
+
+Firmware::Firmware()
+{
+}
+
+Firmware::~Firmware()
+{
+    //views must go before mapping
+    segments.clear();
+}
+
+void Firmware::add(unsigned int addr, const QByteArray &data)
+{
+    if (data.isEmpty())
+        return;
+    //records usually follow each other
+    if (!segments.isEmpty() && segments.last().addr + segments.last().data.size() == addr)
+        segments.last().data.append(data);
+    else
+    {
+        SEGMENT segment;
+        segment.addr = addr;
+        segment.data = data;
+        segments.append(segment);
+    }
+}
+
+void Firmware::normalize()
+{
+    std::stable_sort(segments.begin(), segments.end(), segmentLess);
+    QVector<SEGMENT> res;
+    foreach (const SEGMENT& segment, segments)
+    {
+        if (!res.isEmpty() && res.last().addr + res.last().data.size() >= segment.addr)
+        {
+            //touching or overlapping, later record wins
+            SEGMENT& last = res.last();
+            unsigned int offset = segment.addr - last.addr;
+            if (offset + segment.data.size() > static_cast<unsigned int>(last.data.size()))
+                last.data.resize(offset + segment.data.size());
+            last.data.replace(offset, segment.data.size(), segment.data);
+        }
+        else
+            res.append(segment);
+    }
+    segments = res;
+}
+
+void Firmware::loadHex(const QByteArray &text)
+{
+    unsigned int base = 0;
+    foreach (const QByteArray& raw, text.split('\n'))
+    {
+        QByteArray line(raw.trimmed());
+        if (line.isEmpty())
+            continue;
+        if (line.at(0) != ':')
+            throw ErrorFileFormat();
+        QByteArray rec(QByteArray::fromHex(line.mid(1)));
+        if (rec.size() < 5 || rec.size() != static_cast<unsigned char>(rec.at(0)) + 5)
+            throw ErrorFileFormat();
+        unsigned char sum = 0;
+        foreach (char c, rec)
+            sum += c;
+        if (sum)
+            throw ErrorFileCrc();
+        unsigned int offset = (static_cast<unsigned char>(rec.at(1)) << 8) | static_cast<unsigned char>(rec.at(2));
+        unsigned int value = rec.size() >= 7 ? (static_cast<unsigned char>(rec.at(4)) << 8) | static_cast<unsigned char>(rec.at(5)) : 0;
+        switch (rec.at(3))
+        {
+        case 0x00:
+            add(base + offset, rec.mid(4, rec.size() - 5));
+            break;
+        case 0x01:
+            normalize();
+            return;
+        case 0x02:
+            base = value << 4;
+            break;
+        case 0x04:
+            base = value << 16;
+            break;
+        default:
+            //start address records
+            break;
+        }
+    }
+    normalize();
+}
+
+void Firmware::loadSrec(const QByteArray &text)
+{
+    foreach (const QByteArray& raw, text.split('\n'))
+    {
+        QByteArray line(raw.trimmed());
+        if (line.isEmpty())
+            continue;
+        if (line.size() < 4 || line.at(0) != 'S')
+            throw ErrorFileFormat();
+        QByteArray rec(QByteArray::fromHex(line.mid(2)));
+        if (rec.size() < 3 || rec.size() != static_cast<unsigned char>(rec.at(0)) + 1)
+            throw ErrorFileFormat();
+        unsigned char sum = 0;
+        for (int i = 0; i < rec.size() - 1; ++i)
+            sum += rec.at(i);
+        if (static_cast<unsigned char>(~sum) != static_cast<unsigned char>(rec.at(rec.size() - 1)))
+            throw ErrorFileCrc();
+        int addrSize;
+        switch (line.at(1))
+        {
+        case '1':
+            addrSize = 2;
+            break;
+        case '2':
+            addrSize = 3;
+            break;
+        case '3':
+            addrSize = 4;
+            break;
+        default:
+            //header, count and start records
+            continue;
+        }
+        if (rec.size() < addrSize + 2)
+            throw ErrorFileFormat();
+        unsigned int addr = 0;
+        for (int i = 0; i < addrSize; ++i)
+            addr = (addr << 8) | static_cast<unsigned char>(rec.at(1 + i));
+        add(addr, rec.mid(1 + addrSize, rec.size() - addrSize - 2));
+    }
+    normalize();
+}
+
+void Firmware::loadElf(const QByteArray &data)
+{
+    //32 bit little endian only, Cortex-M
+    if (data.size() < ELF_HEADER_SIZE || !data.startsWith(ELF_MAGIC) || data.at(4) != 1 || data.at(5) != 1)
+        throw ErrorFileFormat();
+    //64 bit arithmetic, header fields may wrap 32 bit sums
+    qint64 size = data.size();
+    qint64 phoff = le32(data, 0x1c);
+    qint64 phentsize = le16(data, 0x2a);
+    qint64 phnum = le16(data, 0x2c);
+    if (phentsize < ELF_PHDR_SIZE || phoff > size || phnum * phentsize > size - phoff)
+        throw ErrorFileFormat();
+    for (qint64 i = 0; i < phnum; ++i)
+    {
+        int ph = static_cast<int>(phoff + i * phentsize);
+        if (le32(data, ph) != ELF_PT_LOAD)
+            continue;
+        qint64 offset = le32(data, ph + 4);
+        //load address: initialized data goes to flash, not to RAM
+        unsigned int paddr = le32(data, ph + 12);
+        qint64 filesz = le32(data, ph + 16);
+        if (!filesz)
+            continue;
+        if (offset > size || filesz > size - offset)
+            throw ErrorFileFormat();
+        SEGMENT segment;
+        segment.addr = paddr;
+        segment.data = data.mid(static_cast<int>(offset), static_cast<int>(filesz));
+        segments.append(segment);
+    }
+    normalize();
+}
+
+void Firmware::load(const QString &fileName, unsigned int binAddr)
+{
+    segments.clear();
+    image.reset(new ImageFile(fileName));
+    QString ext(QFileInfo(fileName).suffix().toLower());
+    const QByteArray& data = image->data();
+    if (data.startsWith(ELF_MAGIC))
+        loadElf(data);
+    else if (QStringList(QStringList() << "hex" << "ihex" << "ihx").contains(ext))
+        loadHex(data);
+    else if (QStringList(QStringList() << "s19" << "s28" << "s37" << "srec" << "mot" << "sx").contains(ext))
+        loadSrec(data);
+    else
+    {
+        add(binAddr, data);
+        return;
+    }
+    //parsed formats own their data
+    image.reset();
+}
+
+unsigned int Firmware::start() const
+{
+    return segments.isEmpty() ? 0 : segments.first().addr;
+}
+
+unsigned int Firmware::span() const
+{
+    return segments.isEmpty() ? 0 : segments.last().addr + segments.last().data.size() - segments.first().addr;
+}
+
+unsigned int Firmware::size() const
+{
+    unsigned int res = 0;
+    foreach (const SEGMENT& segment, segments)
+        res += segment.data.size();
+    return res;
+}
@@ -0,0 +1,58 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef FIRMWARE_H
+#define FIRMWARE_H
+
+#include <QVector>
+#include <QByteArray>
+#include <QString>
+#include <QScopedPointer>
+#include "error.h"
+
+class ImageFile;
+
+class ErrorFileFormat: public ErrorFile
+{
+public:
+    ErrorFileFormat() throw() :ErrorFile() {str = (QObject::tr("Invalid file format"));}
+};
+
+typedef struct {
+    unsigned int addr;
+    QByteArray data;
+} SEGMENT;
+
+//sparse firmware image: Intel HEX, Motorola S-record, ELF (PT_LOAD at LMA)
+//or raw binary. Segments are sorted, touching segments are joined
+class Firmware
+{
+private:
+    QVector<SEGMENT> segments;
+    //raw binary is mapped, segment is a view of it
+    QScopedPointer<ImageFile> image;
+
+    void add(unsigned int addr, const QByteArray& data);
+    void normalize();
+    void loadHex(const QByteArray& text);
+    void loadSrec(const QByteArray& text);
+    void loadElf(const QByteArray& data);
+public:
+    Firmware();
+    ~Firmware();
+
+    //format by extension or ELF magic, binary is placed at binAddr
+    void load(const QString& fileName, unsigned int binAddr);
+    const QVector<SEGMENT>& getSegments() const {return segments;}
+    bool isEmpty() const {return segments.isEmpty();}
+    //lowest address and span up to end of last segment
+    unsigned int start() const;
+    unsigned int span() const;
+    //bytes in segments
+    unsigned int size() const;
+};
+
+#endif // FIRMWARE_H
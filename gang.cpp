@@ -0,0 +1,146 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "gang.h"
+#include "comm.h"
+#include "error.h"
+#include "config.h"
+#include "metrics.h"
+#include <QElapsedTimer>
+#include <QMutexLocker>
+
+GangTask::GangTask(Gang *gang, const QString &port) :
+    gang(gang),
+    port(port)
+{
+}
+
+void GangTask::run()
+{
+    GANG_RESULT result;
+    QElapsedTimer total, timer;
+    const GANG_PARAMS& params = gang->params;
+    total.start();
+    result.port = port;
+    result.ok = false;
+    result.pid = 0;
+    result.openTime = result.eraseTime = result.flashTime = result.verifyTime = 0;
+
+    Comm comm;
+    comm.setCancelFlag(&gang->cancelled);
+    comm.setStubEnabled(params.stub);
+    comm.setStubImage(params.stubImage);
+    comm.setBlockSize(params.blockSize);
+    comm.setDeferredVerify(params.deferredVerify);
+    comm.setChecksumVerify(params.checksumVerify);
+    comm.setCompress(params.compress);
+    comm.setResetLines(params.resetLines);
+    //no event loop in pool threads
+    QObject::connect(&comm, SIGNAL(log(LOG_TYPE,QString,Qt::GlobalColor)), gang, SLOT(portLog(LOG_TYPE,QString,Qt::GlobalColor)), Qt::DirectConnection);
+    //snapshots are labelled by port on open
+    if (params.metrics)
+        params.metrics->add(&comm);
+    try
+    {
+        if (!params.devicesFile.isEmpty())
+            comm.loadDevices(params.devicesFile);
+        timer.start();
+        comm.open(port, params.speed);
+        result.openTime = timer.elapsed();
+        result.pid = comm.getDevice().pid;
+        try
+        {
+            timer.start();
+            if (params.diff)
+                comm.flashDiff(gang->segments, params.verify);
+            else
+            {
+                if (params.eraseSize)
+                    comm.eraseAuto(params.addr, params.eraseSize, params.wipe);
+                else
+                    comm.eraseAuto(gang->segments, params.wipe);
+                result.eraseTime = timer.elapsed();
+                timer.start();
+                comm.flash(gang->segments, params.verify);
+            }
+            result.flashTime = timer.elapsed();
+            result.verifyTime = comm.getVerifyTime();
+            if (params.go)
+                comm.cmdGo(params.addr);
+            comm.close();
+        }
+        catch (...)
+        {
+            comm.close();
+            throw;
+        }
+        result.ok = true;
+    }
+    catch (Exception& e)
+    {
+        result.error = e.what();
+    }
+    catch (...)
+    {
+        result.error = QObject::tr("Unhandled exception");
+    }
+    if (params.metrics)
+        params.metrics->remove(&comm);
+    result.retries = comm.getRetries();
+    result.totalTime = total.elapsed();
+    gang->taskFinished(result);
+}
+
+Gang::Gang(QObject *parent) :
+    QObject(parent),
+    cancelled(0)
+{
+    pool.setMaxThreadCount(GANG_MAX_THREADS);
+}
+
+void Gang::portLog(LOG_TYPE type, const QString &text, Qt::GlobalColor color)
+{
+    Comm* comm = qobject_cast<Comm*>(sender());
+    QString port(comm ? comm->getPortName() : QString());
+    QMutexLocker locker(&mutex);
+    //collect whole lines, so ports output is not mixed
+    QString& line = lines[port];
+    line += text;
+    for (int n = line.indexOf('\n'); n >= 0; n = line.indexOf('\n'))
+    {
+        emit log(type, QString("[%1] %2").arg(port).arg(line.left(n + 1)), color);
+        line.remove(0, n + 1);
+    }
+}
+
+void Gang::taskFinished(const GANG_RESULT &result)
+{
+    QMutexLocker locker(&mutex);
+    results.append(result);
+    emit portFinished(result.port, result.ok);
+}
+
+QVector<GANG_RESULT> Gang::run(const QStringList &ports, const QByteArray &image, const GANG_PARAMS &params)
+{
+    SEGMENT segment;
+    segment.addr = params.addr;
+    segment.data = image;
+    return run(ports, QVector<SEGMENT>() << segment, params);
+}
+
+QVector<GANG_RESULT> Gang::run(const QStringList &ports, const QVector<SEGMENT> &segments, const GANG_PARAMS &params)
+{
+    cancelled.store(0);
+    results.clear();
+    lines.clear();
+    this->params = params;
+    //implicitly shared, tasks only read it, so it is never copied
+    this->segments = segments;
+    foreach (const QString& port, ports)
+        pool.start(new GangTask(this, port));
+    pool.waitForDone();
+    return results;
+}
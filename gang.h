@@ -0,0 +1,108 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef GANG_H
+#define GANG_H
+
+#include <QObject>
+#include <QStringList>
+#include <QVector>
+#include <QMap>
+#include <QByteArray>
+#include "firmware.h"
+#include <QMutex>
+#include <QAtomicInt>
+#include <QRunnable>
+#include <QThreadPool>
+#include "common.h"
+#include "error.h"
+
+class MetricsDumper;
+
+class ErrorGang: public Exception
+{
+public:
+    ErrorGang() throw() :Exception() {str = (QObject::tr("Some ports failed"));}
+};
+
+typedef struct {
+    unsigned int speed;
+    unsigned int addr;
+    //erase range, pages under image if 0
+    unsigned int eraseSize;
+    bool verify, diff, wipe, go;
+    //RAM flash loader, image empty - stub/ by device
+    bool stub;
+    QByteArray stubImage;
+    //Comm settings, see its setters
+    unsigned int blockSize;
+    bool deferredVerify, checksumVerify, compress, resetLines;
+    //device database on top of builtin one, empty - builtin only
+    QString devicesFile;
+    //each port is added for the time of its task, 0 - none
+    MetricsDumper* metrics;
+} GANG_PARAMS;
+
+typedef struct {
+    QString port;
+    bool ok;
+    QString error;
+    unsigned short pid;
+    unsigned int retries;
+    //ms
+    //verifyTime is part of flashTime
+    qint64 openTime, eraseTime, flashTime, verifyTime, totalTime;
+} GANG_RESULT;
+
+class Gang;
+
+class GangTask : public QRunnable
+{
+private:
+    Gang* gang;
+    QString port;
+public:
+    GangTask(Gang* gang, const QString& port);
+    void run();
+};
+
+//Flash same image to many ports in parallel. Each port runs own Comm in pool thread,
+//Comm is blocking and keeps no shared state, so threads need no event loop.
+class Gang : public QObject
+{
+    Q_OBJECT
+private:
+    QThreadPool pool;
+    QMutex mutex;
+    QAtomicInt cancelled;
+    QVector<SEGMENT> segments;
+    GANG_PARAMS params;
+    QVector<GANG_RESULT> results;
+    QMap<QString, QString> lines;
+
+    friend class GangTask;
+    void taskFinished(const GANG_RESULT& result);
+public:
+    explicit Gang(QObject *parent = 0);
+
+    void setMaxThreads(int count) {pool.setMaxThreadCount(count);}
+    //blocks until all ports are done
+    QVector<GANG_RESULT> run(const QStringList& ports, const QByteArray& image, const GANG_PARAMS& params);
+    QVector<GANG_RESULT> run(const QStringList& ports, const QVector<SEGMENT>& segments, const GANG_PARAMS& params);
+
+public slots:
+    void cancel() {cancelled.store(1);}
+
+signals:
+    //emitted from pool threads
+    void log(LOG_TYPE type, const QString& text, Qt::GlobalColor color);
+    void portFinished(const QString& port, bool ok);
+
+private slots:
+    void portLog(LOG_TYPE type, const QString& text, Qt::GlobalColor color);
+};
+
+#endif // GANG_H
@@ -0,0 +1,33 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "imagefile.h"
+#include "error.h"
+
+ImageFile::ImageFile(const QString &fileName) :
+    file(fileName),
+    map(0)
+{
+    if (!file.open(QIODevice::ReadOnly))
+        throw ErrorFileOpen();
+    if (file.size() > 0)
+        map = file.map(0, file.size());
+    if (map)
+        buf = QByteArray::fromRawData(reinterpret_cast<const char*>(map), static_cast<int>(file.size()));
+    else
+    {
+        //pipes, special files
+        buf = file.readAll();
+        file.close();
+    }
+}
+
+ImageFile::~ImageFile()
+{
+    buf.clear();
+    if (map)
+        file.unmap(map);
+}
@@ -0,0 +1,33 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef IMAGEFILE_H
+#define IMAGEFILE_H
+
+#include <QFile>
+#include <QByteArray>
+
+//read-only firmware image, memory mapped when possible. data() doesn't own
+//memory: pages are shared through page cache, spans are taken without copy.
+//Must outlive all users of data()
+class ImageFile
+{
+private:
+    QFile file;
+    uchar* map;
+    QByteArray buf;
+
+    ImageFile(const ImageFile&);
+    ImageFile& operator=(const ImageFile&);
+public:
+    explicit ImageFile(const QString& fileName);
+    ~ImageFile();
+
+    const QByteArray& data() const {return buf;}
+    bool isMapped() const {return map != 0;}
+};
+
+#endif // IMAGEFILE_H
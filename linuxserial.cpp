@@ -0,0 +1,253 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "linuxserial.h"
+#include <QFile>
+#include <QFileInfo>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include <asm/ioctls.h>
+#include <linux/serial.h>
+
+LinuxSerial::LinuxSerial(QObject *parent) :
+    QIODevice(parent),
+    fd(-1),
+    baudRate(115200),
+    dataBits(QSerialPort::Data8),
+    stopBits(QSerialPort::OneStop),
+    parity(QSerialPort::NoParity),
+    flowControl(QSerialPort::NoFlowControl)
+{
+}
+
+LinuxSerial::~LinuxSerial()
+{
+    close();
+}
+
+bool LinuxSerial::open(OpenMode mode)
+{
+    if (fd >= 0)
+        return false;
+    QString path(portName.startsWith('/') ? portName : "/dev/" + portName);
+    //O_NONBLOCK: don't wait for DCD
+    fd = ::open(path.toLocal8Bit().constData(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    if (ioctl(fd, TIOCEXCL) < 0 || !configure())
+    {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    //writes are blocking, reads never block with VMIN = VTIME = 0
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    setLowLatency();
+    clear();
+    //no QIODevice read buffer: clear() must drop every stale ACK/NACK, reads poll fd anyway
+    return QIODevice::open(mode | QIODevice::Unbuffered);
+}
+
+void LinuxSerial::close()
+{
+    if (fd < 0)
+        return;
+    QIODevice::close();
+    ::close(fd);
+    fd = -1;
+}
+
+bool LinuxSerial::configure()
+{
+    if (fd < 0)
+        return true;
+    struct termios2 tio;
+    if (ioctl(fd, TCGETS2, &tio) < 0)
+        return false;
+    //raw
+    tio.c_iflag = 0;
+    tio.c_oflag = 0;
+    tio.c_lflag = 0;
+    tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS | CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= CREAD | CLOCAL | BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = tio.c_ospeed = baudRate;
+    switch (dataBits)
+    {
+    case QSerialPort::Data5:
+        tio.c_cflag |= CS5;
+        break;
+    case QSerialPort::Data6:
+        tio.c_cflag |= CS6;
+        break;
+    case QSerialPort::Data7:
+        tio.c_cflag |= CS7;
+        break;
+    default:
+        tio.c_cflag |= CS8;
+        break;
+    }
+    if (stopBits == QSerialPort::TwoStop)
+        tio.c_cflag |= CSTOPB;
+    switch (parity)
+    {
+    case QSerialPort::EvenParity:
+        tio.c_cflag |= PARENB;
+        break;
+    case QSerialPort::OddParity:
+        tio.c_cflag |= PARENB | PARODD;
+        break;
+    default:
+        break;
+    }
+    if (flowControl == QSerialPort::HardwareControl)
+        tio.c_cflag |= CRTSCTS;
+    else if (flowControl == QSerialPort::SoftwareControl)
+        tio.c_iflag |= IXON | IXOFF;
+    //waiting is done by poll, read returns what is available
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    return ioctl(fd, TCSETS2, &tio) == 0;
+}
+
+void LinuxSerial::setLowLatency()
+{
+    //not supported by every driver, ignore failure
+    struct serial_struct ss;
+    if (ioctl(fd, TIOCGSERIAL, &ss) == 0)
+    {
+        ss.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &ss);
+    }
+}
+
+bool LinuxSerial::setLatencyTimer(int ms)
+{
+    QString name(QFileInfo(portName.startsWith('/') ? portName : "/dev/" + portName).canonicalFilePath().section('/', -1));
+    QFile file(QString("/sys/class/tty/%1/device/latency_timer").arg(name));
+    if (!file.exists())
+        return false;
+    if (file.open(QIODevice::ReadOnly) && file.readAll().trimmed().toInt() == ms)
+        return true;
+    file.close();
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    return file.write(QByteArray::number(ms)) > 0;
+}
+
+bool LinuxSerial::setBaudRate(qint32 baud)
+{
+    baudRate = baud;
+    return configure();
+}
+
+bool LinuxSerial::setDataBits(QSerialPort::DataBits bits)
+{
+    dataBits = bits;
+    return configure();
+}
+
+bool LinuxSerial::setStopBits(QSerialPort::StopBits bits)
+{
+    stopBits = bits;
+    return configure();
+}
+
+bool LinuxSerial::setParity(QSerialPort::Parity value)
+{
+    parity = value;
+    return configure();
+}
+
+bool LinuxSerial::setFlowControl(QSerialPort::FlowControl value)
+{
+    flowControl = value;
+    return configure();
+}
+
+bool LinuxSerial::setDataTerminalReady(bool set)
+{
+    int bits = TIOCM_DTR;
+    return fd >= 0 && ioctl(fd, set ? TIOCMBIS : TIOCMBIC, &bits) == 0;
+}
+
+bool LinuxSerial::setRequestToSend(bool set)
+{
+    int bits = TIOCM_RTS;
+    return fd >= 0 && ioctl(fd, set ? TIOCMBIS : TIOCMBIC, &bits) == 0;
+}
+
+qint64 LinuxSerial::readData(char *data, qint64 maxSize)
+{
+    ssize_t res = ::read(fd, data, maxSize);
+    if (res < 0)
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    return res;
+}
+
+qint64 LinuxSerial::writeData(const char *data, qint64 maxSize)
+{
+    qint64 done = 0;
+    while (done < maxSize)
+    {
+        ssize_t res = ::write(fd, data + done, maxSize - done);
+        if (res < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return done ? done : -1;
+        }
+        done += res;
+    }
+    return done;
+}
+
+qint64 LinuxSerial::bytesAvailable() const
+{
+    int count = 0;
+    if (fd >= 0)
+        ioctl(fd, FIONREAD, &count);
+    return QIODevice::bytesAvailable() + count;
+}
+
+bool LinuxSerial::waitForReadyRead(int msecs)
+{
+    if (fd < 0)
+        return false;
+    if (QIODevice::bytesAvailable())
+        return true;
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    for (;;)
+    {
+        int res = poll(&pfd, 1, msecs);
+        if (res < 0 && errno == EINTR)
+            continue;
+        return res > 0 && (pfd.revents & POLLIN);
+    }
+}
+
+bool LinuxSerial::waitForBytesWritten(int msecs)
+{
+    Q_UNUSED(msecs);
+    //writes are synchronous
+    return false;
+}
+
+bool LinuxSerial::flush()
+{
+    //no write buffer, data is already in driver
+    return fd >= 0;
+}
+
+bool LinuxSerial::clear()
+{
+    return fd >= 0 && ioctl(fd, TCFLSH, TCIOFLUSH) == 0;
+}
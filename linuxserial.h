@@ -0,0 +1,62 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef LINUXSERIAL_H
+#define LINUXSERIAL_H
+
+#include <QIODevice>
+#include <QString>
+#include <QtSerialPort/QSerialPort>
+
+//termios2 serial port, drop-in for QSerialPort subset used by Comm.
+//Any rate via BOTHER, ASYNC_LOW_LATENCY, reads are polled so VMIN = VTIME = 0
+class LinuxSerial : public QIODevice
+{
+    Q_OBJECT
+private:
+    int fd;
+    QString portName;
+    qint32 baudRate;
+    QSerialPort::DataBits dataBits;
+    QSerialPort::StopBits stopBits;
+    QSerialPort::Parity parity;
+    QSerialPort::FlowControl flowControl;
+
+    bool configure();
+    void setLowLatency();
+protected:
+    qint64 readData(char* data, qint64 maxSize);
+    qint64 writeData(const char* data, qint64 maxSize);
+public:
+    explicit LinuxSerial(QObject* parent = 0);
+    virtual ~LinuxSerial();
+
+    void setPortName(const QString& name) {portName = name;}
+    const QString& getPortName() const {return portName;}
+    bool setBaudRate(qint32 baud);
+    bool setDataBits(QSerialPort::DataBits bits);
+    bool setStopBits(QSerialPort::StopBits bits);
+    bool setParity(QSerialPort::Parity value);
+    bool setFlowControl(QSerialPort::FlowControl value);
+    bool setDataTerminalReady(bool set);
+    bool setRequestToSend(bool set);
+    //USB adapter latency_timer in sysfs (FTDI), usually needs udev rule or root
+    bool setLatencyTimer(int ms);
+    int handle() const {return fd;}
+
+    bool open(OpenMode mode);
+    void close();
+    bool isSequential() const {return true;}
+    qint64 bytesAvailable() const;
+    bool waitForReadyRead(int msecs);
+    bool waitForBytesWritten(int msecs);
+    //QSerialPort compatibility, writes are unbuffered
+    bool flush();
+    //drop unread input and unsent output
+    bool clear();
+};
+
+#endif // LINUXSERIAL_H
@@ -0,0 +1,155 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "lz4.h"
+#include <string.h>
+
+#define MIN_MATCH                                   4
+//format limits: last match starts 12 bytes before end, last 5 bytes are literals
+#define MF_LIMIT                                    12
+#define LAST_LITERALS                               5
+#define MAX_OFFSET                                  65535
+#define HASH_BITS                                   12
+
+static unsigned int read32(const unsigned char* p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int hash(unsigned int v)
+{
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+//length above 15 continues in 255 steps
+static bool putLength(unsigned char*& op, const unsigned char* end, int len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        if (op >= end)
+            return false;
+        *op++ = 255;
+    }
+    if (op >= end)
+        return false;
+    *op++ = static_cast<unsigned char>(len);
+    return true;
+}
+
+static bool putSequence(unsigned char*& op, const unsigned char* end, const unsigned char* literals, int literalLen, int offset, int matchLen)
+{
+    if (op >= end)
+        return false;
+    unsigned char* token = op++;
+    *token = static_cast<unsigned char>((literalLen < 15 ? literalLen : 15) << 4);
+    if (literalLen >= 15 && !putLength(op, end, literalLen - 15))
+        return false;
+    if (end - op < literalLen)
+        return false;
+    memcpy(op, literals, literalLen);
+    op += literalLen;
+    //last sequence has literals only
+    if (matchLen == 0)
+        return true;
+    if (end - op < 2)
+        return false;
+    *op++ = static_cast<unsigned char>(offset & 0xff);
+    *op++ = static_cast<unsigned char>(offset >> 8);
+    matchLen -= MIN_MATCH;
+    *token |= static_cast<unsigned char>(matchLen < 15 ? matchLen : 15);
+    return matchLen < 15 || putLength(op, end, matchLen - 15);
+}
+
+int lz4Compress(const char *src, int size, char *dst, int dstSize)
+{
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(src);
+    unsigned char* op = reinterpret_cast<unsigned char*>(dst);
+    const unsigned char* end = op + dstSize;
+    int table[1 << HASH_BITS];
+    int anchor = 0, pos = 0;
+    for (int i = 0; i < (1 << HASH_BITS); ++i)
+        table[i] = -1;
+    //greedy, single probe
+    while (pos < size - MF_LIMIT)
+    {
+        unsigned int v = read32(in + pos);
+        unsigned int h = hash(v);
+        int ref = table[h];
+        table[h] = pos;
+        if (ref < 0 || pos - ref > MAX_OFFSET || read32(in + ref) != v)
+        {
+            ++pos;
+            continue;
+        }
+        int len = MIN_MATCH;
+        while (pos + len < size - LAST_LITERALS && in[ref + len] == in[pos + len])
+            ++len;
+        if (!putSequence(op, end, in + anchor, pos - anchor, pos - ref, len))
+            return 0;
+        pos += len;
+        anchor = pos;
+    }
+    if (!putSequence(op, end, in + anchor, size - anchor, 0, 0))
+        return 0;
+    return static_cast<int>(op - reinterpret_cast<unsigned char*>(dst));
+}
+
+int lz4Decompress(const char *src, int size, char *dst, int dstSize)
+{
+    const unsigned char* ip = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* end = ip + size;
+    int op = 0;
+    while (ip < end)
+    {
+        unsigned int token = *ip++;
+        int len = token >> 4;
+        if (len == 15)
+        {
+            unsigned char c;
+            do
+            {
+                if (ip >= end)
+                    return -1;
+                c = *ip++;
+                len += c;
+            } while (c == 255);
+        }
+        if (len > end - ip || len > dstSize - op)
+            return -1;
+        memcpy(dst + op, ip, len);
+        ip += len;
+        op += len;
+        if (ip == end)
+            break;
+        if (end - ip < 2)
+            return -1;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op)
+            return -1;
+        len = token & 0xf;
+        if (len == 15)
+        {
+            unsigned char c;
+            do
+            {
+                if (ip >= end)
+                    return -1;
+                c = *ip++;
+                len += c;
+            } while (c == 255);
+        }
+        len += MIN_MATCH;
+        if (len > dstSize - op)
+            return -1;
+        //overlapping copy repeats pattern
+        for (; len; --len, ++op)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
@@ -0,0 +1,17 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef LZ4_H
+#define LZ4_H
+
+//LZ4 block format, no frame header. Decoder of stub/ is the same loop
+
+//returns compressed size, 0 if it doesn't fit to dstSize
+int lz4Compress(const char* src, int size, char* dst, int dstSize);
+//returns decompressed size, -1 on malformed input or output overrun
+int lz4Decompress(const char* src, int size, char* dst, int dstSize);
+
+#endif // LZ4_H
@@ -12,6 +12,7 @@
 #include "config.h"
 #include "error.h"
 #include <QFileDialog>
+#include <QRegularExpressionValidator>
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
@@ -24,11 +25,12 @@ MainWindow::MainWindow(QWidget *parent) :
         logToFile(tr("System started\n"));
     else
         logToScreen(tr("Can't create log\n"), Qt::darkYellow);
-    comm = new Comm(this);
-    connect(comm, SIGNAL(log(LOG_TYPE,QString,QColor)), this, SLOT(log(LOG_TYPE,QString,QColor)));
+    queue = new CommQueue(this);
+    connect(queue->getComm(), SIGNAL(log(LOG_TYPE,QString,Qt::GlobalColor)), this, SLOT(log(LOG_TYPE,QString,Qt::GlobalColor)));
+    ui->bCancel->setEnabled(false);
     info(tr("Application started\n"));
 
-    ui->ePort->addItems(comm->ports());
+    ui->ePort->addItems(Comm::ports());
     ui->eSpeed->addItem("1200");
     ui->eSpeed->addItem("2400");
     ui->eSpeed->addItem("4800");
@@ -39,12 +41,21 @@ MainWindow::MainWindow(QWidget *parent) :
     ui->eSpeed->addItem("38400");
     ui->eSpeed->addItem("57600");
     ui->eSpeed->addItem("115200");
+    ui->eSpeed->addItem("230400");
+    ui->eSpeed->addItem("460800");
+    ui->eSpeed->addItem("921600");
+    ui->eSpeed->addItem("1000000");
+    //probe fastest clean rate, needs DTR/RTS reset wiring
+    ui->eSpeed->addItem("auto");
+    //bootloader auto-bauds, any rate the adapter supports may be typed in
+    ui->eSpeed->setEditable(true);
+    ui->eSpeed->setValidator(new QRegularExpressionValidator(QRegularExpression("auto|[1-9][0-9]{0,6}"), this));
     ui->eSpeed->setCurrentText("115200");
 }
 
 MainWindow::~MainWindow()
 {
-    delete comm;
+    delete queue;
     logFile.close();
     delete ui;
 }
@@ -57,7 +68,6 @@ void MainWindow::logToScreen(const QString &text, const QColor &color)
     html.replace("\n", "<br>");
     ui->log->textCursor().insertHtml(html);
     ui->log->setDisabled(false);
-    QCoreApplication::processEvents();
 }
 
 void MainWindow::logToFile(const QString &text)
@@ -72,7 +82,7 @@ void MainWindow::logToFile(const QString &text)
     }
 }
 
-void MainWindow::log(LOG_TYPE type, const QString &text, const QColor &color)
+void MainWindow::log(LOG_TYPE type, const QString &text, Qt::GlobalColor color)
 {
     switch (type)
     {
@@ -101,120 +111,108 @@ void MainWindow::log(LOG_TYPE type, const QString &text, const QColor &color)
     }
 }
 
-void MainWindow::on_bFlash_clicked()
+JOB_PARAMS MainWindow::jobParams(JOB_TYPE type)
 {
-    unsigned int addr = ui->eAddress->text().toInt(0, 16);
-    unsigned int size = ui->eSize->text().toInt(0, 16);
-    try
-    {
-        comm->open(ui->ePort->currentText(), ui->eSpeed->currentText().toInt());
-        try
-        {
-            comm->erase(addr, size);
-            comm->flash(ui->eFile->text(), addr, true);
-            comm->close();
-        }
-        catch (...)
-        {
-            comm->close();
-            throw;
-        }
-    }
-    catch (Exception& e)
-    {
-        error(e.what() + "\n");
-    }
-    catch (...)
+    JOB_PARAMS params;
+    params.type = type;
+    params.port = ui->ePort->currentText();
+    Comm::parseSpeed(ui->eSpeed->currentText(), params.speed);
+    params.fileName = ui->eFile->text();
+    params.addr = ui->eAddress->text().toInt(0, 16);
+    params.size = ui->eSize->text().toInt(0, 16);
+    params.verify = true;
+    params.diff = ui->eDiff->isChecked();
+    params.wipe = ui->eWipe->isChecked();
+    return params;
+}
+
+void MainWindow::start(const JOB_PARAMS &params)
+{
+    unsigned int speed;
+    if (!Comm::parseSpeed(ui->eSpeed->currentText(), speed))
     {
-        error(tr("Unhandled exception\n"));
+        error(QString(tr("Invalid baud rate: %1\n")).arg(ui->eSpeed->currentText()));
+        return;
     }
+    CommJob* job = queue->enqueue(params);
+    connect(job, SIGNAL(progress(uint,uint)), this, SLOT(jobProgress(uint,uint)));
+    connect(job, SIGNAL(finished(bool,QString)), this, SLOT(jobFinished(bool,QString)));
+    ui->bCancel->setEnabled(true);
+}
+
+void MainWindow::on_bFlash_clicked()
+{
+    start(jobParams(JOB_FLASH));
 }
 
 void MainWindow::on_bSelectFile_clicked()
 {
-    QString name(QFileDialog::getOpenFileName(this, tr("Open File"),"",tr("Firmsware (*.bin)")));
+    QString name(QFileDialog::getOpenFileName(this, tr("Open File"),"",tr("Firmware (*.bin *.hex *.ihex *.s19 *.s28 *.s37 *.srec *.mot *.elf *.axf);;All files (*)")));
     if (!name.isEmpty())
         ui->eFile->setText(name);
 }
 
 void MainWindow::on_bDump_clicked()
 {
-    unsigned int addr = ui->eAddress->text().toInt(0, 16);
-    unsigned int size = ui->eSize->text().toInt(0, 16);
-    try
-    {
-        comm->open(ui->ePort->currentText(), ui->eSpeed->currentText().toInt());
-        try
-        {
-            comm->dump(ui->eFile->text(), addr, size);
-            comm->close();
-        }
-        catch (...)
-        {
-            comm->close();
-            throw;
-        }
-    }
-    catch (Exception& e)
-    {
-        error(e.what() + "\n");
-    }
-    catch (...)
-    {
-        error(tr("Unhandled exception\n"));
-    }
+    start(jobParams(JOB_DUMP));
+}
+
+void MainWindow::on_bRecipe_clicked()
+{
+    QString name(QFileDialog::getOpenFileName(this, tr("Open Recipe"), "", tr("Recipe (*.json);;All files (*)")));
+    if (name.isEmpty())
+        return;
+    JOB_PARAMS params(jobParams(JOB_RECIPE));
+    params.fileName = name;
+    info(QString(tr("Running %1\n")).arg(name));
+    start(params);
 }
 
 void MainWindow::on_bReadProtect_clicked()
 {
-    try
-    {
-        comm->open(ui->ePort->currentText(), ui->eSpeed->currentText().toInt());
-        try
-        {
-            info(tr("Read protecting\n"));
-            comm->cmdReadoutProtect();
-            hint(tr("Read protection complete. Device is reset\n"));
-        }
-        catch (...)
-        {
-            comm->close();
-            throw;
-        }
-    }
-    catch (Exception& e)
-    {
-        error(e.what() + "\n");
-    }
-    catch (...)
-    {
-        error(tr("Unhandled exception\n"));
-    }
+    info(tr("Read protecting\n"));
+    start(jobParams(JOB_PROTECT));
 }
 
 void MainWindow::on_eMassErase_clicked()
 {
-    try
+    info(tr("Mass erasing\n"));
+    start(jobParams(JOB_MASS_ERASE));
+}
+
+void MainWindow::on_bCancel_clicked()
+{
+    queue->cancelAll();
+}
+
+void MainWindow::jobProgress(unsigned int done, unsigned int total)
+{
+    ui->progress->setMaximum(total);
+    ui->progress->setValue(done);
+}
+
+void MainWindow::jobFinished(bool ok, const QString &error)
+{
+    CommJob* job = static_cast<CommJob*>(sender());
+    if (ok)
     {
-        comm->open(ui->ePort->currentText(), ui->eSpeed->currentText().toInt());
-        try
+        switch (job->getParams().type)
         {
-            info(tr("Mass erasing\n"));
-            comm->cmdEraseMemoryEx(ISP_MASS_ERASE);
+        case JOB_PROTECT:
+            hint(tr("Read protection complete. Device is reset\n"));
+            break;
+        case JOB_MASS_ERASE:
             hint(tr("Mass erase complete. Device is reset\n"));
+            break;
+        case JOB_RECIPE:
+            hint(tr("Recipe complete\n"));
+            break;
+        default:
+            break;
         }
-        catch (...)
-        {
-            comm->close();
-            throw;
-        }
-    }
-    catch (Exception& e)
-    {
-        error(e.what() + "\n");
-    }
-    catch (...)
-    {
-        error(tr("Unhandled exception\n"));
     }
+    else
+        this->error(error + "\n");
+    job->deleteLater();
+    ui->bCancel->setEnabled(queue->isBusy());
 }
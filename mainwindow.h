@@ -9,9 +9,9 @@
 
 #include <QMainWindow>
 #include <QFile>
+#include <QColor>
 #include "common.h"
-
-class Comm;
+#include "commworker.h"
 
 namespace Ui {
 class MainWindow;
@@ -22,31 +22,38 @@ class MainWindow : public QMainWindow
     Q_OBJECT
 private:
     Ui::MainWindow *ui;
-    Comm* comm;
+    CommQueue* queue;
     QFile logFile;
     bool newLine;
 
 protected:
     void logToScreen(const QString& text, const QColor& color);
     void logToFile(const QString& text);
-    void info(const QString& text, const QColor& color = Qt::black) {log(LOG_TYPE_DEFAULT, text, color);}
+    void info(const QString& text, Qt::GlobalColor color = Qt::black) {log(LOG_TYPE_DEFAULT, text, color);}
     void hint(const QString& text) {log(LOG_TYPE_HINT, text, Qt::black);}
     void warning(const QString& text) {log(LOG_TYPE_WARNING, text, Qt::black);}
     void error(const QString& text) {log(LOG_TYPE_ERROR, text, Qt::black);}
     void debug(const QString& text) {log(LOG_TYPE_DEBUG, text, Qt::black);}
 
+    JOB_PARAMS jobParams(JOB_TYPE type);
+    void start(const JOB_PARAMS& params);
+
 public:
     explicit MainWindow(QWidget *parent = 0);
     ~MainWindow();
 
 public slots:
-    void log(LOG_TYPE type, const QString& text, const QColor& color);
+    void log(LOG_TYPE type, const QString& text, Qt::GlobalColor color);
 private slots:
     void on_bFlash_clicked();
     void on_bSelectFile_clicked();
     void on_bDump_clicked();
+    void on_bRecipe_clicked();
     void on_bReadProtect_clicked();
     void on_eMassErase_clicked();
+    void on_bCancel_clicked();
+    void jobProgress(unsigned int done, unsigned int total);
+    void jobFinished(bool ok, const QString& error);
 };
 
 #endif // MAINWINDOW_H
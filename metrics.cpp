@@ -0,0 +1,335 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "metrics.h"
+#include "comm.h"
+#include "proto.h"
+#include <QSaveFile>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QTextStream>
+#include <exception>
+
+//stop check period of dump thread, ms
+#define DUMP_POLL_INTERVAL                          100
+
+CommMetrics::CommMetrics() :
+    current(ISP_GET)
+{
+    reset();
+}
+
+void CommMetrics::setPort(const QString &port)
+{
+    QMutexLocker locker(&mutex);
+    data.port = port;
+}
+
+void CommMetrics::reset()
+{
+    QMutexLocker locker(&mutex);
+    QString port = data.port;
+    data = COMM_METRICS();
+    data.port = port;
+    data.txBytes = data.rxBytes = 0;
+    data.syncCount = data.syncTimeouts = 0;
+    data.syncTime = 0;
+    data.eraseCount = 0;
+    data.eraseTime = 0;
+    data.programBytes = 0;
+    data.programTime = 0;
+    data.verifyBytes = 0;
+    data.verifyTime = 0;
+    data.retries = 0;
+}
+
+COMM_METRICS CommMetrics::snapshot() const
+{
+    QMutexLocker locker(&mutex);
+    return data;
+}
+
+CMD_METRICS& CommMetrics::command(unsigned char cmd)
+{
+    if (!data.commands.contains(cmd))
+    {
+        CMD_METRICS m;
+        m.count = m.errors = m.nacks = m.timeouts = m.retries = 0;
+        m.totalTime = m.maxTime = 0;
+        data.commands.insert(cmd, m);
+    }
+    return data.commands[cmd];
+}
+
+void CommMetrics::addTx(unsigned int size)
+{
+    QMutexLocker locker(&mutex);
+    data.txBytes += size;
+}
+
+void CommMetrics::addRx(unsigned int size)
+{
+    QMutexLocker locker(&mutex);
+    data.rxBytes += size;
+}
+
+void CommMetrics::beginCommand(unsigned char cmd)
+{
+    QMutexLocker locker(&mutex);
+    current = cmd;
+    ++command(cmd).count;
+}
+
+void CommMetrics::endCommand(unsigned char cmd, double time, bool ok)
+{
+    QMutexLocker locker(&mutex);
+    CMD_METRICS& m = command(cmd);
+    m.totalTime += time;
+    if (time > m.maxTime)
+        m.maxTime = time;
+    if (!ok)
+        ++m.errors;
+}
+
+void CommMetrics::addNack()
+{
+    QMutexLocker locker(&mutex);
+    ++command(current).nacks;
+}
+
+void CommMetrics::addTimeout()
+{
+    QMutexLocker locker(&mutex);
+    ++command(current).timeouts;
+}
+
+void CommMetrics::addRetry()
+{
+    QMutexLocker locker(&mutex);
+    ++command(current).retries;
+    ++data.retries;
+}
+
+void CommMetrics::addSync(double time, bool ok)
+{
+    QMutexLocker locker(&mutex);
+    ++data.syncCount;
+    data.syncTime += time;
+    if (!ok)
+        ++data.syncTimeouts;
+}
+
+void CommMetrics::addErase(double time)
+{
+    QMutexLocker locker(&mutex);
+    ++data.eraseCount;
+    data.eraseTime += time;
+}
+
+void CommMetrics::addProgram(unsigned int size, double time)
+{
+    QMutexLocker locker(&mutex);
+    data.programBytes += size;
+    data.programTime += time;
+}
+
+void CommMetrics::addVerify(unsigned int size, double time)
+{
+    QMutexLocker locker(&mutex);
+    data.verifyBytes += size;
+    data.verifyTime += time;
+}
+
+QString CommMetrics::commandName(unsigned char cmd)
+{
+    switch (cmd)
+    {
+    case ISP_GET:
+        return "get";
+    case ISP_GET_VERSION:
+        return "get_version";
+    case ISP_GET_ID:
+        return "get_id";
+    case ISP_READ_MEMORY:
+        return "read";
+    case ISP_GO:
+        return "go";
+    case ISP_WRITE_MEMORY:
+        return "write";
+    case ISP_ERASE_MEMORY:
+        return "erase";
+    case ISP_ERASE_MEMORY_EX:
+        return "erase_ex";
+    case ISP_READOUT_PROTECT:
+        return "readout_protect";
+    case ISP_READOUT_UNPROTECT:
+        return "readout_unprotect";
+    default:
+        return QString("0x%1").arg(cmd, 2, 16, QChar('0'));
+    }
+}
+
+QString CommMetrics::toJson(const QList<COMM_METRICS> &list)
+{
+    QJsonArray ports;
+    foreach (const COMM_METRICS& m, list)
+    {
+        QJsonObject obj;
+        obj["port"] = m.port;
+        obj["txBytes"] = static_cast<double>(m.txBytes);
+        obj["rxBytes"] = static_cast<double>(m.rxBytes);
+        obj["syncCount"] = static_cast<int>(m.syncCount);
+        obj["syncTimeouts"] = static_cast<int>(m.syncTimeouts);
+        obj["syncTime"] = m.syncTime;
+        obj["eraseCount"] = static_cast<int>(m.eraseCount);
+        obj["eraseTime"] = m.eraseTime;
+        obj["programBytes"] = static_cast<double>(m.programBytes);
+        obj["programTime"] = m.programTime;
+        obj["verifyBytes"] = static_cast<double>(m.verifyBytes);
+        obj["verifyTime"] = m.verifyTime;
+        obj["retries"] = static_cast<int>(m.retries);
+        QJsonObject commands;
+        for (QMap<unsigned char, CMD_METRICS>::const_iterator i = m.commands.constBegin(); i != m.commands.constEnd(); ++i)
+        {
+            QJsonObject cmd;
+            cmd["count"] = static_cast<int>(i.value().count);
+            cmd["errors"] = static_cast<int>(i.value().errors);
+            cmd["nacks"] = static_cast<int>(i.value().nacks);
+            cmd["timeouts"] = static_cast<int>(i.value().timeouts);
+            cmd["retries"] = static_cast<int>(i.value().retries);
+            cmd["totalTime"] = i.value().totalTime;
+            cmd["maxTime"] = i.value().maxTime;
+            commands[commandName(i.key())] = cmd;
+        }
+        obj["commands"] = commands;
+        ports.append(obj);
+    }
+    return QJsonDocument(ports).toJson(QJsonDocument::Indented);
+}
+
+static void promHeader(QTextStream& out, const QString& name, const QString& type, const QString& help)
+{
+    out << "# HELP stm32isp_" << name << ' ' << help << '\n';
+    out << "# TYPE stm32isp_" << name << ' ' << type << '\n';
+}
+
+QString CommMetrics::toPrometheus(const QList<COMM_METRICS> &list)
+{
+    QString res;
+    QTextStream out(&res);
+#define PROM_PORT(name, help, field, scale) \
+    promHeader(out, name, "counter", help); \
+    foreach (const COMM_METRICS& m, list) \
+        out << "stm32isp_" << name << "{port=\"" << m.port << "\"} " << (m.field) / (scale) << '\n';
+#define PROM_CMD(name, help, field, scale) \
+    promHeader(out, name, "counter", help); \
+    foreach (const COMM_METRICS& m, list) \
+        for (QMap<unsigned char, CMD_METRICS>::const_iterator i = m.commands.constBegin(); i != m.commands.constEnd(); ++i) \
+            out << "stm32isp_" << name << "{port=\"" << m.port << "\",command=\"" << commandName(i.key()) << "\"} " << (i.value().field) / (scale) << '\n';
+
+    PROM_PORT("tx_bytes_total", "Bytes transmitted", txBytes, 1)
+    PROM_PORT("rx_bytes_total", "Bytes received", rxBytes, 1)
+    PROM_PORT("sync_total", "Bootloader sync attempts", syncCount, 1)
+    PROM_PORT("sync_timeouts_total", "Bootloader sync timeouts", syncTimeouts, 1)
+    PROM_PORT("sync_seconds_total", "Time spent in sync", syncTime, 1000.0)
+    PROM_PORT("erase_total", "Erase operations", eraseCount, 1)
+    PROM_PORT("erase_seconds_total", "Time spent erasing", eraseTime, 1000.0)
+    PROM_PORT("program_bytes_total", "Bytes programmed", programBytes, 1)
+    PROM_PORT("program_seconds_total", "Time spent programming", programTime, 1000.0)
+    PROM_PORT("verify_bytes_total", "Bytes verified", verifyBytes, 1)
+    PROM_PORT("verify_seconds_total", "Time spent verifying", verifyTime, 1000.0)
+    PROM_PORT("retries_total", "Block retries", retries, 1)
+    PROM_CMD("command_total", "Bootloader commands", count, 1)
+    PROM_CMD("command_errors_total", "Failed bootloader commands", errors, 1)
+    PROM_CMD("command_nacks_total", "NACK responses", nacks, 1)
+    PROM_CMD("command_timeouts_total", "Response timeouts", timeouts, 1)
+    PROM_CMD("command_retries_total", "Retries after failed command", retries, 1)
+    PROM_CMD("command_seconds_total", "Command round-trip time", totalTime, 1000.0)
+    promHeader(out, "command_max_seconds", "gauge", "Slowest command round-trip");
+    foreach (const COMM_METRICS& m, list)
+        for (QMap<unsigned char, CMD_METRICS>::const_iterator i = m.commands.constBegin(); i != m.commands.constEnd(); ++i)
+            out << "stm32isp_command_max_seconds{port=\"" << m.port << "\",command=\"" << commandName(i.key()) << "\"} " << i.value().maxTime / 1000.0 << '\n';
+#undef PROM_PORT
+#undef PROM_CMD
+    out.flush();
+    return res;
+}
+
+MetricsScope::MetricsScope(CommMetrics &metrics, unsigned char cmd) :
+    metrics(metrics),
+    cmd(cmd),
+    exceptions(std::uncaught_exceptions())
+{
+    metrics.beginCommand(cmd);
+    timer.start();
+}
+
+MetricsScope::~MetricsScope()
+{
+    metrics.endCommand(cmd, timer.nsecsElapsed() / 1000000.0, std::uncaught_exceptions() <= exceptions);
+}
+
+MetricsDumper::MetricsDumper(const QString &fileName, METRICS_FORMAT format, int interval, QObject *parent) :
+    QThread(parent),
+    fileName(fileName),
+    format(format),
+    interval(interval),
+    stopped(0)
+{
+}
+
+MetricsDumper::~MetricsDumper()
+{
+    stop();
+    wait();
+}
+
+void MetricsDumper::add(const Comm *comm)
+{
+    QMutexLocker locker(&mutex);
+    comms.append(comm);
+}
+
+void MetricsDumper::remove(const Comm *comm)
+{
+    QMutexLocker locker(&mutex);
+    if (comms.removeAll(comm))
+        finished.append(comm->getMetrics());
+}
+
+void MetricsDumper::dump()
+{
+    QList<COMM_METRICS> list;
+    {
+        QMutexLocker locker(&mutex);
+        list = finished;
+        foreach (const Comm* comm, comms)
+            list.append(comm->getMetrics());
+    }
+    //readers never see partial file
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly))
+        return;
+    file.write((format == METRICS_FORMAT_PROMETHEUS ? CommMetrics::toPrometheus(list) : CommMetrics::toJson(list)).toUtf8());
+    file.commit();
+}
+
+void MetricsDumper::run()
+{
+    QElapsedTimer timer;
+    timer.start();
+    while (!stopped.load())
+    {
+        msleep(DUMP_POLL_INTERVAL);
+        if (timer.elapsed() >= interval)
+        {
+            dump();
+            timer.restart();
+        }
+    }
+    dump();
+}
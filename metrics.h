@@ -0,0 +1,125 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QThread>
+#include <QMutex>
+#include <QMap>
+#include <QList>
+#include <QString>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+
+class Comm;
+
+//per bootloader command, times in ms
+typedef struct {
+    unsigned int count;
+    unsigned int errors;
+    unsigned int nacks;
+    unsigned int timeouts;
+    unsigned int retries;
+    double totalTime;
+    double maxTime;
+} CMD_METRICS;
+
+typedef struct {
+    QString port;
+    quint64 txBytes, rxBytes;
+    unsigned int syncCount;
+    unsigned int syncTimeouts;
+    double syncTime;
+    unsigned int eraseCount;
+    double eraseTime;
+    quint64 programBytes;
+    double programTime;
+    quint64 verifyBytes;
+    double verifyTime;
+    unsigned int retries;
+    QMap<unsigned char, CMD_METRICS> commands;
+} COMM_METRICS;
+
+typedef enum {
+    METRICS_FORMAT_JSON = 0,
+    METRICS_FORMAT_PROMETHEUS
+} METRICS_FORMAT;
+
+//updated from Comm thread, snapshot may be taken from any thread
+class CommMetrics
+{
+private:
+    mutable QMutex mutex;
+    COMM_METRICS data;
+    unsigned char current;
+    CMD_METRICS& command(unsigned char cmd);
+public:
+    CommMetrics();
+
+    void setPort(const QString& port);
+    void reset();
+    COMM_METRICS snapshot() const;
+
+    void addTx(unsigned int size);
+    void addRx(unsigned int size);
+    void beginCommand(unsigned char cmd);
+    void endCommand(unsigned char cmd, double time, bool ok);
+    //attributed to last started command
+    void addNack();
+    void addTimeout();
+    void addRetry();
+    void addSync(double time, bool ok);
+    void addErase(double time);
+    void addProgram(unsigned int size, double time);
+    void addVerify(unsigned int size, double time);
+
+    static QString commandName(unsigned char cmd);
+    static QString toJson(const QList<COMM_METRICS>& list);
+    static QString toPrometheus(const QList<COMM_METRICS>& list);
+};
+
+//times one bootloader command, failed if left by exception
+class MetricsScope
+{
+private:
+    CommMetrics& metrics;
+    unsigned char cmd;
+    //in flight at construction, scope may live in a destructor during unwinding
+    int exceptions;
+    QElapsedTimer timer;
+public:
+    MetricsScope(CommMetrics& metrics, unsigned char cmd);
+    ~MetricsScope();
+};
+
+//writes snapshots of registered Comm instances to file
+class MetricsDumper : public QThread
+{
+    Q_OBJECT
+private:
+    QString fileName;
+    METRICS_FORMAT format;
+    int interval;
+    QAtomicInt stopped;
+    QMutex mutex;
+    QList<const Comm*> comms;
+    //last snapshots of removed instances
+    QList<COMM_METRICS> finished;
+protected:
+    void run();
+public:
+    MetricsDumper(const QString& fileName, METRICS_FORMAT format, int interval, QObject* parent = 0);
+    virtual ~MetricsDumper();
+
+    void add(const Comm* comm);
+    //comm snapshot is kept in next dumps
+    void remove(const Comm* comm);
+    void dump();
+    void stop() {stopped.store(1);}
+};
+
+#endif // METRICS_H
@@ -27,6 +27,8 @@
 #define ISP_ERASE_MEMORY_EX                         0x44
 #define ISP_READOUT_PROTECT                         0x82
 #define ISP_READOUT_UNPROTECT                       0x92
+//address, uint32_t size in bytes (word multiple), each with XOR checksum.
+//Reply: CRC-32/MPEG-2 of words, MSB first, XOR checksum
 
 #pragma pack(pop)
 
@@ -0,0 +1,169 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "recipe.h"
+#include "comm.h"
+#include "config.h"
+#include "device.h"
+#include "firmware.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+
+Recipe::Recipe(QObject *parent) :
+    QObject(parent),
+    go(true),
+    goAddr(0)
+{
+}
+
+QString Recipe::opName(RECIPE_OP op)
+{
+    switch (op)
+    {
+    case RECIPE_UNPROTECT:
+        return "unprotect";
+    case RECIPE_MASS_ERASE:
+        return "mass_erase";
+    case RECIPE_ERASE:
+        return "erase";
+    case RECIPE_FLASH:
+        return "flash";
+    case RECIPE_VERIFY:
+        return "verify";
+    case RECIPE_DUMP:
+        return "dump";
+    case RECIPE_PROTECT:
+        return "protect";
+    }
+    return QString();
+}
+
+void Recipe::load(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        throw ErrorFileOpen();
+    QJsonDocument doc(QJsonDocument::fromJson(file.readAll()));
+    file.close();
+    if (!doc.isObject())
+        throw ErrorRecipe();
+    QDir dir(QFileInfo(fileName).absoluteDir());
+
+    steps.clear();
+    foreach (const QJsonValue& value, doc.object().value("steps").toArray())
+    {
+        QJsonObject obj(value.toObject());
+        RECIPE_STEP step;
+        int op;
+        for (op = RECIPE_UNPROTECT; op <= RECIPE_PROTECT; ++op)
+            if (obj.value("op").toString() == opName(static_cast<RECIPE_OP>(op)))
+                break;
+        if (op > RECIPE_PROTECT)
+            throw ErrorRecipe();
+        step.op = static_cast<RECIPE_OP>(op);
+        step.fileName = obj.contains("file") ? dir.absoluteFilePath(obj.value("file").toString()) : QString();
+        step.addr = obj.contains("address") ? jsonToUInt(obj.value("address")) : FLASH_BASE;
+        step.size = obj.contains("size") ? jsonToUInt(obj.value("size")) : 0;
+        step.erase = obj.value("erase").toBool(true);
+        step.verify = obj.value("verify").toBool(true);
+        step.diff = obj.value("diff").toBool(false);
+        step.wipe = obj.value("wipe").toBool(false);
+        bool needFile = step.op == RECIPE_FLASH || step.op == RECIPE_VERIFY || step.op == RECIPE_DUMP;
+        if ((needFile && step.fileName.isEmpty()) || ((step.op == RECIPE_ERASE || step.op == RECIPE_DUMP) && step.size == 0))
+            throw ErrorRecipe();
+        steps.append(step);
+    }
+    if (steps.isEmpty())
+        throw ErrorRecipe();
+
+    QJsonValue goValue(doc.object().value("go"));
+    go = !goValue.isBool() || goValue.toBool();
+    goAddr = goValue.isBool() || goValue.isUndefined() ? 0 : jsonToUInt(goValue);
+}
+
+void Recipe::runStep(Comm *comm, const RECIPE_STEP &step)
+{
+    switch (step.op)
+    {
+    case RECIPE_UNPROTECT:
+        comm->cmdReadoutUnProtect();
+        break;
+    case RECIPE_MASS_ERASE:
+        if (comm->isExtendedErase())
+            comm->cmdEraseMemoryEx(ISP_MASS_ERASE, ERASE_MASS_TIMEOUT);
+        else
+            comm->cmdEraseMemory(ISP_MASS_ERASE, ERASE_MASS_TIMEOUT);
+        break;
+    case RECIPE_ERASE:
+        comm->eraseAuto(step.addr, step.size, step.wipe);
+        break;
+    case RECIPE_FLASH:
+    {
+        //address is used for raw binary only
+        Firmware firmware;
+        firmware.load(step.fileName, step.addr);
+        if (step.diff)
+            comm->flashDiff(firmware.getSegments(), step.verify);
+        else
+        {
+            if (step.erase)
+            {
+                if (step.size)
+                    comm->eraseAuto(step.addr, step.size, step.wipe);
+                else
+                    comm->eraseAuto(firmware.getSegments(), step.wipe);
+            }
+            comm->flash(firmware.getSegments(), step.verify);
+        }
+        break;
+    }
+    case RECIPE_VERIFY:
+    {
+        Firmware firmware;
+        firmware.load(step.fileName, step.addr);
+        comm->verify(firmware.getSegments());
+        break;
+    }
+    case RECIPE_DUMP:
+        comm->dump(step.fileName, step.addr, step.size);
+        break;
+    case RECIPE_PROTECT:
+        comm->cmdReadoutProtect();
+        break;
+    }
+}
+
+void Recipe::run(Comm *comm)
+{
+    bool protectedFlash = false;
+    for (int i = 0; i < steps.size(); ++i)
+    {
+        const RECIPE_STEP& step = steps.at(i);
+        emit log(LOG_TYPE_DEFAULT, QString(tr("Step %1/%2: %3\n")).arg(i + 1).arg(steps.size()).arg(opName(step.op)), Qt::black);
+        runStep(comm, step);
+        if (step.op == RECIPE_PROTECT)
+            protectedFlash = true;
+        else if (step.op == RECIPE_UNPROTECT)
+            protectedFlash = false;
+        //mass erase and RDP change reset device
+        bool more = i + 1 < steps.size() || (go && !protectedFlash);
+        if (!comm->isActive() && more)
+            comm->reconnect();
+    }
+    if (!go)
+        return;
+    //Go is refused while flash is read protected
+    if (protectedFlash)
+    {
+        emit log(LOG_TYPE_HINT, tr("Flash is read protected, reset device to start firmware\n"), Qt::black);
+        return;
+    }
+    comm->cmdGo(goAddr ? goAddr : comm->getDevice().flashBase);
+}
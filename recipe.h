@@ -0,0 +1,70 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef RECIPE_H
+#define RECIPE_H
+
+#include <QObject>
+#include <QString>
+#include <QVector>
+#include "common.h"
+#include "error.h"
+
+class Comm;
+
+class ErrorRecipe: public ErrorFile
+{
+public:
+    ErrorRecipe() throw() :ErrorFile() {str = (QObject::tr("Invalid recipe file"));}
+};
+
+typedef enum {
+    RECIPE_UNPROTECT,
+    RECIPE_MASS_ERASE,
+    RECIPE_ERASE,
+    RECIPE_FLASH,
+    RECIPE_VERIFY,
+    RECIPE_DUMP,
+    RECIPE_PROTECT
+} RECIPE_OP;
+
+typedef struct {
+    RECIPE_OP op;
+    //relative to recipe file
+    QString fileName;
+    unsigned int addr, size;
+    bool erase, verify, diff, wipe;
+} RECIPE_STEP;
+
+//Station job file: ordered steps run in one Comm session, device is reconnected
+//after steps that reset it and started by Go at the end. Format:
+//{"steps": [{"op": "unprotect"}, {"op": "mass_erase"},
+//           {"op": "flash", "file": "fw.hex", "erase": false}, {"op": "protect"}],
+// "go": "0x08000000"}
+class Recipe : public QObject
+{
+    Q_OBJECT
+private:
+    QVector<RECIPE_STEP> steps;
+    bool go;
+    //0 - flash base of connected device
+    unsigned int goAddr;
+
+    static QString opName(RECIPE_OP op);
+    void runStep(Comm* comm, const RECIPE_STEP& step);
+public:
+    explicit Recipe(QObject *parent = 0);
+
+    void load(const QString& fileName);
+    const QVector<RECIPE_STEP>& getSteps() const {return steps;}
+    //comm is open, port is closed by Go
+    void run(Comm* comm);
+
+signals:
+    void log(LOG_TYPE type, const QString& text, Qt::GlobalColor color);
+};
+
+#endif // RECIPE_H
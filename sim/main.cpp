@@ -0,0 +1,160 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "simulator.h"
+#include "device.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QTextStream>
+#include <signal.h>
+
+static Simulator* simulator = 0;
+
+static void stopHandler(int)
+{
+    if (simulator)
+        simulator->stop();
+}
+
+static unsigned int number(const QString& str, unsigned int def)
+{
+    bool ok;
+    unsigned int res = str.toUInt(&ok, 0);
+    return ok ? res : def;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("stm32_isp_sim");
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QObject::tr("STM32 USART bootloader simulator on pseudo-terminal. Slave device path is printed to stdout."));
+    parser.addHelpOption();
+    QCommandLineOption pidOption("pid", QObject::tr("Product ID from device database, 0x410 by default"), "pid");
+    QCommandLineOption devicesOption("devices", QObject::tr("Device database file"), "file");
+    QCommandLineOption flashSizeOption("flash-size", QObject::tr("Flash size, bytes"), "size");
+    QCommandLineOption pageSizeOption("page-size", QObject::tr("Uniform page size, bytes"), "size");
+    QCommandLineOption extendedOption("extended", QObject::tr("Extended erase command (bootloader v3.x)"));
+    QCommandLineOption baudOption(QStringList() << "b" << "baud", QObject::tr("Emulated line rate, 0 - no wire time"), "baud");
+    QCommandLineOption eraseTimeOption("erase-time", QObject::tr("Page erase time, us"), "us");
+    QCommandLineOption massEraseTimeOption("mass-erase-time", QObject::tr("Mass erase time, us"), "us");
+    QCommandLineOption writeTimeOption("write-time", QObject::tr("Block write time, us"), "us");
+    QCommandLineOption resetTimeOption("reset-time", QObject::tr("Reset to bootloader start time, us"), "us");
+    QCommandLineOption resetHangOption("reset-hang", QObject::tr("Don't come back after reset, as with BOOT0 low"));
+    QCommandLineOption writeDamageOption("write-damage", QObject::tr("Write Memory request number that isn't programmed"), "n");
+    QCommandLineOption protectedOption("protected", QObject::tr("Start with readout protection"));
+    QCommandLineOption noStubOption("no-stub", QObject::tr("Don't emulate RAM flash loader, Go only resets"));
+    QCommandLineOption stubDamageOption("stub-damage", QObject::tr("Loader request number received with bad CRC"), "n");
+    QCommandLineOption stubImageOption("stub-image", QObject::tr("Write loader image for flasher --stub-file and exit"), "file");
+    QCommandLineOption linkOption("link", QObject::tr("Create symlink to slave device"), "path");
+    parser.addOption(pidOption);
+    parser.addOption(devicesOption);
+    parser.addOption(flashSizeOption);
+    parser.addOption(pageSizeOption);
+    parser.addOption(extendedOption);
+    parser.addOption(baudOption);
+    parser.addOption(eraseTimeOption);
+    parser.addOption(massEraseTimeOption);
+    parser.addOption(writeTimeOption);
+    parser.addOption(resetTimeOption);
+    parser.addOption(resetHangOption);
+    parser.addOption(writeDamageOption);
+    parser.addOption(protectedOption);
+    parser.addOption(noStubOption);
+    parser.addOption(stubDamageOption);
+    parser.addOption(stubImageOption);
+    parser.addOption(linkOption);
+    parser.process(a);
+
+    SIM_CONFIG config = Simulator::defaultConfig();
+    try
+    {
+        if (parser.isSet(pidOption) || parser.isSet(devicesOption))
+        {
+            DeviceDatabase devices;
+            devices.loadBuiltin();
+            if (parser.isSet(devicesOption))
+                devices.load(parser.value(devicesOption));
+            Device device = devices.find(number(parser.value(pidOption), config.device.pid));
+            device.pid = number(parser.value(pidOption), config.device.pid);
+            if (!device.ramSize)
+            {
+                device.ramBase = config.device.ramBase;
+                device.ramSize = config.device.ramSize;
+            }
+            config.device = device;
+        }
+    }
+    catch (Exception& e)
+    {
+        err << e.what() << endl;
+        return 1;
+    }
+    if (parser.isSet(flashSizeOption))
+        config.device.flashSize = number(parser.value(flashSizeOption), config.device.flashSize);
+    if (parser.isSet(pageSizeOption) || parser.isSet(flashSizeOption))
+    {
+        SECTOR_GROUP group;
+        group.size = number(parser.value(pageSizeOption), config.device.layout.isEmpty() ? PAGE_SIZE : config.device.layout.first().size);
+        group.count = config.device.flashSize / group.size;
+        config.device.layout.clear();
+        config.device.layout.append(group);
+    }
+    config.extendedErase = parser.isSet(extendedOption);
+    config.version = config.extendedErase ? 0x31 : 0x22;
+    config.baud = number(parser.value(baudOption), config.baud);
+    config.eraseTime = number(parser.value(eraseTimeOption), config.eraseTime);
+    config.massEraseTime = number(parser.value(massEraseTimeOption), config.massEraseTime);
+    config.writeTime = number(parser.value(writeTimeOption), config.writeTime);
+    config.resetTime = number(parser.value(resetTimeOption), config.resetTime);
+    config.resetHang = parser.isSet(resetHangOption);
+    config.writeDamage = number(parser.value(writeDamageOption), config.writeDamage);
+    config.readProtected = parser.isSet(protectedOption);
+    config.stub = !parser.isSet(noStubOption);
+    config.stubDamage = number(parser.value(stubDamageOption), config.stubDamage);
+    if (parser.isSet(stubImageOption))
+    {
+        QFile file(parser.value(stubImageOption));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(Simulator::stubImage(config.device)) < 0)
+        {
+            err << ErrorFileCreate().what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    Simulator sim(config);
+    try
+    {
+        QString name = sim.open();
+        if (parser.isSet(linkOption))
+        {
+            QFile::remove(parser.value(linkOption));
+            if (!QFile::link(name, parser.value(linkOption)))
+                throw ErrorFileCreate();
+            name = parser.value(linkOption);
+        }
+        out << name << endl;
+    }
+    catch (Exception& e)
+    {
+        err << e.what() << endl;
+        return 1;
+    }
+
+    simulator = &sim;
+    signal(SIGINT, stopHandler);
+    signal(SIGTERM, stopHandler);
+    sim.start();
+    sim.wait();
+    if (parser.isSet(linkOption))
+        QFile::remove(parser.value(linkOption));
+    return 0;
+}
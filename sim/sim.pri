@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Bootloader simulator, POSIX pseudo-terminal only
+#
+#-------------------------------------------------
+
+INCLUDEPATH += $$PWD
+
+SOURCES += $$PWD/simulator.cpp
+
+HEADERS  += $$PWD/simulator.h
@@ -0,0 +1,17 @@
+#-------------------------------------------------
+#
+# STM32 bootloader simulator on pseudo-terminal
+#
+#-------------------------------------------------
+
+QT       -= gui
+
+TARGET = stm32_isp_sim
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += main.cpp
+
+include(sim.pri)
+include(../core.pri)
@@ -0,0 +1,714 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "simulator.h"
+#include "config.h"
+#include "comm.h"
+#include "crc.h"
+#include "lz4.h"
+#include "transport.h"
+#include <QtEndian>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define POLL_INTERVAL                               100
+
+Simulator::Simulator(const SIM_CONFIG &config, QObject *parent) :
+    QThread(parent),
+    config(config),
+    master(-1),
+    slave(-1),
+    pipe(0),
+    stopped(0),
+    synced(false),
+    protectedFlash(config.readProtected),
+    halted(false),
+    pendingRx(0),
+    writes(0),
+    stubFrameSize(0),
+    stubFrames(0)
+{
+    flash = QByteArray(config.device.flashSize, static_cast<char>(0xff));
+    ram = QByteArray(config.device.ramSize, 0);
+    sectors = config.device.sectors(config.device.flashBase, config.device.flashSize);
+}
+
+Simulator::~Simulator()
+{
+    stop();
+    wait();
+    delete pipe;
+    if (slave >= 0)
+        ::close(slave);
+    if (master >= 0)
+        ::close(master);
+}
+
+SIM_CONFIG Simulator::defaultConfig()
+{
+    SIM_CONFIG config;
+    //STM32F10x medium-density
+    config.device.pid = 0x410;
+    config.device.name = "STM32F10x medium-density";
+    config.device.flashBase = FLASH_BASE;
+    config.device.flashSize = 128 * 1024;
+    config.device.ramBase = 0x20000200;
+    config.device.ramSize = 0x4e00;
+    SECTOR_GROUP group;
+    group.count = 128;
+    group.size = 1024;
+    config.device.layout.append(group);
+    config.version = 0x22;
+    config.extendedErase = false;
+    config.baud = 115200;
+    config.eraseTime = 20000;
+    config.massEraseTime = 40000;
+    config.writeTime = 1000;
+    config.resetTime = 5000;
+    config.resetHang = false;
+    config.readProtected = false;
+    config.writeDamage = 0;
+    config.stub = true;
+    config.stubDamage = 0;
+    return config;
+}
+
+QByteArray Simulator::stubImage(const Device &device)
+{
+    STUB_HEADER header;
+    header.sp = qToLittleEndian<quint32>(device.ramBase + device.ramSize);
+    //thumb
+    header.entry = qToLittleEndian<quint32>(device.ramBase + sizeof(STUB_HEADER) + 1);
+    header.magic = qToLittleEndian<quint32>(STUB_MAGIC);
+    header.version = qToLittleEndian<quint16>(STUB_VERSION);
+    header.window = qToLittleEndian<quint16>(3);
+    header.base = qToLittleEndian<quint32>(device.ramBase);
+    header.frameSize = qToLittleEndian<quint32>(1024);
+    header.features = qToLittleEndian<quint32>(STUB_FEATURE_LZ4 | STUB_FEATURE_CRC);
+    return QByteArray(reinterpret_cast<const char*>(&header), sizeof(STUB_HEADER));
+}
+
+QString Simulator::open()
+{
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) || unlockpt(master))
+        throw ErrorPortOpen();
+    struct termios tio;
+    tcgetattr(master, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master, TCSANOW, &tio);
+    slaveName = ptsname(master);
+    //keep slave open, so master doesn't get EIO between client sessions
+    slave = ::open(slaveName.toLocal8Bit().constData(), O_RDWR | O_NOCTTY);
+    if (slave < 0)
+        throw ErrorPortOpen();
+    return slaveName;
+}
+
+QString Simulator::listen(const QString &name)
+{
+    pipe = PipeTransport::listen(name);
+    if (!pipe)
+        throw ErrorPortOpen();
+    slaveName = QString("pipe:%1").arg(name);
+    return slaveName;
+}
+
+void Simulator::delay(unsigned int us)
+{
+    if (us)
+        usleep(us);
+}
+
+unsigned char Simulator::rx()
+{
+    if (pipe)
+    {
+        unsigned char c;
+        while (pipe->read(reinterpret_cast<char*>(&c), 1, POLL_INTERVAL) != 1)
+            if (stopped.load())
+                throw ErrorSimulatorStopped();
+        ++pendingRx;
+        return c;
+    }
+    struct pollfd fd;
+    fd.fd = master;
+    fd.events = POLLIN;
+    for (;;)
+    {
+        if (stopped.load())
+            throw ErrorSimulatorStopped();
+        if (poll(&fd, 1, POLL_INTERVAL) <= 0)
+            continue;
+        unsigned char c;
+        if (::read(master, &c, 1) == 1)
+        {
+            ++pendingRx;
+            return c;
+        }
+        //client gone, keep waiting for next session
+        usleep(POLL_INTERVAL * 1000);
+    }
+}
+
+void Simulator::tx(const QByteArray &buf)
+{
+    //wire time of request and response
+    if (config.baud)
+        delay(static_cast<unsigned long long>(pendingRx + buf.size()) * BITS_PER_CHAR * 1000000 / config.baud);
+    pendingRx = 0;
+    if (pipe ? !pipe->write(buf.constData(), buf.size()) : ::write(master, buf.constData(), buf.size()) < 0)
+        throw ErrorPort();
+}
+
+bool Simulator::rxAddr(unsigned int &addr)
+{
+    unsigned char crc = 0;
+    addr = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        unsigned char c = rx();
+        crc ^= c;
+        addr = (addr << 8) | c;
+    }
+    return rx() == crc;
+}
+
+char* Simulator::memory(unsigned int addr, unsigned int size)
+{
+    const Device& device = config.device;
+    if (addr >= device.flashBase && addr + size <= device.flashBase + static_cast<unsigned int>(flash.size()))
+        return flash.data() + (addr - device.flashBase);
+    if (addr >= device.ramBase && addr + size <= device.ramBase + static_cast<unsigned int>(ram.size()))
+        return ram.data() + (addr - device.ramBase);
+    return 0;
+}
+
+void Simulator::reset()
+{
+    synced = false;
+    halted = config.resetHang;
+    delay(config.resetTime);
+    if (pipe)
+        pipe->clear();
+    else
+        tcflush(master, TCIFLUSH);
+    pendingRx = 0;
+}
+
+void Simulator::cmdGet()
+{
+    QByteArray buf;
+    buf.append(static_cast<char>(ISP_ACK));
+    QByteArray cmds;
+    cmds.append(static_cast<char>(ISP_GET));
+    cmds.append(static_cast<char>(ISP_GET_VERSION));
+    cmds.append(static_cast<char>(ISP_GET_ID));
+    cmds.append(static_cast<char>(ISP_READ_MEMORY));
+    cmds.append(static_cast<char>(ISP_GO));
+    cmds.append(static_cast<char>(ISP_WRITE_MEMORY));
+    cmds.append(static_cast<char>(config.extendedErase ? ISP_ERASE_MEMORY_EX : ISP_ERASE_MEMORY));
+    cmds.append(static_cast<char>(ISP_READOUT_PROTECT));
+    cmds.append(static_cast<char>(ISP_READOUT_UNPROTECT));
+    buf.append(static_cast<char>(cmds.size()));
+    buf.append(static_cast<char>(config.version));
+    buf.append(cmds);
+    buf.append(static_cast<char>(ISP_ACK));
+    tx(buf);
+}
+
+void Simulator::cmdGetVersion()
+{
+    QByteArray buf;
+    buf.append(static_cast<char>(ISP_ACK));
+    buf.append(static_cast<char>(config.version));
+    buf.append(2, 0);
+    buf.append(static_cast<char>(ISP_ACK));
+    tx(buf);
+}
+
+void Simulator::cmdGetID()
+{
+    QByteArray buf;
+    buf.append(static_cast<char>(ISP_ACK));
+    buf.append(static_cast<char>(1));
+    buf.append(static_cast<char>(config.device.pid >> 8));
+    buf.append(static_cast<char>(config.device.pid & 0xff));
+    buf.append(static_cast<char>(ISP_ACK));
+    tx(buf);
+}
+
+void Simulator::cmdReadMemory()
+{
+    unsigned int addr;
+    if (protectedFlash)
+    {
+        nack();
+        return;
+    }
+    ack();
+    if (!rxAddr(addr))
+    {
+        nack();
+        return;
+    }
+    //flash size register
+    bool sizeReg = config.device.flashSizeReg && addr == config.device.flashSizeReg;
+    if (!sizeReg && !memory(addr, 1))
+    {
+        nack();
+        return;
+    }
+    ack();
+    unsigned char n = rx();
+    if ((rx() ^ n) != 0xff)
+    {
+        nack();
+        return;
+    }
+    QByteArray buf;
+    buf.append(static_cast<char>(ISP_ACK));
+    if (sizeReg)
+    {
+        buf.append(static_cast<char>((flash.size() / 1024) & 0xff));
+        buf.append(static_cast<char>((flash.size() / 1024) >> 8));
+        buf.append(QByteArray(n + 1 - 2, 0));
+    }
+    else
+    {
+        char* p = memory(addr, n + 1);
+        if (p)
+            buf.append(p, n + 1);
+        else
+            buf.append(QByteArray(n + 1, 0));
+    }
+    tx(buf);
+}
+
+void Simulator::cmdGo()
+{
+    unsigned int addr;
+    if (protectedFlash)
+    {
+        nack();
+        return;
+    }
+    ack();
+    if (!rxAddr(addr) || !memory(addr, 1))
+    {
+        nack();
+        return;
+    }
+    ack();
+    const char* header = memory(addr, sizeof(STUB_HEADER));
+    if (config.stub && header && qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(header) + offsetof(STUB_HEADER, magic)) == STUB_MAGIC)
+        runStub(qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(header) + offsetof(STUB_HEADER, frameSize)));
+    reset();
+}
+
+bool Simulator::stubRx(STUB_FRAME &frame, QByteArray &payload)
+{
+    char buf[sizeof(STUB_FRAME)];
+    do
+        buf[0] = rx();
+    while (buf[0] != static_cast<char>(STUB_SYNC));
+    for (unsigned int i = 1; i < sizeof(STUB_FRAME); ++i)
+        buf[i] = rx();
+    memcpy(&frame, buf, sizeof(STUB_FRAME));
+    frame.addr = qFromLittleEndian<quint32>(frame.addr);
+    frame.size = qFromLittleEndian<quint32>(frame.size);
+    //READ and CRC size is requested length
+    payload.resize(frame.cmd == STUB_READ || frame.cmd == STUB_CRC ? 0 : frame.size);
+    if (static_cast<unsigned int>(payload.size()) > stubFrameSize || (frame.cmd == STUB_READ && frame.size > stubFrameSize))
+        return false;
+    for (int i = 0; i < payload.size(); ++i)
+        payload[i] = rx();
+    uchar crc[4];
+    for (int i = 0; i < 4; ++i)
+        crc[i] = rx();
+    if (++stubFrames == config.stubDamage)
+        return false;
+    return qFromLittleEndian<quint32>(crc) == crc32(payload.constData(), payload.size(), crc32(buf, sizeof(STUB_FRAME)));
+}
+
+void Simulator::stubTx(const STUB_FRAME &req, unsigned char status, const QByteArray &data)
+{
+    STUB_FRAME res;
+    res.sync = STUB_SYNC;
+    res.cmd = req.cmd | STUB_REPLY;
+    res.seq = req.seq;
+    res.status = status;
+    res.addr = qToLittleEndian<quint32>(req.addr);
+    res.size = qToLittleEndian<quint32>(data.size());
+    QByteArray buf(reinterpret_cast<const char*>(&res), sizeof(STUB_FRAME));
+    buf.append(data);
+    quint32 crc = qToLittleEndian<quint32>(crc32(buf.constData(), buf.size()));
+    buf.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+    tx(buf);
+}
+
+unsigned char Simulator::stubErase(const QByteArray &pages)
+{
+    for (int i = 0; i + 4 <= pages.size(); i += 4)
+    {
+        unsigned int addr = qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(pages.constData()) + i);
+        int page = -1;
+        for (int j = 0; j < sectors.size() && page < 0; ++j)
+            if (sectors.at(j).addr == addr)
+                page = j;
+        if (page < 0)
+            return STUB_ERROR_RANGE;
+        erasePage(page);
+    }
+    return STUB_OK;
+}
+
+unsigned char Simulator::stubWrite(unsigned int addr, const QByteArray &data)
+{
+    char* p = memory(addr, data.size());
+    if (!p || p < flash.data() || p >= flash.data() + flash.size() || (addr & 1) || (data.size() & 1))
+        return STUB_ERROR_RANGE;
+    for (int i = 0; i < data.size(); i += 2)
+    {
+        //halfword is programmed only if erased, as FPEC does
+        if ((p[i] & p[i + 1]) != static_cast<char>(0xff) && (data.at(i) & data.at(i + 1)) != static_cast<char>(0xff))
+            return STUB_ERROR_FLASH;
+        p[i] &= data.at(i);
+        p[i + 1] &= data.at(i + 1);
+    }
+    delay(static_cast<unsigned long long>(config.writeTime) * data.size() / MAX_BLOCK_SIZE);
+    return STUB_OK;
+}
+
+QByteArray Simulator::stubChecksum(unsigned int addr, unsigned int size)
+{
+    quint32 crc = qToLittleEndian<quint32>(crc32(memory(addr, size), size));
+    return QByteArray(reinterpret_cast<const char*>(&crc), sizeof(crc));
+}
+
+void Simulator::runStub(unsigned int frameSize)
+{
+    STUB_FRAME req;
+    QByteArray payload;
+    unsigned char seq = 0;
+    unsigned char lastStatus = STUB_OK;
+    stubFrameSize = frameSize;
+
+    req.cmd = STUB_HELLO;
+    req.seq = 0;
+    req.addr = STUB_MAGIC;
+    stubTx(req, STUB_OK);
+    for (;;)
+    {
+        if (!stubRx(req, payload))
+        {
+            //host goes back to first unanswered request
+            if (req.seq == seq && req.size <= stubFrameSize)
+                stubTx(req, STUB_ERROR_CRC);
+            continue;
+        }
+        if (req.seq == static_cast<unsigned char>(seq - 1))
+        {
+            //reply was lost, reads are repeated
+            if (req.cmd == STUB_READ && memory(req.addr, req.size))
+                stubTx(req, STUB_OK, QByteArray(memory(req.addr, req.size), req.size));
+            else if (req.cmd == STUB_CRC && lastStatus == STUB_OK)
+                stubTx(req, STUB_OK, stubChecksum(req.addr, req.size));
+            else
+                stubTx(req, lastStatus);
+            continue;
+        }
+        if (req.seq != seq)
+            continue;
+        ++seq;
+        switch (req.cmd)
+        {
+        case STUB_ERASE:
+            lastStatus = stubErase(payload);
+            stubTx(req, lastStatus);
+            break;
+        case STUB_WRITE:
+            lastStatus = stubWrite(req.addr, payload);
+            stubTx(req, lastStatus);
+            break;
+        case STUB_WRITE_LZ4:
+        {
+            //unpacked size, LZ4 block
+            unsigned int unpacked = payload.size() >= 4 ? qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(payload.constData())) : 0;
+            QByteArray data(stubFrameSize, 0);
+            if (payload.size() < 4 || unpacked > stubFrameSize
+                    || lz4Decompress(payload.constData() + 4, payload.size() - 4, data.data(), unpacked) != static_cast<int>(unpacked))
+                lastStatus = STUB_ERROR_COMMAND;
+            else
+                lastStatus = stubWrite(req.addr, data.left(unpacked));
+            stubTx(req, lastStatus);
+            break;
+        }
+        case STUB_READ:
+            lastStatus = memory(req.addr, req.size) ? STUB_OK : STUB_ERROR_RANGE;
+            stubTx(req, lastStatus, lastStatus == STUB_OK ? QByteArray(memory(req.addr, req.size), req.size) : QByteArray());
+            break;
+        case STUB_CRC:
+            lastStatus = memory(req.addr, req.size) ? STUB_OK : STUB_ERROR_RANGE;
+            stubTx(req, lastStatus, lastStatus == STUB_OK ? stubChecksum(req.addr, req.size) : QByteArray());
+            break;
+        case STUB_EXIT:
+            stubTx(req, STUB_OK);
+            return;
+        default:
+            lastStatus = STUB_ERROR_COMMAND;
+            stubTx(req, lastStatus);
+            break;
+        }
+    }
+}
+
+void Simulator::cmdWriteMemory()
+{
+    unsigned int addr;
+    if (protectedFlash)
+    {
+        nack();
+        return;
+    }
+    ack();
+    if (!rxAddr(addr))
+    {
+        nack();
+        return;
+    }
+    ack();
+    unsigned char n = rx();
+    unsigned char crc = n;
+    QByteArray data;
+    for (int i = 0; i <= n; ++i)
+    {
+        data.append(static_cast<char>(rx()));
+        crc ^= static_cast<unsigned char>(data.at(i));
+    }
+    char* p = memory(addr, data.size());
+    if (rx() != crc || !p || (addr & 3))
+    {
+        nack();
+        return;
+    }
+    bool isFlash = p >= flash.data() && p < flash.data() + flash.size();
+    if (++writes == config.writeDamage)
+    {
+        ack();
+        return;
+    }
+    for (int i = 0; i < data.size(); ++i)
+        //flash bits are only cleared by programming
+        p[i] = isFlash ? (p[i] & data.at(i)) : data.at(i);
+    if (isFlash)
+        delay(config.writeTime);
+    ack();
+}
+
+void Simulator::erasePage(unsigned int page)
+{
+    if (page >= static_cast<unsigned int>(sectors.size()))
+        return;
+    memset(flash.data() + (sectors.at(page).addr - config.device.flashBase), 0xff, sectors.at(page).size);
+    delay(config.eraseTime);
+}
+
+void Simulator::massErase()
+{
+    flash.fill(static_cast<char>(0xff));
+    delay(config.massEraseTime);
+}
+
+void Simulator::cmdErase()
+{
+    if (protectedFlash)
+    {
+        nack();
+        return;
+    }
+    ack();
+    unsigned char n = rx();
+    unsigned char crc = n;
+    if (n == 0xff)
+    {
+        if (rx() != 0x00)
+        {
+            nack();
+            return;
+        }
+        massErase();
+        ack();
+        reset();
+        return;
+    }
+    QVector<unsigned int> pages;
+    for (int i = 0; i <= n; ++i)
+    {
+        unsigned char c = rx();
+        crc ^= c;
+        pages.append(c);
+    }
+    if (rx() != crc)
+    {
+        nack();
+        return;
+    }
+    foreach (unsigned int page, pages)
+        erasePage(page);
+    ack();
+}
+
+void Simulator::cmdEraseEx()
+{
+    if (protectedFlash)
+    {
+        nack();
+        return;
+    }
+    ack();
+    unsigned char hi = rx();
+    unsigned char lo = rx();
+    unsigned char crc = hi ^ lo;
+    unsigned int n = (hi << 8) | lo;
+    if (n >= 0xfff0)
+    {
+        if (rx() != crc)
+        {
+            nack();
+            return;
+        }
+        if (n == ISP_MASS_ERASE)
+        {
+            massErase();
+            ack();
+            if ((config.device.quirks & QUIRK_ERASE_NO_RESET) == 0)
+                reset();
+            return;
+        }
+        unsigned int bankSize = flash.size() / (config.device.banks ? config.device.banks : 1);
+        unsigned int bank = n == ISP_ERASE_BANK1 ? 0 : 1;
+        if ((n != ISP_ERASE_BANK1 && n != ISP_ERASE_BANK2) || config.device.banks < 2)
+        {
+            nack();
+            return;
+        }
+        memset(flash.data() + bank * bankSize, 0xff, bankSize);
+        delay(config.massEraseTime / 2);
+        ack();
+        return;
+    }
+    QVector<unsigned int> pages;
+    for (unsigned int i = 0; i <= n; ++i)
+    {
+        hi = rx();
+        lo = rx();
+        crc ^= hi ^ lo;
+        pages.append((hi << 8) | lo);
+    }
+    if (rx() != crc)
+    {
+        nack();
+        return;
+    }
+    foreach (unsigned int page, pages)
+        erasePage(page);
+    ack();
+}
+
+void Simulator::cmdReadoutProtect()
+{
+    ack();
+    protectedFlash = true;
+    ack();
+    reset();
+}
+
+void Simulator::cmdReadoutUnProtect()
+{
+    ack();
+    massErase();
+    protectedFlash = false;
+    ack();
+    reset();
+}
+
+void Simulator::run()
+{
+    try
+    {
+        for (;;)
+        {
+            unsigned char cmd = rx();
+            if (halted)
+                continue;
+            if (!synced)
+            {
+                //autobaud
+                if (cmd == ISP_START_FRAME)
+                {
+                    synced = true;
+                    ack();
+                }
+                continue;
+            }
+            if ((rx() ^ cmd) != 0xff)
+            {
+                nack();
+                continue;
+            }
+            switch (cmd)
+            {
+            case ISP_GET:
+                cmdGet();
+                break;
+            case ISP_GET_VERSION:
+                cmdGetVersion();
+                break;
+            case ISP_GET_ID:
+                cmdGetID();
+                break;
+            case ISP_READ_MEMORY:
+                cmdReadMemory();
+                break;
+            case ISP_GO:
+                cmdGo();
+                break;
+            case ISP_WRITE_MEMORY:
+                cmdWriteMemory();
+                break;
+            case ISP_ERASE_MEMORY:
+                if (config.extendedErase)
+                    nack();
+                else
+                    cmdErase();
+                break;
+            case ISP_ERASE_MEMORY_EX:
+                if (config.extendedErase)
+                    cmdEraseEx();
+                else
+                    nack();
+                break;
+            case ISP_READOUT_PROTECT:
+                cmdReadoutProtect();
+                break;
+            case ISP_READOUT_UNPROTECT:
+                cmdReadoutUnProtect();
+                break;
+            default:
+                nack();
+                break;
+            }
+        }
+    }
+    catch (ErrorSimulatorStopped)
+    {
+    }
+}
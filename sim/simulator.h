@@ -0,0 +1,119 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include <QThread>
+#include <QByteArray>
+#include <QAtomicInt>
+#include <QVector>
+#include "device.h"
+#include "error.h"
+#include "proto.h"
+#include "stubproto.h"
+
+class PipeTransport;
+
+typedef struct {
+    Device device;
+    unsigned char version;
+    bool extendedErase;
+    //emulated line rate, 0 - no wire time
+    unsigned int baud;
+    //latencies, us
+    unsigned int eraseTime;
+    unsigned int massEraseTime;
+    unsigned int writeTime;
+    //reset to bootloader start, input is lost meanwhile
+    unsigned int resetTime;
+    //bootloader doesn't come back after reset, input is dropped
+    bool resetHang;
+    bool readProtected;
+    //Write Memory request number that is acknowledged but not programmed, 0 - none
+    unsigned int writeDamage;
+    //RAM flash loader started by Go is emulated
+    bool stub;
+    //loader request number received with bad CRC, 0 - none
+    unsigned int stubDamage;
+} SIM_CONFIG;
+
+class ErrorSimulatorStopped: public Exception
+{
+public:
+    ErrorSimulatorStopped() throw() :Exception() {str = (QObject::tr("Simulator stopped"));}
+};
+
+//STM32 ROM bootloader on pseudo-terminal master, Comm opens slave device.
+//Or on in-process pipe, Comm opens "pipe:name"
+class Simulator : public QThread
+{
+    Q_OBJECT
+private:
+    SIM_CONFIG config;
+    int master, slave;
+    QString slaveName;
+    //in-process peer instead of pty
+    PipeTransport* pipe;
+    QAtomicInt stopped;
+    QByteArray flash, ram;
+    QVector<SECTOR> sectors;
+    bool synced, protectedFlash, halted;
+    unsigned int pendingRx;
+    unsigned int writes;
+    unsigned int stubFrameSize;
+    unsigned int stubFrames;
+
+    unsigned char rx();
+    void tx(const QByteArray& buf);
+    void txChar(unsigned char c) {tx(QByteArray(1, static_cast<char>(c)));}
+    void ack() {txChar(ISP_ACK);}
+    void nack() {txChar(ISP_NACK);}
+    void delay(unsigned int us);
+    bool rxAddr(unsigned int& addr);
+    char* memory(unsigned int addr, unsigned int size);
+
+    void cmdGet();
+    void cmdGetVersion();
+    void cmdGetID();
+    void cmdReadMemory();
+    void cmdGo();
+    void cmdWriteMemory();
+    void cmdErase();
+    void cmdEraseEx();
+    void cmdReadoutProtect();
+    void cmdReadoutUnProtect();
+    void erasePage(unsigned int page);
+    void massErase();
+    void reset();
+
+    //false if frame is damaged
+    bool stubRx(STUB_FRAME& frame, QByteArray& payload);
+    void stubTx(const STUB_FRAME& req, unsigned char status, const QByteArray& data = QByteArray());
+    unsigned char stubErase(const QByteArray& pages);
+    unsigned char stubWrite(unsigned int addr, const QByteArray& data);
+    //little endian CRC-32 payload
+    QByteArray stubChecksum(unsigned int addr, unsigned int size);
+    //until STUB_EXIT
+    void runStub(unsigned int frameSize);
+protected:
+    void run();
+public:
+    explicit Simulator(const SIM_CONFIG& config, QObject *parent = 0);
+    virtual ~Simulator();
+
+    static SIM_CONFIG defaultConfig();
+    //header only loader image, enough for emulation
+    static QByteArray stubImage(const Device& device);
+    //creates pty pair, returns slave device path
+    QString open();
+    //in-process pipe, returns name for Comm::open
+    QString listen(const QString& name);
+    const QString& getSlaveName() const {return slaveName;}
+    void stop() {stopped.store(1);}
+};
+
+#endif // SIMULATOR_H
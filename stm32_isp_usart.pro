@@ -11,26 +11,10 @@ TEMPLATE = app
 
 
 SOURCES += main.cpp\
-	 mainwindow.cpp \
-    comm.cpp
+	 mainwindow.cpp
 
-HEADERS  += mainwindow.h \
-    comm.h \
-    common.h \
-    config.h \
-    delay.h \
-    error.h \
-    proto.h
+HEADERS  += mainwindow.h
 
 FORMS    += mainwindow.ui
 
-linux*{
-LIBS += -ludev
-DEFINES += HAVE_LIBUDEV
-}
-
-win32*{
-LIBS += -lsetupapi
-}
-
-CONFIG += exceptions
+include(core.pri)
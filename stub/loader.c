@@ -0,0 +1,372 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+//RAM flash loader for STM32F1 family, started by ROM bootloader Go command.
+//USART1 is left configured by bootloader, RX runs to circular DMA buffer,
+//so next frames arrive while current one is programmed.
+
+#include "stubproto.h"
+
+#ifndef FRAME_SIZE
+#define FRAME_SIZE                                  1024
+#endif
+#ifndef WINDOW
+#define WINDOW                                      3
+#endif
+#ifndef SYSTEM_MEMORY
+#define SYSTEM_MEMORY                               0x1ffff000
+#endif
+//power of 2, holds whole window
+#define RING_SIZE                                   4096
+
+#define REG(addr)                                   (*(volatile uint32_t*)(addr))
+
+#define RCC_AHBENR                                  REG(0x40021014)
+#define RCC_AHBENR_DMA1EN                           (1 << 0)
+
+#define USART1_SR                                   REG(0x40013800)
+#define USART1_DR                                   REG(0x40013804)
+#define USART1_CR3                                  REG(0x40013814)
+#define USART_SR_TXE                                (1 << 7)
+#define USART_SR_TC                                 (1 << 6)
+#define USART_CR3_DMAR                              (1 << 6)
+
+//USART1_RX is DMA1 channel 5
+#define DMA1_CCR5                                   REG(0x40020058)
+#define DMA1_CNDTR5                                 REG(0x4002005c)
+#define DMA1_CPAR5                                  REG(0x40020060)
+#define DMA1_CMAR5                                  REG(0x40020064)
+#define DMA_CCR_EN                                  (1 << 0)
+#define DMA_CCR_CIRC                                (1 << 5)
+#define DMA_CCR_MINC                                (1 << 7)
+
+//bank 2 of XL-density at +0x40
+#define FLASH_KEYR(bank)                            REG(0x40022004 + (bank))
+#define FLASH_SR(bank)                              REG(0x4002200c + (bank))
+#define FLASH_CR(bank)                              REG(0x40022010 + (bank))
+#define FLASH_AR(bank)                              REG(0x40022014 + (bank))
+#define FLASH_SR_BSY                                (1 << 0)
+#define FLASH_SR_PGERR                              (1 << 2)
+#define FLASH_SR_WRPRTERR                           (1 << 4)
+#define FLASH_SR_EOP                                (1 << 5)
+#define FLASH_CR_PG                                 (1 << 0)
+#define FLASH_CR_PER                                (1 << 1)
+#define FLASH_CR_STRT                               (1 << 6)
+#define FLASH_CR_LOCK                               (1 << 7)
+#define FLASH_KEY1                                  0x45670123
+#define FLASH_KEY2                                  0xcdef89ab
+#define FLASH_START                                 0x08000000
+#define FLASH_BANK2                                 0x08080000
+#define FLASH_END                                   0x08100000
+
+extern uint32_t _estack;
+void reset_handler(void);
+
+__attribute__((section(".header"), used))
+const STUB_HEADER header = {
+    (uint32_t)&_estack,
+    (uint32_t)reset_handler,
+    STUB_MAGIC,
+    STUB_VERSION,
+    WINDOW,
+    STUB_BASE,
+    FRAME_SIZE,
+    STUB_FEATURE_LZ4 | STUB_FEATURE_CRC
+};
+
+static volatile uint8_t ring[RING_SIZE];
+static unsigned int ringPos;
+static uint8_t frame[sizeof(STUB_FRAME) + FRAME_SIZE + 4] __attribute__((aligned(4)));
+static uint8_t unpacked[FRAME_SIZE];
+
+static const uint32_t crcNibble[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+static uint32_t crc32(const uint8_t* data, unsigned int size, uint32_t crc)
+{
+    crc = ~crc;
+    while (size--)
+    {
+        crc ^= *data++;
+        crc = (crc >> 4) ^ crcNibble[crc & 0xf];
+        crc = (crc >> 4) ^ crcNibble[crc & 0xf];
+    }
+    return ~crc;
+}
+
+static uint8_t rx(void)
+{
+    while (ringPos == ((RING_SIZE - DMA1_CNDTR5) & (RING_SIZE - 1)))
+        ;
+    uint8_t c = ring[ringPos];
+    ringPos = (ringPos + 1) & (RING_SIZE - 1);
+    return c;
+}
+
+static void tx(const uint8_t* data, unsigned int size)
+{
+    while (size--)
+    {
+        while ((USART1_SR & USART_SR_TXE) == 0)
+            ;
+        USART1_DR = *data++;
+    }
+}
+
+static void reply(const STUB_FRAME* req, uint8_t status, const uint8_t* data, uint32_t size)
+{
+    STUB_FRAME res;
+    uint32_t crc;
+    res.sync = STUB_SYNC;
+    res.cmd = req->cmd | STUB_REPLY;
+    res.seq = req->seq;
+    res.status = status;
+    res.addr = req->addr;
+    res.size = size;
+    crc = crc32((const uint8_t*)&res, sizeof(STUB_FRAME), 0);
+    crc = crc32(data, size, crc);
+    tx((const uint8_t*)&res, sizeof(STUB_FRAME));
+    tx(data, size);
+    tx((const uint8_t*)&crc, sizeof(crc));
+}
+
+static unsigned int bankOf(uint32_t addr)
+{
+    return addr >= FLASH_BANK2 ? 0x40 : 0;
+}
+
+static uint8_t flashWait(unsigned int bank)
+{
+    uint32_t sr;
+    while ((sr = FLASH_SR(bank)) & FLASH_SR_BSY)
+        ;
+    FLASH_SR(bank) = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+    return sr & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR) ? STUB_ERROR_FLASH : STUB_OK;
+}
+
+static void flashUnlock(void)
+{
+    FLASH_KEYR(0) = FLASH_KEY1;
+    FLASH_KEYR(0) = FLASH_KEY2;
+    FLASH_KEYR(0x40) = FLASH_KEY1;
+    FLASH_KEYR(0x40) = FLASH_KEY2;
+}
+
+static uint8_t erase(const uint32_t* pages, unsigned int count)
+{
+    uint8_t status = STUB_OK;
+    for (; count && status == STUB_OK; --count, ++pages)
+    {
+        unsigned int bank = bankOf(*pages);
+        if (*pages < FLASH_START || *pages >= FLASH_END)
+            return STUB_ERROR_RANGE;
+        FLASH_CR(bank) = FLASH_CR_PER;
+        FLASH_AR(bank) = *pages;
+        FLASH_CR(bank) = FLASH_CR_PER | FLASH_CR_STRT;
+        status = flashWait(bank);
+        FLASH_CR(bank) = 0;
+    }
+    return status;
+}
+
+static uint8_t write(uint32_t addr, const uint8_t* data, unsigned int size)
+{
+    uint8_t status = STUB_OK;
+    if ((addr & 1) || (size & 1) || addr < FLASH_START || addr + size > FLASH_END)
+        return STUB_ERROR_RANGE;
+    for (; size && status == STUB_OK; size -= 2, addr += 2, data += 2)
+    {
+        uint16_t value = data[0] | (data[1] << 8);
+        //already erased
+        if (value == 0xffff)
+            continue;
+        unsigned int bank = bankOf(addr);
+        FLASH_CR(bank) = FLASH_CR_PG;
+        *(volatile uint16_t*)addr = value;
+        status = flashWait(bank);
+        FLASH_CR(bank) = 0;
+    }
+    return status;
+}
+
+static int lz4Length(const uint8_t** ip, const uint8_t* end, unsigned int len)
+{
+    uint8_t c;
+    if (len != 15)
+        return len;
+    do
+    {
+        if (*ip >= end)
+            return -1;
+        c = *(*ip)++;
+        len += c;
+    } while (c == 255);
+    return len;
+}
+
+//same as host lz4Decompress
+static int lz4Decompress(const uint8_t* ip, unsigned int size, uint8_t* dst, unsigned int dstSize)
+{
+    const uint8_t* end = ip + size;
+    unsigned int op = 0;
+    while (ip < end)
+    {
+        unsigned int token = *ip++;
+        int len = lz4Length(&ip, end, token >> 4);
+        if (len < 0 || len > end - ip || (unsigned int)len > dstSize - op)
+            return -1;
+        for (; len; --len)
+            dst[op++] = *ip++;
+        if (ip == end)
+            break;
+        if (end - ip < 2)
+            return -1;
+        unsigned int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op)
+            return -1;
+        len = lz4Length(&ip, end, token & 0xf);
+        if (len < 0 || (unsigned int)len + 4 > dstSize - op)
+            return -1;
+        for (len += 4; len; --len, ++op)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
+
+static uint8_t writePacked(uint32_t addr, const uint8_t* data, unsigned int size)
+{
+    int len;
+    if (size < 4)
+        return STUB_ERROR_COMMAND;
+    len = lz4Decompress(data + 4, size - 4, unpacked, FRAME_SIZE);
+    if (len < 0 || (uint32_t)len != (data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24)))
+        return STUB_ERROR_COMMAND;
+    return write(addr, unpacked, len);
+}
+
+static uint8_t checksum(const STUB_FRAME* req)
+{
+    uint32_t crc;
+    uint8_t res[4];
+    if (req->addr < FLASH_START || req->addr > FLASH_END || req->size > FLASH_END - req->addr)
+        return STUB_ERROR_RANGE;
+    crc = crc32((const uint8_t*)req->addr, req->size, 0);
+    res[0] = crc;
+    res[1] = crc >> 8;
+    res[2] = crc >> 16;
+    res[3] = crc >> 24;
+    reply(req, STUB_OK, res, 4);
+    return STUB_OK;
+}
+
+static void exitToLoader(void)
+{
+    while ((USART1_SR & USART_SR_TC) == 0)
+        ;
+    USART1_CR3 &= ~USART_CR3_DMAR;
+    DMA1_CCR5 = 0;
+    FLASH_CR(0) = FLASH_CR_LOCK;
+    FLASH_CR(0x40) = FLASH_CR_LOCK;
+    __asm volatile ("msr msp, %0\n bx %1" : : "r" (REG(SYSTEM_MEMORY)), "r" (REG(SYSTEM_MEMORY + 4)));
+}
+
+void reset_handler(void)
+{
+    STUB_FRAME* req = (STUB_FRAME*)frame;
+    uint8_t seq = 0;
+    uint8_t lastStatus = STUB_OK;
+    unsigned int i;
+
+    //no startup code, bss is not cleared
+    ringPos = 0;
+    RCC_AHBENR |= RCC_AHBENR_DMA1EN;
+    DMA1_CCR5 = 0;
+    DMA1_CPAR5 = (uint32_t)&USART1_DR;
+    DMA1_CMAR5 = (uint32_t)ring;
+    DMA1_CNDTR5 = RING_SIZE;
+    DMA1_CCR5 = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_EN;
+    USART1_CR3 |= USART_CR3_DMAR;
+    flashUnlock();
+
+    req->cmd = STUB_HELLO;
+    req->seq = 0;
+    req->addr = STUB_MAGIC;
+    reply(req, STUB_OK, 0, 0);
+
+    for (;;)
+    {
+        uint32_t crc;
+        while ((frame[0] = rx()) != STUB_SYNC)
+            ;
+        for (i = 1; i < sizeof(STUB_FRAME); ++i)
+            frame[i] = rx();
+        //READ and CRC size is requested length, not payload
+        unsigned int payload = req->cmd == STUB_READ || req->cmd == STUB_CRC ? 0 : req->size;
+        if (payload > FRAME_SIZE || (req->cmd == STUB_READ && req->size > FRAME_SIZE))
+            continue;
+        for (i = 0; i < payload + 4; ++i)
+            frame[sizeof(STUB_FRAME) + i] = rx();
+        crc = frame[sizeof(STUB_FRAME) + payload] | (frame[sizeof(STUB_FRAME) + payload + 1] << 8) |
+              (frame[sizeof(STUB_FRAME) + payload + 2] << 16) | ((uint32_t)frame[sizeof(STUB_FRAME) + payload + 3] << 24);
+        if (crc != crc32(frame, sizeof(STUB_FRAME) + payload, 0))
+        {
+            //host goes back to first unanswered request
+            if (req->seq == seq)
+                reply(req, STUB_ERROR_CRC, 0, 0);
+            continue;
+        }
+        if (req->seq == (uint8_t)(seq - 1))
+        {
+            //reply was lost, reads are repeated
+            if (req->cmd == STUB_READ)
+                reply(req, STUB_OK, (const uint8_t*)req->addr, req->size);
+            else if (req->cmd == STUB_CRC && lastStatus == STUB_OK)
+                checksum(req);
+            else
+                reply(req, lastStatus, 0, 0);
+            continue;
+        }
+        if (req->seq != seq)
+            continue;
+        ++seq;
+        switch (req->cmd)
+        {
+        case STUB_ERASE:
+            lastStatus = erase((const uint32_t*)(frame + sizeof(STUB_FRAME)), payload / 4);
+            reply(req, lastStatus, 0, 0);
+            break;
+        case STUB_WRITE:
+            lastStatus = write(req->addr, frame + sizeof(STUB_FRAME), payload);
+            reply(req, lastStatus, 0, 0);
+            break;
+        case STUB_WRITE_LZ4:
+            lastStatus = writePacked(req->addr, frame + sizeof(STUB_FRAME), payload);
+            reply(req, lastStatus, 0, 0);
+            break;
+        case STUB_READ:
+            lastStatus = STUB_OK;
+            reply(req, STUB_OK, (const uint8_t*)req->addr, req->size);
+            break;
+        case STUB_CRC:
+            lastStatus = checksum(req);
+            if (lastStatus != STUB_OK)
+                reply(req, lastStatus, 0, 0);
+            break;
+        case STUB_EXIT:
+            lastStatus = STUB_OK;
+            reply(req, STUB_OK, 0, 0);
+            exitToLoader();
+            break;
+        default:
+            lastStatus = STUB_ERROR_COMMAND;
+            reply(req, lastStatus, 0, 0);
+            break;
+        }
+    }
+}
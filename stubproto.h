@@ -0,0 +1,77 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef STUBPROTO_H
+#define STUBPROTO_H
+
+#include <stdint.h>
+
+//RAM flash loader protocol, shared by host, simulator and stub/ firmware
+
+#pragma pack(push, 1)
+
+#define STUB_MAGIC                                  0x42555453
+#define STUB_VERSION                                2
+
+#define STUB_SYNC                                   0x5a
+//set in cmd of every stub reply
+#define STUB_REPLY                                  0x80
+
+//sent once by stub after start, empty payload
+#define STUB_HELLO                                  0x01
+//payload: uint32_t page addresses
+#define STUB_ERASE                                  0x02
+//payload: data, halfword aligned
+#define STUB_WRITE                                  0x03
+//request size: bytes to read, no payload. Reply payload: data
+#define STUB_READ                                   0x04
+//stub replies, then jumps to ROM bootloader
+#define STUB_EXIT                                   0x05
+//payload: uint32_t unpacked size, LZ4 block. Needs STUB_FEATURE_LZ4
+#define STUB_WRITE_LZ4                              0x06
+//request size: bytes to check, any length, no payload. Reply payload: uint32_t CRC-32.
+//Needs STUB_FEATURE_CRC
+#define STUB_CRC                                    0x07
+
+#define STUB_FEATURE_LZ4                            (1 << 0)
+#define STUB_FEATURE_CRC                            (1 << 1)
+
+#define STUB_OK                                     0x00
+#define STUB_ERROR_CRC                              0x01
+#define STUB_ERROR_RANGE                            0x02
+#define STUB_ERROR_FLASH                            0x03
+#define STUB_ERROR_COMMAND                          0x04
+
+//image start: vector table for ROM Go command, then loader parameters
+typedef struct {
+    uint32_t sp;
+    uint32_t entry;
+    uint32_t magic;
+    uint16_t version;
+    //requests in flight without reply
+    uint16_t window;
+    //link address, image is written and started here
+    uint32_t base;
+    //maximum payload, also unpacked
+    uint32_t frameSize;
+    uint32_t features;
+} STUB_HEADER;
+
+//followed by payload and CRC-32 of frame and payload, little endian.
+//Requests are processed in seq order, others are dropped without reply.
+//Repeated last seq is answered again without processing.
+typedef struct {
+    uint8_t sync;
+    uint8_t cmd;
+    uint8_t seq;
+    uint8_t status;
+    uint32_t addr;
+    uint32_t size;
+} STUB_FRAME;
+
+#pragma pack(pop)
+
+#endif // STUBPROTO_H
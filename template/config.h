@@ -11,11 +11,79 @@
 
 const QString LOG_FILE_NAME("file.log");
 const QString LOG_DATE_FORMAT("dd.MM hh:mm:ss.zzz");
+const QString DEVICES_FILE_NAME("devices.json");
+const QString SETTINGS_FILE_NAME("stm32_isp_usart.ini");
+//RAM flash loader images, next to binary
+const QString STUB_DIR_NAME("stub");
 
 const int ACK_TIMEOUT_COUNT =                                       5000;
+//0x7f resend interval, ms
+const int SYNC_INTERVAL =                                           10;
+//unknown devices are erased by PAGE_SIZE pages from FLASH_BASE
 const int PAGE_SIZE =                                               128;
+//default Read/Write Memory payload, protocol maximum is 256
+const int BLOCK_SIZE =                                              256;
+const int MAX_BLOCK_SIZE =                                          256;
+//page erase time estimate, ms
+const int ERASE_PAGE_TIME =                                         40;
+//pages per erase command, well below protocol limits of both erase commands
+const int ERASE_BATCH_MAX =                                         128;
+//erase command timeout: PORT_DEFAULT_TIMEOUT + pages * (ERASE_PAGE_TIMEOUT + KB per page * ERASE_KB_TIMEOUT), ms
+const int ERASE_PAGE_TIMEOUT =                                      100;
+const int ERASE_KB_TIMEOUT =                                        50;
+//bank and mass erase command timeout, ms
+const int ERASE_MASS_TIMEOUT =                                      60000;
+//erase planner defaults until measured, command round trip included, ms
+const int ERASE_KB_TIME =                                           20;
+const int ERASE_BANK_TIME =                                         1000;
+const int ERASE_MASS_TIME =                                         2000;
+const int RESET_TIME =                                              1000;
+const double TIMING_AVERAGE_WEIGHT =                                0.5;
 const int FLASH_BASE =                                              0x08000000;
 
+//parallel ports in gang mode
+const int GANG_MAX_THREADS =                                        16;
+
+//periodic metrics file dump, ms
+const int METRICS_INTERVAL =                                        5000;
+
+//auto baud candidates, fastest first
+const unsigned int AUTO_BAUD_RATES[] =                              {1000000, 921600, 460800, 230400, 115200, 57600};
+//0x7f attempts per candidate, target was just reset
+const int AUTO_BAUD_SYNC_COUNT =                                    20;
+//read-back test per candidate: blocks of MAX_BLOCK_SIZE
+const int BAUD_PROBE_READS =                                        16;
+//DTR drives NRST, RTS drives BOOT0, both through adapter inverters, ms
+const int RESET_PULSE =                                             20;
+const int BOOT_DELAY =                                              50;
+//resetting command ACK to bootloader sync, per command until measured, ms
+const int RESYNC_BOOT_TIME =                                        100;
+//first 0x7f after this part of measured time
+const double RESYNC_WAIT =                                          0.8;
+//sync deadline: longer of this and 4 * measured time, ms
+const int RESYNC_TIMEOUT =                                          3000;
+
+//USB adapter latency_timer with native Linux serial backend, ms, 0 - driver default
+const int LATENCY_TIMER =                                           1;
+
+//largest frame + checksum: Write Memory payload or Extended Erase page list
+const int TX_BUFFER_SIZE =                                          (1 + MAX_BLOCK_SIZE > 2 + 2 * ERASE_BATCH_MAX ? 1 + MAX_BLOCK_SIZE : 2 + 2 * ERASE_BATCH_MAX) + 1;
+//dump file write buffer, bytes
+const int DUMP_BUFFER_SIZE =                                        64 * 1024;
+//Comm receive buffer, bytes
+const int RX_BUFFER_SIZE =                                          4096;
+
+//verify after whole image is programmed with MAX_BLOCK_SIZE reads, false - read back each block after write
+const bool VERIFY_DEFERRED =                                        true;
+//compare per page CRC of flash loader, read back only mismatching pages
+const bool VERIFY_CHECKSUM =                                        true;
+
+//8E1 frame: start, 8 data, parity, stop
+const int BITS_PER_CHAR =                                           11;
+
+//RAM flash loader HELLO wait after Go, ms
+const int STUB_START_TIMEOUT =                                      500;
+
 const int PORT_DEFAULT_TIMEOUT =                                    5000;
 const int REFRESH_RATE =                                            10;
 const int NRETRY =                                                  3;
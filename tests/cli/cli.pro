@@ -0,0 +1,23 @@
+#-------------------------------------------------
+#
+# Console exit codes and JSON result, simulator over pipe transport
+#
+#-------------------------------------------------
+
+QT       += testlib
+QT       -= gui
+
+TARGET = tst_cli
+TEMPLATE = app
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../../cli
+
+SOURCES += tst_cli.cpp \
+    ../../cli/console.cpp
+
+HEADERS += ../../cli/console.h
+
+include(../../sim/sim.pri)
+include(../../core.pri)
@@ -0,0 +1,110 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include <QtTest>
+#include <QTemporaryDir>
+#include "console.h"
+#include "simulator.h"
+
+class TestCli : public QObject
+{
+    Q_OBJECT
+private:
+    static SIM_CONFIG config();
+    //program name is added
+    static int exec(Console& console, const QStringList& arguments);
+private slots:
+    void usage_data();
+    void usage();
+    void portMissing();
+    void flashProtect();
+};
+
+SIM_CONFIG TestCli::config()
+{
+    SIM_CONFIG config = Simulator::defaultConfig();
+    config.baud = 0;
+    config.eraseTime = config.massEraseTime = config.writeTime = config.resetTime = 0;
+    config.stub = false;
+    return config;
+}
+
+int TestCli::exec(Console &console, const QStringList &arguments)
+{
+    return console.exec(QStringList() << "stm32_isp_cli" << arguments);
+}
+
+void TestCli::usage_data()
+{
+    QTest::addColumn<QStringList>("arguments");
+    QTest::newRow("option") << (QStringList() << "--bogus" << "open");
+    QTest::newRow("command") << (QStringList() << "frob");
+    QTest::newRow("file") << (QStringList() << "flash");
+    QTest::newRow("speed") << (QStringList() << "-b" << "fast" << "open");
+    QTest::newRow("address") << (QStringList() << "-a" << "0x8zz" << "erase");
+    QTest::newRow("block") << (QStringList() << "--block" << "big" << "open");
+    QTest::newRow("jobs") << (QStringList() << "-j" << "-1" << "gang" << "fw.bin");
+}
+
+void TestCli::usage()
+{
+    QFETCH(QStringList, arguments);
+    Console console;
+    QCOMPARE(exec(console, arguments), static_cast<int>(CLI_EXIT_USAGE));
+    QCOMPARE(console.getResult().value("status").toString(), QString("error"));
+    QCOMPARE(console.getResult().value("code").toInt(), static_cast<int>(CLI_EXIT_USAGE));
+    QVERIFY(!console.getResult().value("error").toString().isEmpty());
+}
+
+void TestCli::portMissing()
+{
+    Console console;
+    QCOMPARE(exec(console, QStringList() << "-p" << "pipe:missing" << "open"), static_cast<int>(CLI_EXIT_PORT));
+    QCOMPARE(console.getResult().value("command").toString(), QString("open"));
+    QCOMPARE(console.getResult().value("status").toString(), QString("error"));
+}
+
+void TestCli::flashProtect()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QByteArray image(2000, 0);
+    for (int i = 0; i < image.size(); ++i)
+        image[i] = static_cast<char>(i * 7);
+    QFile file(dir.filePath("fw.bin"));
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write(image);
+    file.close();
+
+    Simulator sim(config());
+    QString name(sim.listen("cli"));
+    sim.start();
+    {
+        Console console;
+        QCOMPARE(exec(console, QStringList() << "-p" << name << "flash" << file.fileName()), static_cast<int>(CLI_EXIT_OK));
+        QCOMPARE(console.getResult().value("status").toString(), QString("ok"));
+        QCOMPARE(console.getResult().value("pid").toString(), QString("0x0410"));
+        QCOMPARE(console.getResult().value("segments").toInt(), 1);
+    }
+    {
+        Console console;
+        QCOMPARE(exec(console, QStringList() << "-p" << name << "verify" << file.fileName()), static_cast<int>(CLI_EXIT_OK));
+    }
+    {
+        Console console;
+        QCOMPARE(exec(console, QStringList() << "-p" << name << "protect"), static_cast<int>(CLI_EXIT_OK));
+    }
+    {
+        Console console;
+        QCOMPARE(exec(console, QStringList() << "-p" << name << "-s" << "400" << "dump" << dir.filePath("dump.bin")),
+                 static_cast<int>(CLI_EXIT_PROTECTED));
+        QCOMPARE(console.getResult().value("code").toInt(), static_cast<int>(CLI_EXIT_PROTECTED));
+    }
+}
+
+QTEST_GUILESS_MAIN(TestCli)
+
+#include "tst_cli.moc"
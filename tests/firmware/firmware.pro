@@ -0,0 +1,17 @@
+#-------------------------------------------------
+#
+# Firmware parsers on fixture files in data/
+#
+#-------------------------------------------------
+
+QT       += testlib
+QT       -= gui
+
+TARGET = tst_firmware
+TEMPLATE = app
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+SOURCES += tst_firmware.cpp
+
+include(../../core.pri)
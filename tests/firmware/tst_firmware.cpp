@@ -0,0 +1,124 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include <QtTest>
+#include "firmware.h"
+
+class TestFirmware : public QObject
+{
+    Q_OBJECT
+private:
+    static void compare(const Firmware& firmware, const QVector<SEGMENT>& expected);
+    static SEGMENT segment(unsigned int addr, const QByteArray& data);
+private slots:
+    void extendedLinear();
+    void extendedSegment();
+    void overlap();
+    void srec();
+    void elf();
+    void badChecksum_data();
+    void badChecksum();
+    void elfOverflow_data();
+    void elfOverflow();
+};
+
+SEGMENT TestFirmware::segment(unsigned int addr, const QByteArray &data)
+{
+    SEGMENT res;
+    res.addr = addr;
+    res.data = data;
+    return res;
+}
+
+void TestFirmware::compare(const Firmware &firmware, const QVector<SEGMENT> &expected)
+{
+    QCOMPARE(firmware.getSegments().size(), expected.size());
+    for (int i = 0; i < expected.size(); ++i)
+    {
+        QCOMPARE(firmware.getSegments().at(i).addr, expected.at(i).addr);
+        QCOMPARE(firmware.getSegments().at(i).data, expected.at(i).data);
+    }
+}
+
+void TestFirmware::extendedLinear()
+{
+    Firmware firmware;
+    firmware.load(QFINDTESTDATA("data/extended_linear.hex"), 0);
+    compare(firmware, QVector<SEGMENT>() << segment(0x08000000, QByteArray("\x01\x02\x03\x04", 4))
+                                         << segment(0x08010010, QByteArray("\x05\x06\x07\x08", 4)));
+}
+
+void TestFirmware::extendedSegment()
+{
+    Firmware firmware;
+    firmware.load(QFINDTESTDATA("data/extended_segment.hex"), 0);
+    compare(firmware, QVector<SEGMENT>() << segment(0x10020, QByteArray("\x0a\x0b\x0c\x0d", 4)));
+}
+
+void TestFirmware::overlap()
+{
+    //later record wins
+    Firmware firmware;
+    firmware.load(QFINDTESTDATA("data/overlap.hex"), 0);
+    compare(firmware, QVector<SEGMENT>() << segment(0x08000000, QByteArray("\x00\x01\x02\x03\xaa\xaa\xaa\xaa", 8)));
+}
+
+void TestFirmware::srec()
+{
+    //S0 and S7 are skipped, S1 and S3 are sorted by address
+    Firmware firmware;
+    firmware.load(QFINDTESTDATA("data/two_records.srec"), 0);
+    compare(firmware, QVector<SEGMENT>() << segment(0x0100, QByteArray("\x09\x0a", 2))
+                                         << segment(0x08000000, QByteArray("\x01\x02\x03\x04\x05\x06\x07\x08", 8)));
+}
+
+void TestFirmware::elf()
+{
+    //.data is placed at LMA, .bss has no file bytes
+    QByteArray text;
+    for (int i = 0; i < 16; ++i)
+        text.append(static_cast<char>(i));
+    Firmware firmware;
+    firmware.load(QFINDTESTDATA("data/two_segments.elf"), 0);
+    compare(firmware, QVector<SEGMENT>() << segment(0x08000000, text)
+                                         << segment(0x08001000, QByteArray(8, 0x55)));
+    QCOMPARE(firmware.start(), 0x08000000u);
+    QCOMPARE(firmware.span(), 0x1008u);
+    QCOMPARE(firmware.size(), 24u);
+}
+
+void TestFirmware::badChecksum_data()
+{
+    QTest::addColumn<QString>("fileName");
+    QTest::newRow("hex") << "data/bad_checksum.hex";
+    QTest::newRow("srec") << "data/bad_checksum.srec";
+}
+
+void TestFirmware::badChecksum()
+{
+    QFETCH(QString, fileName);
+    Firmware firmware;
+    QVERIFY_EXCEPTION_THROWN(firmware.load(QFINDTESTDATA(fileName), 0), ErrorFileCrc);
+}
+
+void TestFirmware::elfOverflow_data()
+{
+    QTest::addColumn<QString>("fileName");
+    //offsets near 4G wrap 32 bit sums back into file
+    QTest::newRow("phoff") << "data/phoff_overflow.elf";
+    QTest::newRow("filesz") << "data/filesz_overflow.elf";
+}
+
+void TestFirmware::elfOverflow()
+{
+    QFETCH(QString, fileName);
+    Firmware firmware;
+    QVERIFY_EXCEPTION_THROWN(firmware.load(QFINDTESTDATA(fileName), 0), ErrorFileFormat);
+}
+
+QTEST_GUILESS_MAIN(TestFirmware)
+
+#include "tst_firmware.moc"
@@ -0,0 +1,18 @@
+#-------------------------------------------------
+#
+# Comm against in-process simulator over pipe transport
+#
+#-------------------------------------------------
+
+QT       += testlib
+QT       -= gui
+
+TARGET = tst_loopback
+TEMPLATE = app
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+SOURCES += tst_loopback.cpp
+
+include(../../sim/sim.pri)
+include(../../core.pri)
@@ -0,0 +1,444 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include <QtTest>
+#include <QTemporaryDir>
+#include "comm.h"
+#include "recipe.h"
+#include "simulator.h"
+#include "transport.h"
+#include "config.h"
+
+class TestLoopback : public QObject
+{
+    Q_OBJECT
+private:
+    static SIM_CONFIG config();
+    static QByteArray pattern(int size);
+    static QByteArray readBack(Comm& comm, unsigned int addr, unsigned int size);
+private slots:
+    void init();
+    void listenDuplicate();
+    void flashBootloader();
+    void erasePages_data();
+    void erasePages();
+    void erasePlanBank();
+    void erasePlanMass();
+    void resyncUnprotect();
+    void resyncFailed();
+    void flashDiff();
+    void verifyRepair();
+    void verifyEachFails();
+    void flashStub();
+    void stubRetransmit();
+    void stubNoStartReset();
+    void stubNoStart();
+    void segmentGap();
+    void recipe();
+};
+
+SIM_CONFIG TestLoopback::config()
+{
+    SIM_CONFIG config = Simulator::defaultConfig();
+    //no wire and flash time, test runs at memory speed
+    config.baud = 0;
+    config.eraseTime = config.massEraseTime = config.writeTime = config.resetTime = 0;
+    config.stub = false;
+    return config;
+}
+
+QByteArray TestLoopback::pattern(int size)
+{
+    QByteArray res(size, 0);
+    unsigned int x = 0x12345678;
+    for (int i = 0; i < size; ++i)
+    {
+        x = x * 1103515245 + 12345;
+        res[i] = static_cast<char>(x >> 16);
+    }
+    return res;
+}
+
+QByteArray TestLoopback::readBack(Comm &comm, unsigned int addr, unsigned int size)
+{
+    QByteArray res;
+    for (unsigned int pos = 0; pos < size; pos += MAX_BLOCK_SIZE)
+        res.append(comm.cmdReadMemory(addr + pos, qMin<unsigned int>(MAX_BLOCK_SIZE, size - pos)));
+    return res;
+}
+
+void TestLoopback::init()
+{
+    //measured erase and reset timings of previous test
+    QSettings settings(SETTINGS_FILE_NAME, QSettings::IniFormat);
+    settings.clear();
+}
+
+void TestLoopback::listenDuplicate()
+{
+    PipeTransport* peer = PipeTransport::listen("duplicate");
+    QVERIFY(peer);
+    QVERIFY(!PipeTransport::listen("duplicate"));
+    //name is free again once peer is gone
+    delete peer;
+    peer = PipeTransport::listen("duplicate");
+    QVERIFY(peer);
+    delete peer;
+}
+
+void TestLoopback::flashBootloader()
+{
+    Simulator sim(config());
+    QString name(sim.listen("bootloader"));
+    sim.start();
+    Comm comm;
+    comm.open(name, 115200);
+    QCOMPARE(static_cast<int>(comm.getDevice().pid), 0x410);
+    QByteArray image(pattern(5000));
+    comm.eraseAuto(FLASH_BASE, image.size(), false);
+    comm.flash(image, FLASH_BASE);
+    QCOMPARE(readBack(comm, FLASH_BASE, image.size()), image);
+    comm.close();
+}
+
+void TestLoopback::erasePages_data()
+{
+    QTest::addColumn<bool>("extended");
+    QTest::newRow("legacy") << false;
+    QTest::newRow("extended") << true;
+}
+
+void TestLoopback::erasePages()
+{
+    QFETCH(bool, extended);
+    SIM_CONFIG cfg(config());
+    cfg.extendedErase = extended;
+    cfg.version = extended ? 0x31 : 0x22;
+    Simulator sim(cfg);
+    QString name(sim.listen(extended ? "eraseEx" : "erase"));
+    sim.start();
+    Comm comm;
+    comm.open(name, 115200);
+    QCOMPARE(comm.isExtendedErase(), extended);
+    QByteArray image(pattern(4096));
+    comm.eraseAuto(FLASH_BASE, image.size(), false);
+    comm.flash(image, FLASH_BASE);
+    QByteArray tail(pattern(1024));
+    comm.eraseAuto(FLASH_BASE + 64 * 1024, tail.size(), false);
+    comm.flash(tail, FLASH_BASE + 64 * 1024);
+
+    unsigned char cmd = extended ? ISP_ERASE_MEMORY_EX : ISP_ERASE_MEMORY;
+    unsigned int count = comm.getMetrics().commands.value(cmd).count;
+    //64 pages in one request
+    comm.erase(FLASH_BASE, 64 * 1024);
+    QCOMPARE(comm.getMetrics().commands.value(cmd).count, count + 1);
+    QCOMPARE(readBack(comm, FLASH_BASE, image.size()), QByteArray(image.size(), static_cast<char>(0xff)));
+    QCOMPARE(readBack(comm, FLASH_BASE + 64 * 1024, tail.size()), tail);
+
+    //page number out of command range, nothing is sent
+    quint64 tx = comm.getMetrics().txBytes;
+    if (extended)
+        QVERIFY_EXCEPTION_THROWN(comm.cmdEraseMemoryEx(QVector<unsigned int>() << 0 << 0xfff0), ErrorDeviceRange);
+    else
+        QVERIFY_EXCEPTION_THROWN(comm.cmdEraseMemory(QVector<unsigned int>() << 0 << 0x100), ErrorDeviceRange);
+    QCOMPARE(comm.getMetrics().txBytes, tx);
+    QCOMPARE(static_cast<int>(comm.cmdGetID()), 0x410);
+    comm.close();
+}
+
+void TestLoopback::erasePlanBank()
+{
+    SIM_CONFIG cfg(config());
+    DeviceDatabase devices;
+    devices.loadBuiltin();
+    cfg.device = devices.find(0x430);
+    cfg.device.pid = 0x430;
+    cfg.extendedErase = true;
+    cfg.version = 0x31;
+    Simulator sim(cfg);
+    QString name(sim.listen("bank"));
+    sim.start();
+    Comm comm;
+    comm.open(name, 115200);
+    unsigned int bankSize = cfg.device.flashSize / 2;
+
+    //default timings: few pages, whole banks
+    QCOMPARE(comm.eraseAuto(FLASH_BASE, 4096, true, true).method, ERASE_METHOD_PAGES);
+    ERASE_PLAN plan(comm.eraseAuto(FLASH_BASE, cfg.device.flashSize, true, true));
+    QCOMPARE(plan.method, ERASE_METHOD_BANK);
+    QCOMPARE(plan.banks.size(), 2);
+
+    //blank flash, no erase needed
+    QByteArray image(pattern(2048));
+    comm.flash(image, FLASH_BASE);
+    comm.flash(image, FLASH_BASE + bankSize);
+    plan = comm.eraseAuto(FLASH_BASE + bankSize, 200 * 1024, true);
+    QCOMPARE(plan.method, ERASE_METHOD_BANK);
+    QCOMPARE(plan.banks, QVector<unsigned int>() << ISP_ERASE_BANK2);
+    QCOMPARE(readBack(comm, FLASH_BASE, image.size()), image);
+    QCOMPARE(readBack(comm, FLASH_BASE + bankSize, image.size()), QByteArray(image.size(), static_cast<char>(0xff)));
+    comm.close();
+}
+
+void TestLoopback::erasePlanMass()
+{
+    {
+        //slow pages, mass erase with reset is cheaper for whole flash
+        QSettings settings(SETTINGS_FILE_NAME, QSettings::IniFormat);
+        settings.setValue("erase_0410/kb", 100);
+    }
+    Simulator sim(config());
+    QString name(sim.listen("mass"));
+    sim.start();
+    Comm comm;
+    comm.open(name, 115200);
+    QByteArray image(pattern(4096));
+    comm.flash(image, FLASH_BASE);
+    ERASE_PLAN plan(comm.eraseAuto(FLASH_BASE, 128 * 1024, true));
+    QCOMPARE(plan.method, ERASE_METHOD_MASS);
+    QVERIFY(plan.reset);
+    //resynced after device reset
+    QVERIFY(comm.isActive());
+    QCOMPARE(readBack(comm, FLASH_BASE, image.size()), QByteArray(image.size(), static_cast<char>(0xff)));
+    comm.flash(image, FLASH_BASE);
+    QCOMPARE(readBack(comm, FLASH_BASE, image.size()), image);
+    comm.close();
+}
+
+void TestLoopback::resyncUnprotect()
+{
+    SIM_CONFIG cfg(config());
+    cfg.readProtected = true;
+    Simulator sim(cfg);
+    QString name(sim.listen("unprotect"));
+    sim.start();
+    Comm comm;
+    comm.open(name, 115200);
+    QVERIFY_EXCEPTION_THROWN(comm.cmdReadMemory(FLASH_BASE, 4), ErrorProtocol);
+    comm.cmdReadoutUnProtect();
+    //same session after device reset
+    QVERIFY(comm.isActive());
+    QCOMPARE(static_cast<int>(comm.getDevice().pid), 0x410);
+    QCOMPARE(readBack(comm, FLASH_BASE, 1024), QByteArray(1024, static_cast<char>(0xff)));
+    comm.close();
+}
+
+void TestLoopback::resyncFailed()
+{
+    SIM_CONFIG cfg(config());
+    cfg.resetHang = true;
+    Simulator sim(cfg);
+    QString name(sim.listen("resyncFailed"));
+    sim.start();
+    Comm comm;
+    comm.open(name, 115200);
+    //erase is done, but device doesn't answer after reset
+    QVERIFY_EXCEPTION_THROWN(comm.cmdEraseMemory(ISP_MASS_ERASE, ERASE_MASS_TIMEOUT), ErrorProtocolResync);
+    QVERIFY(!comm.isActive());
+}
+
+void TestLoopback::flashDiff()
+{
+    Simulator sim(config());
+    QString name(sim.listen("diff"));
+    sim.start();
+    Comm comm;
+    comm.open(name, 115200);
+    QByteArray image(pattern(8 * 1024));
+    comm.flash(image, FLASH_BASE);
+
+    //one changed page, one page on blank flash, the rest as is
+    QByteArray changed(image + QByteArray(1024, static_cast<char>(0x5a)));
+    changed[3 * 1024 + 10] = static_cast<char>(~changed.at(3 * 1024 + 10));
+    COMM_METRICS before(comm.getMetrics());
+    comm.flashDiff(changed, FLASH_BASE);
+    COMM_METRICS after(comm.getMetrics());
+    QCOMPARE(after.commands.value(ISP_ERASE_MEMORY).count - before.commands.value(ISP_ERASE_MEMORY).count, 1u);
+    QCOMPARE(after.commands.value(ISP_WRITE_MEMORY).count - before.commands.value(ISP_WRITE_MEMORY).count, 2u * 1024 / BLOCK_SIZE);
+    QCOMPARE(readBack(comm, FLASH_BASE, changed.size()), changed);
+    comm.close();
+}
+
+void TestLoopback::verifyRepair()
+{
+    SIM_CONFIG cfg(config());
+    //block in second page is lost
+    cfg.writeDamage = 6;
+    Simulator sim(cfg);
+    QString name(sim.listen("repair"));
+    sim.start();
+    Comm comm;
+    comm.open(name, 115200);
+    QVERIFY(comm.isDeferredVerify());
+    QByteArray image(pattern(4096));
+    comm.flash(image, FLASH_BASE);
+    COMM_METRICS metrics(comm.getMetrics());
+    //only damaged page is erased and rewritten
+    QCOMPARE(metrics.commands.value(ISP_ERASE_MEMORY).count, 1u);
+    QCOMPARE(metrics.commands.value(ISP_WRITE_MEMORY).count, (4096u + 1024) / BLOCK_SIZE);
+    QCOMPARE(metrics.verifyBytes, static_cast<quint64>(image.size()));
+    QCOMPARE(readBack(comm, FLASH_BASE, image.size()), image);
+    comm.close();
+}
+
+void TestLoopback::verifyEachFails()
+{
+    SIM_CONFIG cfg(config());
+    cfg.writeDamage = 2;
+    Simulator sim(cfg);
+    QString name(sim.listen("verifyEach"));
+    sim.start();
+    Comm comm;
+    comm.open(name, 115200);
+    comm.setDeferredVerify(false);
+    //read back retries are limited, block isn't rewritten
+    QVERIFY_EXCEPTION_THROWN(comm.flash(pattern(1024), FLASH_BASE), ErrorProtocolVerify);
+    QCOMPARE(comm.getRetries(), static_cast<unsigned int>(NRETRY));
+}
+
+void TestLoopback::flashStub()
+{
+    SIM_CONFIG cfg(config());
+    cfg.stub = true;
+    Simulator sim(cfg);
+    QString name(sim.listen("stub"));
+    sim.start();
+    Comm comm;
+    comm.setStubEnabled(true);
+    comm.setStubImage(Simulator::stubImage(cfg.device));
+    comm.open(name, 115200);
+    QVERIFY(comm.isStubActive());
+    QByteArray image(pattern(3000) + QByteArray(3000, static_cast<char>(0x55)));
+    comm.eraseAuto(FLASH_BASE, image.size(), false);
+    comm.flash(image, FLASH_BASE);
+    comm.verify(image, FLASH_BASE);
+    comm.close();
+}
+
+void TestLoopback::stubRetransmit()
+{
+    SIM_CONFIG cfg(config());
+    cfg.stub = true;
+    //write in the middle of the window
+    cfg.stubDamage = 4;
+    Simulator sim(cfg);
+    QString name(sim.listen("retransmit"));
+    sim.start();
+    Comm comm;
+    comm.setStubEnabled(true);
+    comm.setStubImage(Simulator::stubImage(cfg.device));
+    comm.open(name, 115200);
+    QVERIFY(comm.isStubActive());
+    QByteArray image(pattern(8000));
+    comm.eraseAuto(FLASH_BASE, image.size(), false);
+    comm.flash(image, FLASH_BASE);
+    QVERIFY(comm.getRetries() > 0);
+    comm.verify(image, FLASH_BASE);
+    comm.close();
+}
+
+void TestLoopback::stubNoStartReset()
+{
+    //Go leaves bootloader, but loader doesn't answer
+    Simulator sim(config());
+    QString name(sim.listen("noStartReset"));
+    sim.start();
+    Comm comm;
+    comm.setStubEnabled(true);
+    comm.setStubImage(Simulator::stubImage(config().device));
+    comm.setResetLines(true);
+    comm.open(name, 115200);
+    QVERIFY(!comm.isStubActive());
+    QByteArray image(pattern(2000));
+    comm.eraseAuto(FLASH_BASE, image.size(), false);
+    comm.flash(image, FLASH_BASE);
+    QCOMPARE(readBack(comm, FLASH_BASE, image.size()), image);
+    comm.close();
+}
+
+void TestLoopback::stubNoStart()
+{
+    Simulator sim(config());
+    QString name(sim.listen("noStart"));
+    sim.start();
+    Comm comm;
+    comm.setStubEnabled(true);
+    comm.setStubImage(Simulator::stubImage(config().device));
+    QVERIFY_EXCEPTION_THROWN(comm.open(name, 115200), ErrorProtocolStubStart);
+    QVERIFY(!comm.isActive());
+}
+
+void TestLoopback::segmentGap()
+{
+    Simulator sim(config());
+    QString name(sim.listen("gap"));
+    sim.start();
+    Comm comm;
+    comm.open(name, 115200);
+    //two segments in one page, gap is left erased
+    QVector<SEGMENT> segments;
+    SEGMENT segment;
+    segment.addr = FLASH_BASE;
+    segment.data = pattern(100);
+    segments.append(segment);
+    segment.addr = FLASH_BASE + 512;
+    segment.data = pattern(200);
+    segments.append(segment);
+    comm.eraseAuto(segments, false);
+    comm.flash(segments);
+    QByteArray page(readBack(comm, FLASH_BASE, 1024));
+    QCOMPARE(page.left(100), segments.at(0).data);
+    QCOMPARE(page.mid(100, 412), QByteArray(412, static_cast<char>(0xff)));
+    QCOMPARE(page.mid(512, 200), segments.at(1).data);
+    comm.close();
+}
+
+void TestLoopback::recipe()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QByteArray image(pattern(3000));
+    QFile file(dir.filePath("fw.bin"));
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write(image);
+    file.close();
+
+    Recipe recipe;
+    file.setFileName(dir.filePath("bad.json"));
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write("{\"steps\": [{\"op\": \"flash\"}]}");
+    file.close();
+    //flash without file
+    QVERIFY_EXCEPTION_THROWN(recipe.load(file.fileName()), ErrorRecipe);
+
+    file.setFileName(dir.filePath("job.json"));
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write("{\"steps\": [{\"op\": \"unprotect\"}, {\"op\": \"mass_erase\"},\n"
+               "  {\"op\": \"flash\", \"file\": \"fw.bin\", \"erase\": false}, {\"op\": \"verify\", \"file\": \"fw.bin\"},\n"
+               "  {\"op\": \"dump\", \"file\": \"dump.bin\", \"address\": \"0x08000000\", \"size\": 3000}]}");
+    file.close();
+    recipe.load(file.fileName());
+    QCOMPARE(recipe.getSteps().size(), 5);
+
+    //unprotect and mass erase reset device, one session for all steps
+    SIM_CONFIG cfg(config());
+    cfg.readProtected = true;
+    Simulator sim(cfg);
+    QString name(sim.listen("recipe"));
+    sim.start();
+    Comm comm;
+    comm.open(name, 115200);
+    recipe.run(&comm);
+    //started by Go
+    QVERIFY(!comm.isActive());
+    file.setFileName(dir.filePath("dump.bin"));
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.readAll(), image);
+}
+
+QTEST_GUILESS_MAIN(TestLoopback)
+
+#include "tst_loopback.moc"
@@ -0,0 +1,20 @@
+#-------------------------------------------------
+#
+# LZ4 block codec round trip and malformed input
+#
+#-------------------------------------------------
+
+QT       += testlib
+QT       -= gui
+
+TARGET = tst_lz4
+TEMPLATE = app
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../..
+
+SOURCES += tst_lz4.cpp \
+    ../../lz4.cpp
+
+HEADERS  += ../../lz4.h
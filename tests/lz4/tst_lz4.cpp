@@ -0,0 +1,121 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include <QtTest>
+#include "lz4.h"
+
+#define FRAME_SIZE                                  1024
+
+class TestLz4 : public QObject
+{
+    Q_OBJECT
+private:
+    static QByteArray random(int size, unsigned int seed);
+    //-1 on malformed input
+    static int decompress(const QByteArray& src, int dstSize);
+private slots:
+    void roundTrip_data();
+    void roundTrip();
+    void noFit();
+    void malformed_data();
+    void malformed();
+    void garbage();
+};
+
+QByteArray TestLz4::random(int size, unsigned int seed)
+{
+    QByteArray res(size, 0);
+    for (int i = 0; i < size; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        res[i] = static_cast<char>(seed >> 16);
+    }
+    return res;
+}
+
+int TestLz4::decompress(const QByteArray &src, int dstSize)
+{
+    QByteArray dst(dstSize, 0);
+    return lz4Decompress(src.constData(), src.size(), dst.data(), dst.size());
+}
+
+void TestLz4::roundTrip_data()
+{
+    QTest::addColumn<QByteArray>("frame");
+    QTest::newRow("blank") << QByteArray(FRAME_SIZE, static_cast<char>(0xff));
+    QTest::newRow("random") << random(FRAME_SIZE, 1);
+    QTest::newRow("repetitive") << QByteArray("\x00\x20\x00\x08\x41\x01\x00\x08", 8).repeated(FRAME_SIZE / 8);
+    QTest::newRow("mixed") << random(FRAME_SIZE / 2, 2) + QByteArray(FRAME_SIZE / 2, 0);
+    QTest::newRow("short") << QByteArray("abc");
+    QTest::newRow("empty") << QByteArray();
+}
+
+void TestLz4::roundTrip()
+{
+    QFETCH(QByteArray, frame);
+    //worst case: literals only
+    QByteArray packed(frame.size() + frame.size() / 255 + 16, 0);
+    int size = lz4Compress(frame.constData(), frame.size(), packed.data(), packed.size());
+    QVERIFY(size > 0);
+    packed.resize(size);
+    QByteArray unpacked(frame.size(), 0);
+    QCOMPARE(lz4Decompress(packed.constData(), packed.size(), unpacked.data(), unpacked.size()), frame.size());
+    QCOMPARE(unpacked, frame);
+}
+
+void TestLz4::noFit()
+{
+    QByteArray frame(random(FRAME_SIZE, 3));
+    QByteArray packed(FRAME_SIZE, 0);
+    //incompressible frame is sent raw
+    QCOMPARE(lz4Compress(frame.constData(), frame.size(), packed.data(), packed.size()), 0);
+    QByteArray blank(FRAME_SIZE, static_cast<char>(0xff));
+    QVERIFY(lz4Compress(blank.constData(), blank.size(), packed.data(), packed.size()) < FRAME_SIZE / 16);
+}
+
+void TestLz4::malformed_data()
+{
+    QTest::addColumn<QByteArray>("src");
+    QTest::addColumn<int>("dstSize");
+    //token 0x50: 5 literals, only 2 follow
+    QTest::newRow("short literals") << QByteArray("\x50" "ab", 3) << 16;
+    //15 literals, length continuation missing
+    QTest::newRow("short length") << QByteArray("\xf0", 1) << 64;
+    //1 literal, then half of offset
+    QTest::newRow("short offset") << QByteArray("\x10" "a" "\x01", 3) << 16;
+    QTest::newRow("zero offset") << QByteArray("\x10" "a" "\x00\x00", 4) << 16;
+    QTest::newRow("offset before start") << QByteArray("\x10" "a" "\x02\x00", 4) << 16;
+    //match length continuation missing
+    QTest::newRow("short match length") << QByteArray("\x1f" "a" "\x01\x00", 4) << 64;
+    //literals overrun output
+    QTest::newRow("literal overrun") << QByteArray("\x40" "abcd", 5) << 3;
+    //4 + 15 byte match into 16 byte output
+    QTest::newRow("match overrun") << QByteArray("\x1f" "a" "\x01\x00\x00", 5) << 16;
+}
+
+void TestLz4::malformed()
+{
+    QFETCH(QByteArray, src);
+    QFETCH(int, dstSize);
+    QCOMPARE(decompress(src, dstSize), -1);
+}
+
+void TestLz4::garbage()
+{
+    //must not crash or write past output
+    for (unsigned int seed = 0; seed < 1000; ++seed)
+    {
+        QByteArray src(random(1 + seed % 64, seed));
+        QByteArray dst(FRAME_SIZE + 4, static_cast<char>(0xa5));
+        int size = lz4Decompress(src.constData(), src.size(), dst.data(), FRAME_SIZE);
+        QVERIFY(size >= -1 && size <= FRAME_SIZE);
+        QCOMPARE(dst.right(4), QByteArray(4, static_cast<char>(0xa5)));
+    }
+}
+
+QTEST_APPLESS_MAIN(TestLz4)
+
+#include "tst_lz4.moc"
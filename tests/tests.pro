@@ -0,0 +1,12 @@
+#-------------------------------------------------
+#
+# Host unit tests: qmake && make check
+#
+#-------------------------------------------------
+
+TEMPLATE = subdirs
+
+SUBDIRS += cli \
+    firmware \
+    loopback \
+    lz4
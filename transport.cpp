@@ -0,0 +1,264 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "transport.h"
+#include "config.h"
+#include <QtSerialPort/QSerialPort>
+#include <QTcpSocket>
+#include <QMap>
+#include <QPair>
+#include <QElapsedTimer>
+#ifdef HAVE_TERMIOS2
+#include "linuxserial.h"
+#endif
+
+#define TCP_PREFIX                                  "tcp:"
+#define PIPE_PREFIX                                 "pipe:"
+
+Transport* Transport::create(const QString &name, QObject *parent)
+{
+    if (name.startsWith(TCP_PREFIX))
+        return new TcpTransport(parent);
+    if (name.startsWith(PIPE_PREFIX))
+        return new PipeTransport(parent);
+    return new SerialTransport(parent);
+}
+
+SerialTransport::SerialTransport(QObject *parent) :
+    Transport(parent)
+{
+    port = new SerialPort(this);
+}
+
+SerialTransport::~SerialTransport()
+{
+    delete port;
+}
+
+bool SerialTransport::open(const QString &name, unsigned int speed)
+{
+    port->close();
+    port->setPortName(name);
+    if (!port->open(QIODevice::ReadWrite))
+        return false;
+    port->setBaudRate(speed);
+    port->setDataBits(QSerialPort::Data8);
+    port->setStopBits(QSerialPort::OneStop);
+    port->setParity(QSerialPort::EvenParity);
+    port->setFlowControl(QSerialPort::NoFlowControl);
+#ifdef HAVE_TERMIOS2
+    //not fatal, usually needs udev rule
+    if (LATENCY_TIMER)
+        port->setLatencyTimer(LATENCY_TIMER);
+#endif
+    return true;
+}
+
+void SerialTransport::close()
+{
+    port->close();
+}
+
+bool SerialTransport::isOpen() const
+{
+    return port->isOpen();
+}
+
+bool SerialTransport::write(const char *data, int size)
+{
+    return port->write(data, size) == size;
+}
+
+int SerialTransport::read(char *data, int maxSize, int timeout)
+{
+    if (!port->bytesAvailable() && !port->waitForReadyRead(timeout))
+        return 0;
+    qint64 res = port->read(data, maxSize);
+    return res > 0 ? static_cast<int>(res) : 0;
+}
+
+void SerialTransport::clear()
+{
+    port->clear();
+}
+
+bool SerialTransport::setDataTerminalReady(bool set)
+{
+    return port->setDataTerminalReady(set);
+}
+
+bool SerialTransport::setRequestToSend(bool set)
+{
+    return port->setRequestToSend(set);
+}
+
+TcpTransport::TcpTransport(QObject *parent) :
+    Transport(parent)
+{
+    socket = new QTcpSocket(this);
+}
+
+TcpTransport::~TcpTransport()
+{
+    delete socket;
+}
+
+bool TcpTransport::open(const QString &name, unsigned int speed)
+{
+    Q_UNUSED(speed);
+    close();
+    //tcp:host:port
+    QString addr(name.mid(QString(TCP_PREFIX).size()));
+    int pos = addr.lastIndexOf(':');
+    if (pos <= 0)
+        return false;
+    socket->connectToHost(addr.left(pos), addr.mid(pos + 1).toUShort());
+    if (!socket->waitForConnected(PORT_DEFAULT_TIMEOUT))
+        return false;
+    //no Nagle delay on single byte requests
+    socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    return true;
+}
+
+void TcpTransport::close()
+{
+    if (socket->state() == QAbstractSocket::ConnectedState)
+    {
+        send();
+        socket->disconnectFromHost();
+        if (socket->state() != QAbstractSocket::UnconnectedState)
+            socket->waitForDisconnected(PORT_DEFAULT_TIMEOUT);
+    }
+    socket->abort();
+    txBuf.clear();
+}
+
+bool TcpTransport::isOpen() const
+{
+    return socket->state() == QAbstractSocket::ConnectedState;
+}
+
+bool TcpTransport::send()
+{
+    if (txBuf.isEmpty())
+        return true;
+    bool res = socket->write(txBuf) == txBuf.size();
+    txBuf.clear();
+    while (res && socket->bytesToWrite())
+        res = socket->waitForBytesWritten(PORT_DEFAULT_TIMEOUT);
+    return res;
+}
+
+bool TcpTransport::write(const char *data, int size)
+{
+    txBuf.append(data, size);
+    return isOpen();
+}
+
+int TcpTransport::read(char *data, int maxSize, int timeout)
+{
+    //request is complete once response is awaited
+    if (!send())
+        return 0;
+    if (!socket->bytesAvailable() && !socket->waitForReadyRead(timeout))
+        return 0;
+    qint64 res = socket->read(data, maxSize);
+    return res > 0 ? static_cast<int>(res) : 0;
+}
+
+void TcpTransport::clear()
+{
+    socket->readAll();
+}
+
+typedef QPair<QSharedPointer<PIPE_CHANNEL>, QSharedPointer<PIPE_CHANNEL> > PIPE;
+
+static QMutex pipesMutex;
+static QMap<QString, PIPE> pipes;
+
+PipeTransport::PipeTransport(QObject *parent) :
+    Transport(parent),
+    connected(false)
+{
+}
+
+PipeTransport::~PipeTransport()
+{
+    if (listenName.isEmpty())
+        return;
+    QMutexLocker locker(&pipesMutex);
+    pipes.remove(listenName);
+}
+
+PipeTransport* PipeTransport::listen(const QString &name, QObject *parent)
+{
+    PIPE pipe(QSharedPointer<PIPE_CHANNEL>(new PIPE_CHANNEL), QSharedPointer<PIPE_CHANNEL>(new PIPE_CHANNEL));
+    QMutexLocker locker(&pipesMutex);
+    if (pipes.contains(name))
+        return 0;
+    pipes.insert(name, pipe);
+    PipeTransport* peer = new PipeTransport(parent);
+    peer->in = pipe.first;
+    peer->out = pipe.second;
+    peer->connected = true;
+    peer->listenName = name;
+    return peer;
+}
+
+bool PipeTransport::open(const QString &name, unsigned int speed)
+{
+    Q_UNUSED(speed);
+    QMutexLocker locker(&pipesMutex);
+    QMap<QString, PIPE>::const_iterator i = pipes.constFind(name.mid(QString(PIPE_PREFIX).size()));
+    if (i == pipes.constEnd())
+        return false;
+    in = i.value().second;
+    out = i.value().first;
+    connected = true;
+    return true;
+}
+
+void PipeTransport::close()
+{
+    connected = false;
+}
+
+bool PipeTransport::write(const char *data, int size)
+{
+    if (!connected)
+        return false;
+    QMutexLocker locker(&out->mutex);
+    out->data.append(data, size);
+    out->ready.wakeAll();
+    return true;
+}
+
+int PipeTransport::read(char *data, int maxSize, int timeout)
+{
+    if (!connected)
+        return 0;
+    QMutexLocker locker(&in->mutex);
+    QElapsedTimer timer;
+    timer.start();
+    while (in->data.isEmpty())
+    {
+        qint64 left = timeout - timer.elapsed();
+        if (left <= 0 || !in->ready.wait(&in->mutex, left))
+            return 0;
+    }
+    int size = qMin(maxSize, in->data.size());
+    memcpy(data, in->data.constData(), size);
+    in->data.remove(0, size);
+    return size;
+}
+
+void PipeTransport::clear()
+{
+    if (!connected)
+        return;
+    QMutexLocker locker(&in->mutex);
+    in->data.clear();
+}
@@ -0,0 +1,123 @@
+/*
+    USB DFU Flasher PC part (cross-platform)
+    Copyright (c) 2014, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QSharedPointer>
+
+#ifdef HAVE_TERMIOS2
+class LinuxSerial;
+typedef LinuxSerial SerialPort;
+#else
+class QSerialPort;
+typedef QSerialPort SerialPort;
+#endif
+class QTcpSocket;
+
+//byte stream to bootloader. Called per frame/read chunk, never per byte:
+//Comm keeps own rx buffer
+class Transport : public QObject
+{
+    Q_OBJECT
+public:
+    explicit Transport(QObject* parent = 0) : QObject(parent) {}
+    virtual ~Transport() {}
+
+    //"tcp:host:port", "pipe:name", otherwise serial port name
+    static Transport* create(const QString& name, QObject* parent = 0);
+
+    virtual bool open(const QString& name, unsigned int speed) = 0;
+    virtual void close() = 0;
+    virtual bool isOpen() const = 0;
+    //whole frame, returns false on error
+    virtual bool write(const char* data, int size) = 0;
+    //waits up to timeout for first byte, returns available bytes, 0 on timeout
+    virtual int read(char* data, int maxSize, int timeout) = 0;
+    //drop unread input
+    virtual void clear() = 0;
+    //modem lines, serial only
+    virtual bool setDataTerminalReady(bool set) {Q_UNUSED(set); return false;}
+    virtual bool setRequestToSend(bool set) {Q_UNUSED(set); return false;}
+};
+
+class SerialTransport : public Transport
+{
+    Q_OBJECT
+private:
+    SerialPort* port;
+public:
+    explicit SerialTransport(QObject* parent = 0);
+    virtual ~SerialTransport();
+
+    bool open(const QString& name, unsigned int speed);
+    void close();
+    bool isOpen() const;
+    bool write(const char* data, int size);
+    int read(char* data, int maxSize, int timeout);
+    void clear();
+    bool setDataTerminalReady(bool set);
+    bool setRequestToSend(bool set);
+};
+
+//ser2net-style raw TCP to UART bridge, baud rate is set on bridge side
+class TcpTransport : public Transport
+{
+    Q_OBJECT
+private:
+    QTcpSocket* socket;
+    //coalesced until next read, one segment per request
+    QByteArray txBuf;
+    bool send();
+public:
+    explicit TcpTransport(QObject* parent = 0);
+    virtual ~TcpTransport();
+
+    bool open(const QString& name, unsigned int speed);
+    void close();
+    bool isOpen() const;
+    bool write(const char* data, int size);
+    int read(char* data, int maxSize, int timeout);
+    void clear();
+};
+
+typedef struct {
+    QMutex mutex;
+    QWaitCondition ready;
+    QByteArray data;
+} PIPE_CHANNEL;
+
+//in-process loopback. Peer side is created by listen(name) and served by
+//test code or simulator in other thread
+class PipeTransport : public Transport
+{
+    Q_OBJECT
+private:
+    QSharedPointer<PIPE_CHANNEL> in, out;
+    bool connected;
+    //registered by listen(), released on destruction
+    QString listenName;
+public:
+    explicit PipeTransport(QObject* parent = 0);
+    virtual ~PipeTransport();
+
+    //peer end, Comm side is opened as "pipe:name". 0 if name is taken
+    static PipeTransport* listen(const QString& name, QObject* parent = 0);
+
+    bool open(const QString& name, unsigned int speed);
+    void close();
+    bool isOpen() const {return connected;}
+    bool write(const char* data, int size);
+    int read(char* data, int maxSize, int timeout);
+    void clear();
+};
+
+#endif // TRANSPORT_H